@@ -0,0 +1,175 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the outgoing message preparation of toxprpl_send_im with the
+ * unconditional purple_markup_strip_html / purple_message_meify path.
+ *
+ * usage: bench_markup [iterations] [percentage of plain text messages]
+ */
+
+// pull in the plugin to get at its static functions
+#include "toxprpl.c"
+
+// what automated senders and scripts typically send
+static const char *bench_plain_corpus[] =
+{
+    "ok",
+    "ping",
+    "build #4711 finished: SUCCESS (12m 31s)",
+    "[alert] disk usage on db-03 is above 90% (93.4%)",
+    "deploy of tox-prpl 0.4.0 to staging started by ci",
+    "/me is away from keyboard",
+    "https://example.org/jobs/4711/console?start=0 - see the log for details",
+    "Temperature: 21.5 C, humidity: 48 %, pressure: 1013 hPa",
+    "Überweisung von 120,00 € ist eingegangen",
+    "Привет! Как дела? Сегодня встреча в 15:00.",
+    "今日は会議が三時からあります。よろしくお願いします。",
+    "reminder: stand-up in 5 minutes",
+    "cpu=12% mem=1843MB load=0.42 0.51 0.48 uptime=17d",
+    "The quick brown fox jumps over the lazy dog. The quick brown fox jumps "
+    "over the lazy dog. The quick brown fox jumps over the lazy dog. The "
+    "quick brown fox jumps over the lazy dog. The quick brown fox jumps over "
+    "the lazy dog.",
+};
+
+// what the Pidgin conversation window sends for typed or formatted text
+static const char *bench_markup_corpus[] =
+{
+    "tom &amp; jerry",
+    "if (a &lt; b) return;",
+    "<b>important</b> please read",
+    "<FONT COLOR=\"#FF0000\">red alert</FONT>",
+    "/me <i>waves</i>",
+    "<a href=\"https://example.org/\">https://example.org/</a>",
+    "it&apos;s &quot;fine&quot;",
+    "<span style=\"font-weight: bold;\">bold</span> and <u>underlined</u>",
+    // control whitespace is replaced by spaces as well
+    "first line\nsecond line",
+    "name\tvalue\r\n",
+    "/me\tshrugs",
+    "form\ffeed and\vvertical tab",
+};
+
+// both paths must produce the same text
+static gboolean bench_check(const char *message)
+{
+    char *buffer;
+    uint32_t length;
+    gboolean action;
+    const char *text = toxprpl_prepare_message(message, &buffer, &length,
+                                               &action);
+
+    char *reference = purple_markup_strip_html(message);
+    gboolean reference_action = purple_message_meify(reference, -1);
+    gboolean same = (action == reference_action) &&
+                    (length == strlen(reference)) &&
+                    (memcmp(text, reference, length) == 0);
+    if (!same)
+    {
+        fprintf(stderr, "mismatch for \"%s\": \"%.*s\" vs \"%s\"\n",
+                message, (int)length, text, reference);
+    }
+    g_free(reference);
+    g_free(buffer);
+    return same;
+}
+
+typedef struct
+{
+    const char *text;
+} bench_message;
+
+static double bench_now_ns(void)
+{
+    return (double)g_get_monotonic_time() * 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    guint iterations = argc > 1 ? (guint)atoi(argv[1]) : 200000;
+    guint plain_percent = argc > 2 ? (guint)atoi(argv[2]) : 80;
+    guint corpus_size = 1024;
+    guint i, n;
+
+    // deterministic mix of both corpora
+    bench_message *corpus = g_new0(bench_message, corpus_size);
+    g_random_set_seed(4711);
+    for (i = 0; i < corpus_size; i++)
+    {
+        if ((guint)g_random_int_range(0, 100) < plain_percent)
+        {
+            corpus[i].text = bench_plain_corpus[
+                g_random_int_range(0, G_N_ELEMENTS(bench_plain_corpus))];
+        }
+        else
+        {
+            corpus[i].text = bench_markup_corpus[
+                g_random_int_range(0, G_N_ELEMENTS(bench_markup_corpus))];
+        }
+    }
+
+    // every message of both corpora, not only the ones drawn for the mix
+    for (i = 0; i < G_N_ELEMENTS(bench_plain_corpus); i++)
+    {
+        if (!bench_check(bench_plain_corpus[i]))
+        {
+            return 1;
+        }
+    }
+    for (i = 0; i < G_N_ELEMENTS(bench_markup_corpus); i++)
+    {
+        if (!bench_check(bench_markup_corpus[i]))
+        {
+            return 1;
+        }
+    }
+
+    size_t checksum = 0;
+    double start = bench_now_ns();
+    for (n = 0; n < iterations; n++)
+    {
+        char *stripped = purple_markup_strip_html(corpus[n % corpus_size].text);
+        checksum += purple_message_meify(stripped, -1) + strlen(stripped);
+        g_free(stripped);
+    }
+    double strip_ns = (bench_now_ns() - start) / iterations;
+
+    start = bench_now_ns();
+    for (n = 0; n < iterations; n++)
+    {
+        char *buffer;
+        uint32_t length;
+        gboolean action;
+        toxprpl_prepare_message(corpus[n % corpus_size].text, &buffer,
+                                &length, &action);
+        checksum -= action + length;
+        g_free(buffer);
+    }
+    double prepare_ns = (bench_now_ns() - start) / iterations;
+
+    printf("corpus: %u messages, %u%% plain text, %u iterations\n",
+           corpus_size, plain_percent, iterations);
+    printf("strip_html + meify:      %8.1f ns/op\n", strip_ns);
+    printf("toxprpl_prepare_message: %8.1f ns/op (%.1fx)\n", prepare_ns,
+           strip_ns / prepare_ns);
+
+    g_free(corpus);
+    return checksum == 0 ? 0 : 1;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * JSON output shared by the benchmarks that pull in the plugin source.
+ * include it after toxprpl.c, it works on the histograms of the plugin
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+static void bench_json_histogram(GString *json, const char *name,
+                                 const toxprpl_histogram *h)
+{
+    g_string_append_printf(json, "\"%s\":{\"count\":%" G_GUINT64_FORMAT ","
+        "\"p50\":%" G_GUINT64_FORMAT ",\"p90\":%" G_GUINT64_FORMAT ","
+        "\"p99\":%" G_GUINT64_FORMAT ",\"max\":%" G_GUINT64_FORMAT "}",
+        name, h->count, toxprpl_histogram_percentile(h, 50),
+        toxprpl_histogram_percentile(h, 90),
+        toxprpl_histogram_percentile(h, 99), h->max);
+}
+
+// events per second
+static double bench_rate(guint64 count, gint64 elapsed)
+{
+    return elapsed > 0 ? count * (double)G_USEC_PER_SEC / elapsed : 0.0;
+}
+
+#endif
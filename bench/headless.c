@@ -0,0 +1,410 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <core.h>
+#include <debug.h>
+#include <eventloop.h>
+#include <prefs.h>
+#include <request.h>
+#include <util.h>
+
+#include "headless.h"
+
+// at most this many event loop dispatches per headless_iterate(), idle
+// sources like the file transfer pump would keep it busy forever otherwise
+#define HEADLESS_MAX_DISPATCH   64
+
+#define HEADLESS_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define HEADLESS_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+typedef struct
+{
+    PurpleInputFunction function;
+    guint result;
+    gpointer data;
+} headless_io_closure;
+
+// a request dialog waiting to be answered from the event loop
+typedef struct
+{
+    PurpleRequestType type;
+    GCallback callback;
+    void *user_data;
+    int action;
+    PurpleRequestFields *fields;
+    gchar *filename;
+    guint source;
+} headless_request;
+
+static gchar *headless_dir;
+static gchar *headless_download_dir;
+static GList *headless_download_files;
+static guint headless_download_count;
+static guint headless_answered;
+
+/* event loop */
+static gboolean headless_io_invoke(GIOChannel *source,
+                                   GIOCondition condition, gpointer data)
+{
+    headless_io_closure *closure = data;
+    PurpleInputCondition purple_cond = 0;
+
+    if (condition & HEADLESS_READ_COND)
+    {
+        purple_cond |= PURPLE_INPUT_READ;
+    }
+    if (condition & HEADLESS_WRITE_COND)
+    {
+        purple_cond |= PURPLE_INPUT_WRITE;
+    }
+
+    closure->function(closure->data, g_io_channel_unix_get_fd(source),
+                      purple_cond);
+    return TRUE;
+}
+
+static guint headless_input_add(gint fd, PurpleInputCondition condition,
+                                PurpleInputFunction function, gpointer data)
+{
+    headless_io_closure *closure = g_new0(headless_io_closure, 1);
+    GIOCondition cond = 0;
+
+    closure->function = function;
+    closure->data = data;
+    if (condition & PURPLE_INPUT_READ)
+    {
+        cond |= HEADLESS_READ_COND;
+    }
+    if (condition & PURPLE_INPUT_WRITE)
+    {
+        cond |= HEADLESS_WRITE_COND;
+    }
+
+    GIOChannel *channel = g_io_channel_unix_new(fd);
+    closure->result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
+        headless_io_invoke, closure, g_free);
+    g_io_channel_unref(channel);
+    return closure->result;
+}
+
+static PurpleEventLoopUiOps headless_eventloop_ops =
+{
+    g_timeout_add,
+    g_source_remove,
+    headless_input_add,
+    g_source_remove,
+    NULL,                   /* input_get_error */
+    g_timeout_add_seconds,
+    NULL,
+    NULL,
+    NULL
+};
+
+/* requests */
+static void headless_request_free(headless_request *request)
+{
+    if (request->source != 0)
+    {
+        // closed before it was answered, nobody else frees the fields
+        g_source_remove(request->source);
+        if (request->fields != NULL)
+        {
+            purple_request_fields_destroy(request->fields);
+        }
+    }
+    g_free(request->filename);
+    g_free(request);
+}
+
+static gboolean headless_request_answer(gpointer data)
+{
+    headless_request *request = data;
+    // the callback may close the request itself, which frees it
+    PurpleRequestType type = request->type;
+    PurpleRequestFields *fields = request->fields;
+
+    request->source = 0;
+    headless_answered++;
+    switch (type)
+    {
+        case PURPLE_REQUEST_ACTION:
+            ((PurpleRequestActionCb)request->callback)(request->user_data,
+                                                       request->action);
+            break;
+        case PURPLE_REQUEST_FIELDS:
+            ((PurpleRequestFieldsCb)request->callback)(request->user_data,
+                                                       fields);
+            break;
+        case PURPLE_REQUEST_FILE:
+            ((PurpleRequestFileCb)request->callback)(request->user_data,
+                                                     request->filename);
+            break;
+        default:
+            break;
+    }
+
+    // like a dialog that goes away after the button was clicked, this does
+    // nothing if it is gone already
+    purple_request_close(type, request);
+    if (fields != NULL)
+    {
+        purple_request_fields_destroy(fields);
+    }
+    return FALSE;
+}
+
+static headless_request *headless_request_new(PurpleRequestType type,
+                                              GCallback callback,
+                                              void *user_data)
+{
+    headless_request *request = g_new0(headless_request, 1);
+    request->type = type;
+    request->callback = callback;
+    request->user_data = user_data;
+    if (callback != NULL)
+    {
+        request->source = g_idle_add(headless_request_answer, request);
+    }
+    return request;
+}
+
+static void *headless_request_action(const char *title, const char *primary,
+    const char *secondary, int default_action, PurpleAccount *account,
+    const char *who, PurpleConversation *conv, void *user_data,
+    size_t action_count, va_list actions)
+{
+    int choice = ((default_action >= 0) &&
+                  ((size_t)default_action < action_count)) ?
+                 default_action : 0;
+    GCallback callback = NULL;
+    size_t i;
+
+    for (i = 0; i < action_count; i++)
+    {
+        va_arg(actions, const char *);
+        GCallback cb = va_arg(actions, GCallback);
+        if ((int)i == choice)
+        {
+            callback = cb;
+        }
+    }
+
+    headless_request *request = headless_request_new(PURPLE_REQUEST_ACTION,
+                                                     callback, user_data);
+    request->action = choice;
+    return request;
+}
+
+static void *headless_request_fields(const char *title, const char *primary,
+    const char *secondary, PurpleRequestFields *fields, const char *ok_text,
+    GCallback ok_cb, const char *cancel_text, GCallback cancel_cb,
+    PurpleAccount *account, const char *who, PurpleConversation *conv,
+    void *user_data)
+{
+    headless_request *request = headless_request_new(PURPLE_REQUEST_FIELDS,
+                                                     ok_cb, user_data);
+    request->fields = fields;
+    return request;
+}
+
+static void *headless_request_file(const char *title, const char *filename,
+    gboolean savedialog, GCallback ok_cb, GCallback cancel_cb,
+    PurpleAccount *account, const char *who, PurpleConversation *conv,
+    void *user_data)
+{
+    gchar *name = g_strdup_printf("file-%u", headless_download_count++);
+    gchar *path = g_build_filename(headless_download_dir, name, NULL);
+    g_free(name);
+    headless_download_files = g_list_append(headless_download_files,
+                                            g_strdup(path));
+
+    headless_request *request = headless_request_new(PURPLE_REQUEST_FILE,
+                                                     ok_cb, user_data);
+    request->filename = path;
+    return request;
+}
+
+static void headless_close_request(PurpleRequestType type, void *ui_handle)
+{
+    headless_request_free(ui_handle);
+}
+
+static PurpleRequestUiOps headless_request_ops =
+{
+    NULL,                       /* request_input */
+    NULL,                       /* request_choice */
+    headless_request_action,
+    headless_request_fields,
+    headless_request_file,
+    headless_close_request,
+    NULL,                       /* request_folder */
+    NULL,                       /* request_action_with_icon */
+    NULL,
+    NULL,
+    NULL
+};
+
+/* helpers */
+static void headless_remove_tree(const char *path)
+{
+    if (g_file_test(path, G_FILE_TEST_IS_DIR))
+    {
+        GDir *dir = g_dir_open(path, 0, NULL);
+        const gchar *entry;
+        while ((dir != NULL) && ((entry = g_dir_read_name(dir)) != NULL))
+        {
+            gchar *child = g_build_filename(path, entry, NULL);
+            headless_remove_tree(child);
+            g_free(child);
+        }
+        if (dir != NULL)
+        {
+            g_dir_close(dir);
+        }
+        g_rmdir(path);
+    }
+    else
+    {
+        g_unlink(path);
+    }
+}
+
+/* interface */
+gboolean headless_init(gboolean verbose)
+{
+    headless_dir = g_dir_make_tmp("toxprpl-bench-XXXXXX", NULL);
+    if (headless_dir == NULL)
+    {
+        fprintf(stderr, "could not create a temporary directory\n");
+        return FALSE;
+    }
+    headless_download_dir = g_build_filename(headless_dir, "downloads", NULL);
+    g_mkdir(headless_download_dir, 0700);
+
+    purple_util_set_user_dir(headless_dir);
+    purple_debug_set_enabled(verbose);
+    purple_eventloop_set_ui_ops(&headless_eventloop_ops);
+    purple_request_set_ui_ops(&headless_request_ops);
+
+    if (!purple_core_init(HEADLESS_UI))
+    {
+        fprintf(stderr, "libpurple initialization failed\n");
+        return FALSE;
+    }
+
+    purple_set_blist(purple_blist_new());
+    purple_blist_load();
+
+    // keep the disk out of the measurements
+    purple_prefs_set_bool("/purple/logging/log_ims", FALSE);
+    purple_prefs_set_bool("/purple/logging/log_chats", FALSE);
+    purple_prefs_set_bool("/purple/logging/log_system", FALSE);
+    return TRUE;
+}
+
+void headless_shutdown(void)
+{
+    purple_core_quit();
+    headless_remove_tree(headless_dir);
+    g_list_free_full(headless_download_files, g_free);
+    headless_download_files = NULL;
+    g_free(headless_download_dir);
+    g_free(headless_dir);
+    headless_download_dir = NULL;
+    headless_dir = NULL;
+}
+
+const char *headless_user_dir(void)
+{
+    return headless_dir;
+}
+
+gboolean headless_register_plugin(gboolean (*init)(PurplePlugin *plugin))
+{
+    PurplePlugin *plugin = purple_plugin_new(TRUE, NULL);
+    if (!init(plugin))
+    {
+        fprintf(stderr, "could not register the plugin\n");
+        return FALSE;
+    }
+    if (!purple_plugin_load(plugin))
+    {
+        fprintf(stderr, "could not load the plugin\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+PurpleAccount *headless_account_new(const char *protocol_id,
+                                    const char *username)
+{
+    PurpleAccount *account = purple_account_new(username, protocol_id);
+    // an empty state skips the "new or import" question of the first login
+    purple_account_set_string(account, "messenger", "");
+    purple_account_set_string(account, "nickname", username);
+    purple_accounts_add(account);
+    return account;
+}
+
+PurpleConnection *headless_connect(PurpleAccount *account)
+{
+    purple_account_set_enabled(account, HEADLESS_UI, TRUE);
+    if (purple_account_is_disconnected(account))
+    {
+        purple_account_connect(account);
+    }
+    return purple_account_get_connection(account);
+}
+
+void headless_iterate(void)
+{
+    guint i;
+    for (i = 0; (i < HEADLESS_MAX_DISPATCH) && g_main_context_pending(NULL);
+         i++)
+    {
+        g_main_context_iteration(NULL, FALSE);
+    }
+}
+
+guint headless_requests_answered(void)
+{
+    return headless_answered;
+}
+
+GList *headless_downloads(void)
+{
+    return headless_download_files;
+}
+
+void headless_remove_downloads(void)
+{
+    GList *iter;
+    for (iter = headless_download_files; iter != NULL; iter = iter->next)
+    {
+        g_unlink(iter->data);
+    }
+    g_list_free_full(headless_download_files, g_free);
+    headless_download_files = NULL;
+}
@@ -0,0 +1,61 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Minimal headless libpurple UI for the benchmarks, along the lines of
+ * nullclient: a glib event loop, a throw-away user directory and request
+ * dialogs that are answered automatically with their default choice. File
+ * save dialogs get a fresh name in <user dir>/downloads.
+ */
+
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <glib.h>
+
+#include <account.h>
+#include <connection.h>
+#include <plugin.h>
+
+#define HEADLESS_UI "toxprpl-bench"
+
+// creates a temporary user directory and starts the libpurple core
+gboolean headless_init(gboolean verbose);
+void headless_shutdown(void);
+const char *headless_user_dir(void);
+
+// registers and loads a plugin that is linked into the program, pass the
+// purple_init_plugin of the included plugin source
+gboolean headless_register_plugin(gboolean (*init)(PurplePlugin *plugin));
+
+// a new account that skips the first login dialog of the plugin
+PurpleAccount *headless_account_new(const char *protocol_id,
+                                    const char *username);
+// connects the account, NULL if no connection came up
+PurpleConnection *headless_connect(PurpleAccount *account);
+
+// runs whatever the event loop has ready without blocking
+void headless_iterate(void);
+
+guint headless_requests_answered(void);
+// files handed out by save dialogs, in order
+GList *headless_downloads(void);
+void headless_remove_downloads(void);
+
+#endif
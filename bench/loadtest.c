@@ -0,0 +1,542 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load test of the plugin against the mock core in a headless libpurple.
+ * Logs in with a large friend list, then runs a presence storm, an incoming
+ * and an outgoing message storm, a number of parallel file transfers and a
+ * group chat that fills up with peers, is flooded and empties again.
+ * Everything is driven from a fixed seed, the results are printed as JSON.
+ *
+ * usage: loadtest [options], see loadtest --help
+ */
+
+// pull in the plugin to get at its static functions
+#include "toxprpl.c"
+
+#include "headless.h"
+#include "bench_util.h"
+#include "mock_tox.h"
+
+// give up on a phase that makes no progress for this long
+#define LOADTEST_STALL_TIMEOUT  (10 * G_USEC_PER_SEC)
+
+static gint loadtest_friends = 1000;
+static gint loadtest_messages = 20000;
+static gint loadtest_burst = 0;
+static gint loadtest_transfers = 4;
+static gint loadtest_transfer_size = 8 * 1024 * 1024;
+static gint loadtest_chunks = 64;
+static gint loadtest_group_peers = 2000;
+static gint loadtest_seed = 4711;
+static gboolean loadtest_verbose = FALSE;
+
+static GOptionEntry loadtest_options[] =
+{
+    { "friends", 'f', 0, G_OPTION_ARG_INT, &loadtest_friends,
+      "size of the friend list", "N" },
+    { "messages", 'm', 0, G_OPTION_ARG_INT, &loadtest_messages,
+      "messages per storm", "N" },
+    { "burst", 'b', 0, G_OPTION_ARG_INT, &loadtest_burst,
+      "events the core delivers per tox_do(), 0 for all", "N" },
+    { "transfers", 't', 0, G_OPTION_ARG_INT, &loadtest_transfers,
+      "parallel incoming file transfers", "N" },
+    { "transfer-size", 's', 0, G_OPTION_ARG_INT, &loadtest_transfer_size,
+      "bytes per file transfer", "BYTES" },
+    { "chunks", 'c', 0, G_OPTION_ARG_INT, &loadtest_chunks,
+      "file chunks per transfer and tox_do()", "N" },
+    { "group-peers", 'g', 0, G_OPTION_ARG_INT, &loadtest_group_peers,
+      "peers in the group chat, 0 to skip it", "N" },
+    { "seed", 0, 0, G_OPTION_ARG_INT, &loadtest_seed,
+      "random seed", "N" },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &loadtest_verbose,
+      "print the libpurple debug log", NULL },
+    { NULL }
+};
+
+// a mix of what people and scripts send
+static const char *loadtest_corpus[] =
+{
+    "ok",
+    "ping",
+    "are you there?",
+    "build #4711 finished: SUCCESS (12m 31s)",
+    "[alert] disk usage on db-03 is above 90% (93.4%)",
+    "Überweisung von 120,00 € ist eingegangen",
+    "Привет! Как дела? Сегодня встреча в 15:00.",
+    "今日は会議が三時からあります。よろしくお願いします。",
+    "The quick brown fox jumps over the lazy dog. The quick brown fox jumps "
+    "over the lazy dog. The quick brown fox jumps over the lazy dog.",
+    "<b>important</b> please read",
+    "tom &amp; jerry",
+};
+
+static Tox *loadtest_tox;
+static toxprpl_histogram loadtest_callback[MOCK_TOX_EVENT_COUNT];
+static toxprpl_histogram loadtest_queue;
+
+static void loadtest_new_tox(Tox *tox, void *user_data)
+{
+    loadtest_tox = tox;
+    mock_tox_set_event_budget(tox, (guint)loadtest_burst);
+    mock_tox_add_friends(tox, (guint)loadtest_friends);
+}
+
+static void loadtest_event(Tox *tox, const mock_tox_event *event,
+                           gint64 delivered, gint64 finished, void *user_data)
+{
+    toxprpl_histogram_record(&loadtest_callback[event->type],
+                             (guint64)(finished - delivered));
+    toxprpl_histogram_record(&loadtest_queue,
+                             (guint64)(delivered - event->injected));
+}
+
+static void loadtest_reset(void)
+{
+    memset(loadtest_callback, 0, sizeof(loadtest_callback));
+    memset(&loadtest_queue, 0, sizeof(loadtest_queue));
+}
+
+// runs the messenger until the core has nothing left to deliver
+static gboolean loadtest_drain(PurpleConnection *gc)
+{
+    guint64 events = mock_tox_get_stats(loadtest_tox)->events;
+    gint64 progress = g_get_monotonic_time();
+
+    while (mock_tox_pending(loadtest_tox) > 0)
+    {
+        tox_messenger_loop(gc);
+        headless_iterate();
+
+        const mock_tox_stats *stats = mock_tox_get_stats(loadtest_tox);
+        if (stats->events != events)
+        {
+            events = stats->events;
+            progress = g_get_monotonic_time();
+        }
+        else if (g_get_monotonic_time() - progress > LOADTEST_STALL_TIMEOUT)
+        {
+            fprintf(stderr, "no progress, %u events still pending\n",
+                    mock_tox_pending(loadtest_tox));
+            return FALSE;
+        }
+    }
+    headless_iterate();
+    return TRUE;
+}
+
+static gboolean loadtest_presence(PurpleConnection *gc, GString *json)
+{
+    gint i;
+
+    loadtest_reset();
+    for (i = 0; i < loadtest_friends; i++)
+    {
+        mock_tox_inject(loadtest_tox, MOCK_TOX_EVENT_CONNECTION, i, 1, NULL,
+                        0, 0);
+    }
+
+    gint64 start = g_get_monotonic_time();
+    gboolean ok = loadtest_drain(gc);
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    g_string_append_printf(json, ",\"presence\":{\"events\":%d,"
+        "\"seconds\":%.3f,\"per_second\":%.0f,", loadtest_friends,
+        elapsed / (double)G_USEC_PER_SEC,
+        bench_rate(loadtest_friends, elapsed));
+    bench_json_histogram(json, "callback_us",
+        &loadtest_callback[MOCK_TOX_EVENT_CONNECTION]);
+    g_string_append_c(json, '}');
+    return ok;
+}
+
+static gboolean loadtest_incoming(PurpleConnection *gc, GString *json)
+{
+    gint i;
+
+    loadtest_reset();
+    for (i = 0; i < loadtest_messages; i++)
+    {
+        const char *text = loadtest_corpus[
+            g_random_int_range(0, G_N_ELEMENTS(loadtest_corpus))];
+        mock_tox_inject(loadtest_tox, MOCK_TOX_EVENT_MESSAGE,
+                        g_random_int_range(0, loadtest_friends), 0, text,
+                        (uint16_t)strlen(text) + 1, 0);
+    }
+
+    gint64 start = g_get_monotonic_time();
+    gboolean ok = loadtest_drain(gc);
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    g_string_append_printf(json, ",\"incoming\":{\"messages\":%d,"
+        "\"seconds\":%.3f,\"per_second\":%.0f,", loadtest_messages,
+        elapsed / (double)G_USEC_PER_SEC,
+        bench_rate(loadtest_messages, elapsed));
+    bench_json_histogram(json, "callback_us",
+        &loadtest_callback[MOCK_TOX_EVENT_MESSAGE]);
+    g_string_append_c(json, ',');
+    bench_json_histogram(json, "queue_us", &loadtest_queue);
+    g_string_append_c(json, '}');
+    return ok;
+}
+
+static gboolean loadtest_outgoing(PurpleConnection *gc, GString *json)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_histogram send;
+    gchar **keys = g_new0(gchar *, loadtest_friends + 1);
+    gint i, failed = 0;
+
+    // what the conversation window would pass in as the recipient
+    for (i = 0; i < loadtest_friends; i++)
+    {
+        uint8_t client_id[TOX_CLIENT_ID_SIZE];
+        tox_get_client_id(loadtest_tox, i, client_id);
+        keys[i] = toxprpl_tox_bin_id_to_string(client_id);
+    }
+
+    loadtest_reset();
+    memset(&send, 0, sizeof(send));
+    memset(&plugin->metrics.histograms[TOXPRPL_HISTOGRAM_DELIVERY_LATENCY], 0,
+           sizeof(toxprpl_histogram));
+
+    gint64 start = g_get_monotonic_time();
+    for (i = 0; i < loadtest_messages; i++)
+    {
+        const char *text = loadtest_corpus[
+            g_random_int_range(0, G_N_ELEMENTS(loadtest_corpus))];
+        const char *who = keys[g_random_int_range(0, loadtest_friends)];
+        gint64 before = g_get_monotonic_time();
+        if (toxprpl_send_im(gc, who, text, 0) <= 0)
+        {
+            failed++;
+        }
+        toxprpl_histogram_record(&send,
+                                 (guint64)(g_get_monotonic_time() - before));
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+    gboolean ok = loadtest_drain(gc);
+
+    g_string_append_printf(json, ",\"outgoing\":{\"messages\":%d,"
+        "\"failed\":%d,\"seconds\":%.3f,\"per_second\":%.0f,"
+        "\"ns_per_op\":%.1f,", loadtest_messages, failed,
+        elapsed / (double)G_USEC_PER_SEC,
+        bench_rate(loadtest_messages, elapsed),
+        loadtest_messages > 0 ? elapsed * 1000.0 / loadtest_messages : 0.0);
+    bench_json_histogram(json, "send_us", &send);
+    g_string_append_c(json, ',');
+    bench_json_histogram(json, "receipt_callback_us",
+        &loadtest_callback[MOCK_TOX_EVENT_RECEIPT]);
+    g_string_append_c(json, ',');
+    bench_json_histogram(json, "delivery_us",
+        &plugin->metrics.histograms[TOXPRPL_HISTOGRAM_DELIVERY_LATENCY]);
+    g_string_append_c(json, '}');
+
+    g_strfreev(keys);
+    return ok && (failed == 0);
+}
+
+static gboolean loadtest_transfer(PurpleConnection *gc, GString *json)
+{
+    int *filenumbers = g_new0(int, loadtest_transfers);
+    guint64 total = (guint64)loadtest_transfers * loadtest_transfer_size;
+    guint64 received = 0;
+    gboolean ok = TRUE;
+    gint i;
+
+    loadtest_reset();
+    for (i = 0; i < loadtest_transfers; i++)
+    {
+        gchar *name = g_strdup_printf("loadtest-%d.bin", i);
+        filenumbers[i] = mock_tox_inject_file(loadtest_tox,
+            i % loadtest_friends, (uint64_t)loadtest_transfer_size, name,
+            (guint)loadtest_chunks);
+        g_free(name);
+    }
+
+    gint64 start = g_get_monotonic_time();
+    gint64 progress = start;
+    guint64 events = 0;
+    gint done = 0;
+    while (done < loadtest_transfers)
+    {
+        tox_messenger_loop(gc);
+        headless_iterate();
+
+        const mock_tox_stats *stats = mock_tox_get_stats(loadtest_tox);
+        if (stats->events != events)
+        {
+            events = stats->events;
+            progress = g_get_monotonic_time();
+        }
+        else if (g_get_monotonic_time() - progress > LOADTEST_STALL_TIMEOUT)
+        {
+            fprintf(stderr, "file transfers stalled, %d of %d done\n", done,
+                    loadtest_transfers);
+            ok = FALSE;
+            break;
+        }
+
+        for (i = 0, done = 0; i < loadtest_transfers; i++)
+        {
+            done += mock_tox_file_done(loadtest_tox, i % loadtest_friends,
+                                       filenumbers[i]);
+        }
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+    headless_iterate();
+
+    // what actually ended up on disk
+    GList *iter;
+    for (iter = headless_downloads(); iter != NULL; iter = iter->next)
+    {
+        GStatBuf sb;
+        if (g_stat(iter->data, &sb) == 0)
+        {
+            received += sb.st_size;
+        }
+    }
+    headless_remove_downloads();
+
+    g_string_append_printf(json, ",\"transfers\":{\"files\":%d,"
+        "\"bytes\":%" G_GUINT64_FORMAT ",\"written\":%" G_GUINT64_FORMAT ","
+        "\"seconds\":%.3f,\"mb_per_second\":%.1f,", loadtest_transfers,
+        total, received, elapsed / (double)G_USEC_PER_SEC,
+        bench_rate(total, elapsed) / (1024.0 * 1024.0));
+    bench_json_histogram(json, "chunk_callback_us",
+        &loadtest_callback[MOCK_TOX_EVENT_FILE_DATA]);
+    g_string_append_c(json, '}');
+
+    g_free(filenumbers);
+    return ok && (received == total);
+}
+
+// runs the messenger until neither the core nor the plugin hold back any
+// group chat updates, the duration of every tick goes to ticks
+static gboolean loadtest_drain_group(PurpleConnection *gc,
+                                     toxprpl_histogram *ticks)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    guint64 events = mock_tox_get_stats(loadtest_tox)->events;
+    gint64 progress = g_get_monotonic_time();
+
+    while ((mock_tox_pending(loadtest_tox) > 0) || plugin->group_flush)
+    {
+        gint64 before = g_get_monotonic_time();
+        tox_messenger_loop(gc);
+        toxprpl_histogram_record(ticks,
+                                 (guint64)(g_get_monotonic_time() - before));
+        headless_iterate();
+
+        const mock_tox_stats *stats = mock_tox_get_stats(loadtest_tox);
+        if ((stats->events != events) || plugin->group_flush)
+        {
+            events = stats->events;
+            progress = g_get_monotonic_time();
+        }
+        else if (g_get_monotonic_time() - progress > LOADTEST_STALL_TIMEOUT)
+        {
+            fprintf(stderr, "no progress, %u events still pending\n",
+                    mock_tox_pending(loadtest_tox));
+            return FALSE;
+        }
+    }
+    headless_iterate();
+    return TRUE;
+}
+
+static gboolean loadtest_group(PurpleConnection *gc, GString *json)
+{
+    toxprpl_histogram ticks;
+    gint renames = loadtest_group_peers / 10;
+    gint leaves = loadtest_group_peers / 2;
+    gint i;
+
+    // what "Join a Chat" does without an invite, the mock core starts
+    // numbering groups at 0
+    GHashTable *components = g_hash_table_new(g_str_hash, g_str_equal);
+    serv_join_chat(gc, components);
+    g_hash_table_destroy(components);
+    PurpleConversation *conv = purple_find_chat(gc, 0);
+    if (conv == NULL)
+    {
+        fprintf(stderr, "could not join a group chat\n");
+        return FALSE;
+    }
+
+    // every name about twice, the plugin has to tell them apart
+    loadtest_reset();
+    memset(&ticks, 0, sizeof(ticks));
+    for (i = 0; i < loadtest_group_peers; i++)
+    {
+        gchar *name = g_strdup_printf("peer-%d",
+            g_random_int_range(0, loadtest_group_peers / 2 + 1));
+        mock_tox_inject_namelist(loadtest_tox, 0, -1,
+                                 TOX_CHAT_CHANGE_PEER_ADD, name);
+        g_free(name);
+    }
+    gint64 start = g_get_monotonic_time();
+    gboolean ok = loadtest_drain_group(gc, &ticks);
+    gint64 join = g_get_monotonic_time() - start;
+    toxprpl_histogram namelist = loadtest_callback[
+        MOCK_TOX_EVENT_GROUP_NAMELIST];
+
+    loadtest_reset();
+    for (i = 0; i < loadtest_messages; i++)
+    {
+        const char *text = loadtest_corpus[
+            g_random_int_range(0, G_N_ELEMENTS(loadtest_corpus))];
+        mock_tox_inject(loadtest_tox, i % 10 == 0 ?
+                        MOCK_TOX_EVENT_GROUP_ACTION :
+                        MOCK_TOX_EVENT_GROUP_MESSAGE, 0,
+                        g_random_int_range(0, loadtest_group_peers), text,
+                        (uint16_t)strlen(text) + 1, 0);
+    }
+    start = g_get_monotonic_time();
+    ok = loadtest_drain_group(gc, &ticks) && ok;
+    gint64 flood = g_get_monotonic_time() - start;
+    toxprpl_histogram message = loadtest_callback[
+        MOCK_TOX_EVENT_GROUP_MESSAGE];
+
+    // our own message comes back from the core
+    ok = (toxprpl_chat_send(gc, 0, "<b>hello</b> room", 0) == 0) && ok;
+    for (i = 0; i < renames; i++)
+    {
+        gchar *name = g_strdup_printf("renamed-%d", i);
+        mock_tox_inject_namelist(loadtest_tox, 0,
+                                 g_random_int_range(0, loadtest_group_peers),
+                                 TOX_CHAT_CHANGE_PEER_NAME, name);
+        g_free(name);
+    }
+    for (i = 0; i < leaves; i++)
+    {
+        mock_tox_inject_namelist(loadtest_tox, 0, g_random_int_range(0,
+                                 loadtest_group_peers - i),
+                                 TOX_CHAT_CHANGE_PEER_DEL, NULL);
+    }
+    start = g_get_monotonic_time();
+    ok = loadtest_drain_group(gc, &ticks) && ok;
+    gint64 churn = g_get_monotonic_time() - start;
+
+    // the peers and ourselves
+    guint users = g_list_length(
+        purple_conv_chat_get_users(PURPLE_CONV_CHAT(conv)));
+    gboolean users_ok = users ==
+        (guint)tox_group_number_peers(loadtest_tox, 0) + 1;
+
+    g_string_append_printf(json, ",\"group\":{\"peers\":%d,"
+        "\"join_seconds\":%.3f,\"joins_per_second\":%.0f,"
+        "\"messages\":%d,\"messages_per_second\":%.0f,\"renames\":%d,"
+        "\"leaves\":%d,\"churn_seconds\":%.3f,\"users\":%u,"
+        "\"users_ok\":%s,", loadtest_group_peers,
+        join / (double)G_USEC_PER_SEC,
+        bench_rate(loadtest_group_peers, join), loadtest_messages,
+        bench_rate(loadtest_messages, flood), renames, leaves,
+        churn / (double)G_USEC_PER_SEC, users, users_ok ? "true" : "false");
+    bench_json_histogram(json, "tick_us", &ticks);
+    g_string_append_c(json, ',');
+    bench_json_histogram(json, "namelist_callback_us", &namelist);
+    g_string_append_c(json, ',');
+    bench_json_histogram(json, "message_callback_us", &message);
+    g_string_append_c(json, '}');
+    return ok && users_ok;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context = g_option_context_new(NULL);
+    GError *error = NULL;
+
+    g_option_context_add_main_entries(context, loadtest_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    loadtest_friends = MAX(loadtest_friends, 1);
+
+    g_random_set_seed((guint32)loadtest_seed);
+    mock_tox_set_seed((guint32)loadtest_seed);
+    mock_tox_set_new_hook(loadtest_new_tox, NULL);
+
+    if (!headless_init(loadtest_verbose) ||
+        !headless_register_plugin(purple_init_plugin))
+    {
+        return 1;
+    }
+
+    PurpleAccount *account = headless_account_new(TOXPRPL_ID, "loadtest");
+    gint64 start = g_get_monotonic_time();
+    PurpleConnection *gc = headless_connect(account);
+    gint64 login = g_get_monotonic_time() - start;
+    if ((gc == NULL) || (purple_connection_get_protocol_data(gc) == NULL) ||
+        (loadtest_tox == NULL))
+    {
+        fprintf(stderr, "login failed\n");
+        headless_shutdown();
+        return 1;
+    }
+    mock_tox_set_event_hook(loadtest_tox, loadtest_event, NULL);
+
+    // come online without waiting for the connection timer
+    tox_messenger_loop(gc);
+    tox_connection_check(gc);
+
+    GSList *buddies = purple_find_buddies(account, NULL);
+    guint buddy_count = g_slist_length(buddies);
+    g_slist_free(buddies);
+
+    GString *json = g_string_new(NULL);
+    g_string_append_printf(json, "{\"benchmark\":\"loadtest\",\"seed\":%d,"
+        "\"friends\":%d,\"login\":{\"ms\":%.3f,\"buddies\":%u,"
+        "\"connected\":%s}", loadtest_seed, loadtest_friends,
+        login / 1000.0, buddy_count,
+        purple_connection_get_state(gc) == PURPLE_CONNECTED ?
+        "true" : "false");
+
+    gboolean ok = buddy_count == (guint)loadtest_friends;
+    ok = loadtest_presence(gc, json) && ok;
+    ok = loadtest_incoming(gc, json) && ok;
+    ok = loadtest_outgoing(gc, json) && ok;
+    if (loadtest_transfers > 0)
+    {
+        ok = loadtest_transfer(gc, json) && ok;
+    }
+    if (loadtest_group_peers > 0)
+    {
+        ok = loadtest_group(gc, json) && ok;
+    }
+
+    const mock_tox_stats *stats = mock_tox_get_stats(loadtest_tox);
+    g_string_append_printf(json, ",\"core\":{\"ticks\":%" G_GUINT64_FORMAT
+        ",\"events\":%" G_GUINT64_FORMAT ",\"messages_sent\":%"
+        G_GUINT64_FORMAT ",\"group_messages_sent\":%" G_GUINT64_FORMAT
+        ",\"saves\":%" G_GUINT64_FORMAT ",\"save_bytes\":%"
+        G_GUINT64_FORMAT "},\"ok\":%s}\n", stats->ticks, stats->events,
+        stats->messages_sent, stats->group_messages_sent, stats->saves,
+        stats->save_bytes,
+        ok ? "true" : "false");
+    fputs(json->str, stdout);
+    g_string_free(json, TRUE);
+
+    purple_account_disconnect(account);
+    headless_shutdown();
+    return ok ? 0 : 1;
+}
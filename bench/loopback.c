@@ -0,0 +1,477 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * End-to-end benchmark between two accounts of the plugin in one headless
+ * libpurple, running on the real Tox core over 127.0.0.1 only. The accounts
+ * bootstrap from each other, become friends without a request and then
+ * exchange a message stream and files through the regular send and receive
+ * paths of the plugin. Message rate, latency and transfer throughput are
+ * printed as JSON.
+ *
+ * Each instance is bootstrapped with the other one's client id as DHT key,
+ * which is what the core versions the plugin is written for use. With --lan
+ * nobody is bootstrapped, the accounts have to find each other through the
+ * LAN discovery of the plugin.
+ *
+ * usage: loopback [options], see loopback --help
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+// pull in the plugin to get at its static functions
+#include "toxprpl.c"
+
+#include <ft.h>
+#include <server.h>
+#include <signals.h>
+
+#include "headless.h"
+#include "bench_util.h"
+
+// time between two rounds of tox_do() on both instances
+#define LOOPBACK_TICK_US        1000
+
+typedef struct
+{
+    PurpleAccount *account;
+    PurpleConnection *gc;
+    Tox *tox;
+    guint16 port;
+    gchar *key;             // client id as hex, also the DHT key
+    gchar *buddy;           // name of the other peer in the buddy list
+} loopback_peer;
+
+static gint loopback_messages = 2000;
+static gint loopback_message_size = 64;
+static gint loopback_window = 32;
+static gchar *loopback_file_sizes = "65536,1048576,16777216";
+static gint loopback_timeout = 60;
+static gboolean loopback_lan = FALSE;
+static gboolean loopback_verbose = FALSE;
+
+static GOptionEntry loopback_options[] =
+{
+    { "messages", 'm', 0, G_OPTION_ARG_INT, &loopback_messages,
+      "messages to send", "N" },
+    { "message-size", 's', 0, G_OPTION_ARG_INT, &loopback_message_size,
+      "bytes per message", "BYTES" },
+    { "window", 'w', 0, G_OPTION_ARG_INT, &loopback_window,
+      "messages in flight at most", "N" },
+    { "file-sizes", 'f', 0, G_OPTION_ARG_STRING, &loopback_file_sizes,
+      "comma separated sizes of the files to send, empty for none",
+      "BYTES,..." },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &loopback_timeout,
+      "seconds to wait for connections and each phase", "SECONDS" },
+    { "lan", 'l', 0, G_OPTION_ARG_NONE, &loopback_lan,
+      "find each other by LAN discovery instead of bootstrapping", NULL },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &loopback_verbose,
+      "print the libpurple debug log", NULL },
+    { NULL }
+};
+
+static loopback_peer loopback_alice;
+static loopback_peer loopback_bob;
+
+static gint64 *loopback_sent;       // send time by sequence number
+static guint loopback_received;
+static toxprpl_histogram loopback_latency;
+static gint64 loopback_file_done;   // 0 while the transfer is running
+static gboolean loopback_file_failed;
+
+static void loopback_pump(void)
+{
+    tox_messenger_loop(loopback_alice.gc);
+    tox_messenger_loop(loopback_bob.gc);
+    headless_iterate();
+    g_usleep(LOOPBACK_TICK_US);
+}
+
+// pumps until done() returns TRUE, FALSE on timeout
+static gboolean loopback_wait(gboolean (*done)(void), const char *what)
+{
+    gint64 deadline = g_get_monotonic_time() +
+                      loopback_timeout * G_USEC_PER_SEC;
+    while (!done())
+    {
+        if (g_get_monotonic_time() > deadline)
+        {
+            fprintf(stderr, "timeout waiting for %s\n", what);
+            return FALSE;
+        }
+        loopback_pump();
+    }
+    return TRUE;
+}
+
+static gboolean loopback_login(loopback_peer *peer, const char *name,
+                               const loopback_peer *server)
+{
+    peer->account = headless_account_new(TOXPRPL_ID, name);
+    purple_account_set_bool(peer->account, "lan_discovery", loopback_lan);
+    purple_account_set_string(peer->account, "dht_server", "127.0.0.1");
+    if (server != NULL)
+    {
+        purple_account_set_int(peer->account, "dht_server_port",
+                               server->port);
+        purple_account_set_string(peer->account, "dht_server_key",
+                                  server->key);
+    }
+    else
+    {
+        // nobody to bootstrap from yet, the other peer will call in
+        gchar *nobody = g_strnfill(TOX_CLIENT_ID_SIZE * 2, '0');
+        purple_account_set_int(peer->account, "dht_server_port", 9);
+        purple_account_set_string(peer->account, "dht_server_key", nobody);
+        g_free(nobody);
+    }
+
+    peer->gc = headless_connect(peer->account);
+    toxprpl_plugin_data *plugin = peer->gc == NULL ? NULL :
+        purple_connection_get_protocol_data(peer->gc);
+    if (plugin == NULL)
+    {
+        fprintf(stderr, "login of %s failed\n", name);
+        return FALSE;
+    }
+    peer->tox = plugin->tox;
+
+    uint8_t address[TOX_FRIEND_ADDRESS_SIZE];
+    tox_get_address(peer->tox, address);
+    peer->key = toxprpl_tox_bin_id_to_string(address);
+    peer->port = plugin->dht_port;
+    if (peer->port == 0)
+    {
+        fprintf(stderr, "could not find the port of %s\n", name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// friends without a request on both sides, as if the request was accepted
+static void loopback_befriend(loopback_peer *peer, loopback_peer *other)
+{
+    uint8_t *client_id = toxprpl_hex_string_to_data(other->key);
+    int friendnumber = tox_add_friend_norequest(peer->tox, client_id);
+    g_free(client_id);
+    toxprpl_sync_add_buddy(peer->account,
+        purple_connection_get_protocol_data(peer->gc), friendnumber);
+    peer->buddy = g_strdup(other->key);
+}
+
+static gboolean loopback_dht_connected(void)
+{
+    return tox_isconnected(loopback_alice.tox) &&
+           tox_isconnected(loopback_bob.tox);
+}
+
+static gboolean loopback_friends_online(void)
+{
+    return (tox_get_friend_connection_status(loopback_alice.tox, 0) == 1) &&
+           (tox_get_friend_connection_status(loopback_bob.tox, 0) == 1);
+}
+
+static void loopback_received_im(PurpleAccount *account, char *sender,
+                                 char *message, PurpleConversation *conv,
+                                 PurpleMessageFlags flags)
+{
+    char *end;
+    gulong seq = strtoul(message, &end, 10);
+
+    if ((account != loopback_bob.account) || (end == message) ||
+        (seq >= (gulong)loopback_messages) || (loopback_sent[seq] == 0))
+    {
+        return;
+    }
+    toxprpl_histogram_record(&loopback_latency,
+        (guint64)(g_get_monotonic_time() - loopback_sent[seq]));
+    loopback_sent[seq] = 0;
+    loopback_received++;
+}
+
+static gboolean loopback_messages_done(void)
+{
+    return loopback_received == (guint)loopback_messages;
+}
+
+// alice sends, bob receives. at most loopback_window messages are in flight
+static gboolean loopback_message_stream(GString *json)
+{
+    gchar *text = g_malloc(MAX(loopback_message_size, 16) + 1);
+    gint next = 0;
+    gint64 deadline = g_get_monotonic_time() +
+                      loopback_timeout * G_USEC_PER_SEC;
+    gboolean ok = TRUE;
+
+    loopback_sent = g_new0(gint64, loopback_messages);
+    gint64 start = g_get_monotonic_time();
+    while (!loopback_messages_done())
+    {
+        while ((next < loopback_messages) &&
+               (next - (gint)loopback_received < loopback_window))
+        {
+            int length = g_snprintf(text, 17, "%d ", next);
+            memset(text + length, 'x', MAX(loopback_message_size - length, 0));
+            text[MAX(loopback_message_size, length)] = '\0';
+            loopback_sent[next] = g_get_monotonic_time();
+            if (toxprpl_send_im(loopback_alice.gc, loopback_alice.buddy, text,
+                                0) <= 0)
+            {
+                fprintf(stderr, "message %d was not accepted\n", next);
+            }
+            next++;
+        }
+        if (g_get_monotonic_time() > deadline)
+        {
+            fprintf(stderr, "timeout, %u of %d messages received\n",
+                    loopback_received, loopback_messages);
+            ok = FALSE;
+            break;
+        }
+        loopback_pump();
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    // let the read receipts for the last messages arrive
+    gint i;
+    for (i = 0; i < 100; i++)
+    {
+        loopback_pump();
+    }
+
+    toxprpl_plugin_data *plugin =
+        purple_connection_get_protocol_data(loopback_alice.gc);
+    g_string_append_printf(json, ",\"messages\":{\"count\":%d,\"size\":%d,"
+        "\"window\":%d,\"received\":%u,\"seconds\":%.3f,\"per_second\":%.0f,",
+        loopback_messages, loopback_message_size, loopback_window,
+        loopback_received, elapsed / (double)G_USEC_PER_SEC,
+        bench_rate(loopback_received, elapsed));
+    bench_json_histogram(json, "latency_us", &loopback_latency);
+    g_string_append_c(json, ',');
+    bench_json_histogram(json, "receipt_us", &plugin->metrics.histograms[
+        TOXPRPL_HISTOGRAM_DELIVERY_LATENCY]);
+    g_string_append_c(json, '}');
+
+    g_free(loopback_sent);
+    loopback_sent = NULL;
+    g_free(text);
+    return ok;
+}
+
+static void loopback_file_complete(PurpleXfer *xfer, gpointer data)
+{
+    if (purple_xfer_get_account(xfer) == loopback_bob.account)
+    {
+        loopback_file_done = g_get_monotonic_time();
+    }
+}
+
+static void loopback_file_cancel(PurpleXfer *xfer, gpointer data)
+{
+    loopback_file_failed = TRUE;
+}
+
+static gboolean loopback_file_finished(void)
+{
+    return (loopback_file_done != 0) || loopback_file_failed;
+}
+
+static gboolean loopback_write_file(const char *path, guint64 size)
+{
+    guint8 buffer[64 * 1024];
+    guint64 written = 0;
+    FILE *file = g_fopen(path, "wb");
+    gsize i;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "could not write %s: %s\n", path, strerror(errno));
+        return FALSE;
+    }
+    for (i = 0; i < sizeof(buffer); i++)
+    {
+        buffer[i] = (guint8)(i * 31 + 7);
+    }
+    while (written < size)
+    {
+        size_t chunk = (size_t)MIN(size - written, sizeof(buffer));
+        if (fwrite(buffer, 1, chunk, file) != chunk)
+        {
+            break;
+        }
+        written += chunk;
+    }
+    return (fclose(file) == 0) && (written == size);
+}
+
+// alice sends a file of the given size to bob
+static gboolean loopback_transfer(GString *json, guint64 size, gboolean first)
+{
+    gchar *name = g_strdup_printf("send-%" G_GUINT64_FORMAT, size);
+    gchar *path = g_build_filename(headless_user_dir(), name, NULL);
+    gboolean ok = loopback_write_file(path, size);
+    g_free(name);
+
+    loopback_file_done = 0;
+    loopback_file_failed = FALSE;
+    gint64 start = g_get_monotonic_time();
+    if (ok)
+    {
+        serv_send_file(loopback_alice.gc, loopback_alice.buddy, path);
+        ok = loopback_wait(loopback_file_finished, "a file transfer") &&
+             !loopback_file_failed;
+    }
+    gint64 elapsed = (ok ? loopback_file_done : g_get_monotonic_time()) -
+                     start;
+
+    // check that all of it arrived
+    GList *last = g_list_last(headless_downloads());
+    GStatBuf st;
+    if (ok && ((last == NULL) || (g_stat(last->data, &st) != 0) ||
+               ((guint64)st.st_size != size)))
+    {
+        fprintf(stderr, "received file of %" G_GUINT64_FORMAT " bytes is "
+                "incomplete\n", size);
+        ok = FALSE;
+    }
+    headless_remove_downloads();
+    g_unlink(path);
+    g_free(path);
+
+    g_string_append_printf(json, "%s{\"bytes\":%" G_GUINT64_FORMAT ","
+        "\"seconds\":%.3f,\"mb_per_second\":%.3f,\"ok\":%s}",
+        first ? "" : ",", size, elapsed / (double)G_USEC_PER_SEC,
+        ok && (elapsed > 0) ? size / (double)elapsed : 0.0,
+        ok ? "true" : "false");
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context = g_option_context_new(NULL);
+    GError *error = NULL;
+
+    g_option_context_add_main_entries(context, loopback_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    loopback_messages = MAX(loopback_messages, 1);
+    loopback_message_size = CLAMP(loopback_message_size, 1,
+                                  TOX_MAX_MESSAGE_LENGTH);
+    loopback_window = MAX(loopback_window, 1);
+
+    if (!headless_init(loopback_verbose) ||
+        !headless_register_plugin(purple_init_plugin))
+    {
+        return 1;
+    }
+
+    static int handle;
+    purple_signal_connect(purple_conversations_get_handle(),
+        "received-im-msg", &handle, PURPLE_CALLBACK(loopback_received_im),
+        NULL);
+    purple_signal_connect(purple_xfers_get_handle(), "file-recv-complete",
+        &handle, PURPLE_CALLBACK(loopback_file_complete), NULL);
+    purple_signal_connect(purple_xfers_get_handle(), "file-recv-cancel",
+        &handle, PURPLE_CALLBACK(loopback_file_cancel), NULL);
+    purple_signal_connect(purple_xfers_get_handle(), "file-send-cancel",
+        &handle, PURPLE_CALLBACK(loopback_file_cancel), NULL);
+
+    GString *json = g_string_new("{\"benchmark\":\"loopback\"");
+    gint64 start = g_get_monotonic_time();
+    // with --lan neither knows a node, they have to find each other
+    gboolean ok = loopback_login(&loopback_alice, "alice", NULL) &&
+                  loopback_login(&loopback_bob, "bob",
+                                 loopback_lan ? NULL : &loopback_alice);
+    if (ok)
+    {
+        if (!loopback_lan)
+        {
+            // alice started out without a node, tell her about bob
+            uint8_t *key = toxprpl_hex_string_to_data(loopback_bob.key);
+            tox_bootstrap_from_address(loopback_alice.tox, "127.0.0.1", 0,
+                                       htons(loopback_bob.port), key);
+            g_free(key);
+        }
+        loopback_befriend(&loopback_alice, &loopback_bob);
+        loopback_befriend(&loopback_bob, &loopback_alice);
+        ok = loopback_wait(loopback_dht_connected, "the DHT");
+    }
+    gint64 dht = g_get_monotonic_time() - start;
+    ok = ok && loopback_wait(loopback_friends_online, "the friends");
+    gint64 friends = g_get_monotonic_time() - start;
+
+    // whether the friends announced themselves on the LAN, the plugin can
+    // not tell which path the core took
+    gboolean on_lan = ok &&
+        toxprpl_friend_on_lan(
+            purple_connection_get_protocol_data(loopback_alice.gc), 0) &&
+        toxprpl_friend_on_lan(
+            purple_connection_get_protocol_data(loopback_bob.gc), 0);
+    g_string_append_printf(json, ",\"connect\":{\"lan\":%s,\"dht_ms\":%.1f,"
+        "\"friend_ms\":%.1f,\"on_lan\":%s,\"ok\":%s}",
+        loopback_lan ? "true" : "false", dht / 1000.0, friends / 1000.0,
+        on_lan ? "true" : "false", ok ? "true" : "false");
+
+    if (ok)
+    {
+        ok = loopback_message_stream(json);
+
+        g_string_append(json, ",\"transfers\":[");
+        gchar **sizes = g_strsplit(loopback_file_sizes, ",", -1);
+        gboolean first = TRUE;
+        gchar **size;
+        for (size = sizes; *size != NULL; size++)
+        {
+            guint64 bytes = g_ascii_strtoull(*size, NULL, 10);
+            if (bytes > 0)
+            {
+                ok = loopback_transfer(json, bytes, first) && ok;
+                first = FALSE;
+            }
+        }
+        g_strfreev(sizes);
+        g_string_append_c(json, ']');
+    }
+
+    g_string_append_printf(json, ",\"ok\":%s}\n", ok ? "true" : "false");
+    fputs(json->str, stdout);
+    g_string_free(json, TRUE);
+
+    purple_signals_disconnect_by_handle(&handle);
+    if (loopback_alice.account != NULL)
+    {
+        purple_account_disconnect(loopback_alice.account);
+    }
+    if (loopback_bob.account != NULL)
+    {
+        purple_account_disconnect(loopback_bob.account);
+    }
+    g_free(loopback_alice.key);
+    g_free(loopback_alice.buddy);
+    g_free(loopback_bob.key);
+    g_free(loopback_bob.buddy);
+    headless_shutdown();
+    return ok ? 0 : 1;
+}
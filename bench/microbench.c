@@ -0,0 +1,439 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the CPU hot spots of the plugin. Every benchmark runs
+ * until it took at least --min-time seconds, the results are printed as JSON
+ * with the time and the number of heap allocations per operation so that
+ * runs can be compared over time.
+ *
+ * The plugin runs in a headless libpurple against the mock core, like in
+ * loadtest.
+ *
+ * usage: microbench [options] [benchmark name...], see microbench --help
+ */
+
+// pull in the plugin to get at its static functions
+#include "toxprpl.c"
+
+#include "headless.h"
+#include "mock_tox.h"
+
+#define MICROBENCH_TRANSFERS    64
+
+typedef void (*microbench_func)(guint64 iterations);
+
+typedef struct
+{
+    const char *name;
+    microbench_func func;
+} microbench;
+
+static gint microbench_friends = 1000;
+static gdouble microbench_min_time = 0.5;
+static gint microbench_seed = 4711;
+
+static GOptionEntry microbench_options[] =
+{
+    { "friends", 'f', 0, G_OPTION_ARG_INT, &microbench_friends,
+      "size of the friend list", "N" },
+    { "min-time", 't', 0, G_OPTION_ARG_DOUBLE, &microbench_min_time,
+      "minimum run time per benchmark", "SECONDS" },
+    { "seed", 0, 0, G_OPTION_ARG_INT, &microbench_seed,
+      "random seed", "N" },
+    { NULL }
+};
+
+static Tox *microbench_tox;
+static PurpleAccount *microbench_account;
+static PurpleConnection *microbench_gc;
+static gchar **microbench_keys;     // buddy names by friend number
+static PurpleXfer *microbench_xfers[MICROBENCH_TRANSFERS];
+
+/* timing and allocation counting */
+static gboolean microbench_running;
+static gint64 microbench_started;
+static gint64 microbench_elapsed;
+static volatile guint64 microbench_allocs;
+
+#ifdef __GLIBC__
+/*
+ * count every allocation of the process, including the ones libpurple and
+ * glib make. G_SLICE=always-malloc is set in main() so that GSlice does not
+ * hide them in its magazines
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size)
+{
+    if (microbench_running)
+    {
+        microbench_allocs++;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (microbench_running)
+    {
+        microbench_allocs++;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (microbench_running)
+    {
+        microbench_allocs++;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    if (microbench_running)
+    {
+        microbench_allocs++;
+    }
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr == NULL ? ENOMEM : 0;
+}
+#define MICROBENCH_COUNTS_ALLOCS TRUE
+#else
+#define MICROBENCH_COUNTS_ALLOCS FALSE
+#endif
+
+// like b.StopTimer() / b.StartTimer() in Go, for per iteration setup
+static void microbench_pause(void)
+{
+    microbench_running = FALSE;
+    microbench_elapsed += g_get_monotonic_time() - microbench_started;
+}
+
+static void microbench_resume(void)
+{
+    microbench_started = g_get_monotonic_time();
+    microbench_running = TRUE;
+}
+
+/* benchmarks */
+static void microbench_hex_encode(guint64 iterations)
+{
+    uint8_t client_id[TOX_CLIENT_ID_SIZE];
+    guint64 i;
+
+    tox_get_client_id(microbench_tox, 0, client_id);
+    for (i = 0; i < iterations; i++)
+    {
+        client_id[0] = (uint8_t)i;
+        free(toxprpl_tox_bin_id_to_string(client_id));
+    }
+}
+
+static void microbench_hex_decode(guint64 iterations)
+{
+    guint64 i;
+    for (i = 0; i < iterations; i++)
+    {
+        free(toxprpl_hex_string_to_data(
+            microbench_keys[i % microbench_friends]));
+    }
+}
+
+// reconciliation on login, every buddy and friend already match
+static void microbench_sync_friends(guint64 iterations)
+{
+    toxprpl_plugin_data *plugin =
+        purple_connection_get_protocol_data(microbench_gc);
+    GSList *buddies = purple_find_buddies(microbench_account, NULL);
+    guint64 i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        // what a fresh login starts with
+        microbench_pause();
+        GSList *iter;
+        for (iter = buddies; iter != NULL; iter = iter->next)
+        {
+            toxprpl_free_buddy(iter->data);
+        }
+        microbench_resume();
+
+        toxprpl_sync_friends(microbench_account, plugin);
+    }
+    g_slist_free(buddies);
+}
+
+// what the friend callbacks do to get from a friend number to the buddy
+static void microbench_buddy_lookup(guint64 iterations)
+{
+    toxprpl_plugin_data *plugin =
+        purple_connection_get_protocol_data(microbench_gc);
+    guint64 i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        int fnum = (int)(i % microbench_friends);
+        gchar *buddy_key = toxprpl_friend_buddy_key(plugin, fnum);
+        if ((buddy_key == NULL) || (toxprpl_friend_buddy(plugin, fnum) == NULL))
+        {
+            fprintf(stderr, "buddy of friend %d not found\n", fnum);
+            exit(1);
+        }
+        // the messenger loop resets it after every tox_do()
+        if ((i % 64) == 63)
+        {
+            toxprpl_arena_reset(&plugin->scratch);
+        }
+    }
+    toxprpl_arena_reset(&plugin->scratch);
+}
+
+static void microbench_find_xfer(guint64 iterations)
+{
+    guint64 i;
+    for (i = 0; i < iterations; i++)
+    {
+        guint n = (guint)(i % MICROBENCH_TRANSFERS);
+        if (toxprpl_find_xfer(microbench_gc, (int)n, 0) == NULL)
+        {
+            fprintf(stderr, "transfer %u not found\n", n);
+            exit(1);
+        }
+    }
+}
+
+static const char *microbench_corpus[] =
+{
+    "ok",
+    "build #4711 finished: SUCCESS (12m 31s)",
+    "Привет! Как дела? Сегодня встреча в 15:00.",
+    "<b>important</b> please read",
+    "/me is away from keyboard",
+    "tom &amp; jerry",
+};
+
+static void microbench_prepare_message(guint64 iterations)
+{
+    guint64 i;
+    for (i = 0; i < iterations; i++)
+    {
+        char *buffer;
+        uint32_t length;
+        gboolean action;
+        toxprpl_prepare_message(
+            microbench_corpus[i % G_N_ELEMENTS(microbench_corpus)], &buffer,
+            &length, &action);
+        g_free(buffer);
+    }
+}
+
+static void microbench_send_im(guint64 iterations)
+{
+    guint64 i;
+    for (i = 0; i < iterations; i++)
+    {
+        toxprpl_send_im(microbench_gc, microbench_keys[i % microbench_friends],
+            microbench_corpus[i % G_N_ELEMENTS(microbench_corpus)], 0);
+        // let the receipts come back before the table grows too much
+        if ((i % 256) == 255)
+        {
+            microbench_pause();
+            tox_messenger_loop(microbench_gc);
+            tox_messenger_loop(microbench_gc);
+            microbench_resume();
+        }
+    }
+    microbench_pause();
+    tox_messenger_loop(microbench_gc);
+    tox_messenger_loop(microbench_gc);
+    microbench_resume();
+}
+
+static void microbench_save_account(guint64 iterations)
+{
+    guint64 i;
+    for (i = 0; i < iterations; i++)
+    {
+        toxprpl_save_account(microbench_account, microbench_tox);
+    }
+}
+
+static const microbench microbench_all[] =
+{
+    { "hex_encode", microbench_hex_encode },
+    { "hex_decode", microbench_hex_decode },
+    { "sync_friends", microbench_sync_friends },
+    { "buddy_lookup", microbench_buddy_lookup },
+    { "find_xfer", microbench_find_xfer },
+    { "prepare_message", microbench_prepare_message },
+    { "send_im", microbench_send_im },
+    { "save_account", microbench_save_account },
+};
+
+/* runner */
+static void microbench_run(const microbench *bench, GString *json)
+{
+    guint64 iterations = 1;
+    gint64 min_time = (gint64)(microbench_min_time * G_USEC_PER_SEC);
+    guint64 allocs;
+
+    for (;;)
+    {
+        microbench_elapsed = 0;
+        microbench_allocs = 0;
+        microbench_resume();
+        bench->func(iterations);
+        microbench_pause();
+        allocs = microbench_allocs;
+
+        if ((microbench_elapsed >= min_time) || (iterations >= G_MAXUINT32))
+        {
+            break;
+        }
+
+        // aim a bit beyond the minimum, but do not grow more than 100x
+        guint64 next = microbench_elapsed > 0 ?
+            (guint64)(iterations * 1.2 * min_time / microbench_elapsed) :
+            iterations * 100;
+        iterations = CLAMP(next, iterations + 1, iterations * 100);
+    }
+
+    g_string_append_printf(json, "%s{\"name\":\"%s\",\"iterations\":%"
+        G_GUINT64_FORMAT ",\"ns_per_op\":%.1f,", json->str[json->len - 1] ==
+        '[' ? "" : ",", bench->name, iterations,
+        microbench_elapsed * 1000.0 / iterations);
+    if (MICROBENCH_COUNTS_ALLOCS)
+    {
+        g_string_append_printf(json, "\"allocs_per_op\":%.2f}",
+                               (double)allocs / iterations);
+    }
+    else
+    {
+        g_string_append(json, "\"allocs_per_op\":null}");
+    }
+}
+
+static gboolean microbench_setup(void)
+{
+    gint i;
+
+    microbench_account = headless_account_new(TOXPRPL_ID, "microbench");
+    microbench_gc = headless_connect(microbench_account);
+    if ((microbench_gc == NULL) || (microbench_tox == NULL))
+    {
+        fprintf(stderr, "login failed\n");
+        return FALSE;
+    }
+    tox_messenger_loop(microbench_gc);
+    tox_connection_check(microbench_gc);
+
+    microbench_keys = g_new0(gchar *, microbench_friends + 1);
+    for (i = 0; i < microbench_friends; i++)
+    {
+        uint8_t client_id[TOX_CLIENT_ID_SIZE];
+        tox_get_client_id(microbench_tox, i, client_id);
+        microbench_keys[i] = toxprpl_tox_bin_id_to_string(client_id);
+        mock_tox_set_online(microbench_tox, i, TRUE);
+    }
+
+    // transfers that were offered but not yet accepted
+    for (i = 0; i < MICROBENCH_TRANSFERS; i++)
+    {
+        microbench_xfers[i] = toxprpl_new_xfer_receive(microbench_gc,
+            microbench_keys[i % microbench_friends], i, 0, 4096,
+            "microbench.bin");
+    }
+    return TRUE;
+}
+
+static void microbench_teardown(void)
+{
+    gint i;
+    for (i = 0; i < MICROBENCH_TRANSFERS; i++)
+    {
+        toxprpl_xfer_free(microbench_xfers[i]);
+        purple_xfer_unref(microbench_xfers[i]);
+    }
+    g_strfreev(microbench_keys);
+    purple_account_disconnect(microbench_account);
+}
+
+static void microbench_new_tox(Tox *tox, void *user_data)
+{
+    microbench_tox = tox;
+    mock_tox_add_friends(tox, (guint)microbench_friends);
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    guint i;
+    int j;
+
+    g_setenv("G_SLICE", "always-malloc", TRUE);
+
+    context = g_option_context_new("[BENCHMARK...]");
+    g_option_context_add_main_entries(context, microbench_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    microbench_friends = MAX(microbench_friends, MICROBENCH_TRANSFERS);
+
+    mock_tox_set_seed((guint32)microbench_seed);
+    mock_tox_set_new_hook(microbench_new_tox, NULL);
+    if (!headless_init(FALSE) ||
+        !headless_register_plugin(purple_init_plugin) ||
+        !microbench_setup())
+    {
+        return 1;
+    }
+
+    GString *json = g_string_new(NULL);
+    g_string_append_printf(json, "{\"benchmark\":\"microbench\",\"seed\":%d,"
+        "\"friends\":%d,\"results\":[", microbench_seed, microbench_friends);
+    for (i = 0; i < G_N_ELEMENTS(microbench_all); i++)
+    {
+        gboolean selected = argc < 2;
+        for (j = 1; j < argc; j++)
+        {
+            selected |= strcmp(argv[j], microbench_all[i].name) == 0;
+        }
+        if (selected)
+        {
+            microbench_run(&microbench_all[i], json);
+        }
+    }
+    g_string_append(json, "]}\n");
+    fputs(json->str, stdout);
+    g_string_free(json, TRUE);
+
+    microbench_teardown();
+    headless_shutdown();
+    return 0;
+}
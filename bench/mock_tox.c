@@ -0,0 +1,1574 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "mock_tox.h"
+
+#define MOCK_TOX_SAVE_MAGIC     "MTOX"
+#define MOCK_TOX_MAX_REQUEST    1016    // longest friend request message
+
+typedef struct
+{
+    uint8_t client_id[TOX_CLIENT_ID_SIZE];
+    gboolean exists;
+    uint8_t online;
+    uint8_t user_status;
+    uint8_t name[TOX_MAX_NAME_LENGTH];
+    uint16_t name_length;
+    uint8_t status_message[TOX_MAX_STATUSMESSAGE_LENGTH];
+    uint16_t status_message_length;
+    uint8_t next_filenumber;
+    guint window_used;      // file chunks accepted during this tick
+} mock_friend;
+
+typedef struct
+{
+    int32_t friendnumber;
+    uint8_t filenumber;
+    gboolean incoming;
+    uint64_t size;
+    uint64_t transferred;
+    gboolean accepted;
+    gboolean done;
+    guint chunks_per_tick;  // 0 if the data is injected as events
+} mock_file;
+
+typedef struct
+{
+    GPtrArray *peers;       // of gchar *, index is the peer number
+} mock_group;
+
+struct Tox
+{
+    uint8_t self_id[TOX_CLIENT_ID_SIZE];
+    uint32_t nospam;
+    uint8_t name[TOX_MAX_NAME_LENGTH];
+    uint16_t name_length;
+    uint8_t status_message[TOX_MAX_STATUSMESSAGE_LENGTH];
+    uint16_t status_message_length;
+    uint8_t user_status;
+
+    GArray *friends;            // of mock_friend, index is the friend number
+    GHashTable *friend_index;   // client id -> friend number + 1
+    GQueue *events;             // of mock_tox_event, sorted by due
+    GList *files;               // of mock_file
+    GPtrArray *groups;          // of mock_group, NULL for a deleted group
+    uint32_t next_message_id;
+
+    guint64 tick;
+    guint connect_delay;
+    guint receipt_delay;
+    guint event_budget;
+    guint file_window;
+    gboolean auto_accept;
+
+    void (*friend_request)(Tox *, uint8_t *, uint8_t *, uint16_t, void *);
+    void *friend_request_data;
+    void (*friend_message)(Tox *, int32_t, uint8_t *, uint16_t, void *);
+    void *friend_message_data;
+    void (*friend_action)(Tox *, int32_t, uint8_t *, uint16_t, void *);
+    void *friend_action_data;
+    void (*name_change)(Tox *, int32_t, uint8_t *, uint16_t, void *);
+    void *name_change_data;
+    void (*status_message_change)(Tox *, int32_t, uint8_t *, uint16_t,
+                                  void *);
+    void *status_message_change_data;
+    void (*user_status_change)(Tox *, int32_t, uint8_t, void *);
+    void *user_status_change_data;
+    void (*typing_change)(Tox *, int32_t, uint8_t, void *);
+    void *typing_change_data;
+    void (*read_receipt)(Tox *, int32_t, uint32_t, void *);
+    void *read_receipt_data;
+    void (*connection_status)(Tox *, int32_t, uint8_t, void *);
+    void *connection_status_data;
+    void (*file_send_request)(Tox *, int32_t, uint8_t, uint64_t, uint8_t *,
+                              uint16_t, void *);
+    void *file_send_request_data;
+    void (*file_control)(Tox *, int32_t, uint8_t, uint8_t, uint8_t,
+                         uint8_t *, uint16_t, void *);
+    void *file_control_data;
+    void (*file_data)(Tox *, int32_t, uint8_t, uint8_t *, uint16_t, void *);
+    void *file_data_data;
+    void (*group_invite)(Tox *, int32_t, uint8_t *, void *);
+    void *group_invite_data;
+    void (*group_message)(Tox *, int, int, uint8_t *, uint16_t, void *);
+    void *group_message_data;
+    void (*group_action)(Tox *, int, int, uint8_t *, uint16_t, void *);
+    void *group_action_data;
+    void (*group_namelist_change)(Tox *, int, int, uint8_t, void *);
+    void *group_namelist_change_data;
+
+    mock_tox_event_hook event_hook;
+    void *event_hook_data;
+    mock_tox_send_hook send_hook;
+    void *send_hook_data;
+
+    mock_tox_stats stats;
+};
+
+static const char *mock_tox_event_names[] =
+{
+    "message",
+    "action",
+    "name",
+    "status_message",
+    "user_status",
+    "typing",
+    "connection",
+    "receipt",
+    "request",
+    "file_send_request",
+    "file_control",
+    "file_data",
+    "group_invite",
+    "group_message",
+    "group_action",
+    "group_namelist",
+};
+G_STATIC_ASSERT(G_N_ELEMENTS(mock_tox_event_names) == MOCK_TOX_EVENT_COUNT);
+
+static GRand *mock_tox_rand;
+static mock_tox_new_hook mock_tox_new_cb;
+static void *mock_tox_new_cb_data;
+static uint8_t mock_tox_file_pattern[MOCK_TOX_FILE_DATA_SIZE];
+
+/* helpers */
+static GRand *mock_tox_get_rand(void)
+{
+    if (mock_tox_rand == NULL)
+    {
+        mock_tox_rand = g_rand_new_with_seed(4711);
+    }
+    return mock_tox_rand;
+}
+
+static guint mock_tox_client_id_hash(gconstpointer key)
+{
+    guint hash;
+    memcpy(&hash, key, sizeof(hash)); // keys are random anyway
+    return hash;
+}
+
+static gboolean mock_tox_client_id_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, TOX_CLIENT_ID_SIZE) == 0;
+}
+
+static mock_friend *mock_tox_get_friend(Tox *tox, int32_t friendnumber)
+{
+    if ((friendnumber < 0) || ((guint)friendnumber >= tox->friends->len))
+    {
+        return NULL;
+    }
+    mock_friend *f = &g_array_index(tox->friends, mock_friend, friendnumber);
+    return f->exists ? f : NULL;
+}
+
+static mock_file *mock_tox_find_file(Tox *tox, int32_t friendnumber,
+                                     uint8_t filenumber, gboolean incoming)
+{
+    GList *iter;
+    for (iter = tox->files; iter != NULL; iter = iter->next)
+    {
+        mock_file *file = iter->data;
+        if ((file->friendnumber == friendnumber) &&
+            (file->filenumber == filenumber) &&
+            (file->incoming == incoming))
+        {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+static void mock_tox_remove_file(Tox *tox, mock_file *file)
+{
+    tox->files = g_list_remove(tox->files, file);
+    g_free(file);
+}
+
+static mock_group *mock_tox_get_group(Tox *tox, int groupnumber)
+{
+    if ((groupnumber < 0) || ((guint)groupnumber >= tox->groups->len))
+    {
+        return NULL;
+    }
+    return g_ptr_array_index(tox->groups, groupnumber);
+}
+
+static int mock_tox_new_group(Tox *tox)
+{
+    mock_group *group = g_new0(mock_group, 1);
+    group->peers = g_ptr_array_new_with_free_func(g_free);
+
+    // like the core, reuse the numbers of deleted groups
+    guint i;
+    for (i = 0; i < tox->groups->len; i++)
+    {
+        if (g_ptr_array_index(tox->groups, i) == NULL)
+        {
+            g_ptr_array_index(tox->groups, i) = group;
+            return (int)i;
+        }
+    }
+    g_ptr_array_add(tox->groups, group);
+    return (int)tox->groups->len - 1;
+}
+
+static void mock_tox_group_free(mock_group *group)
+{
+    if (group != NULL)
+    {
+        g_ptr_array_free(group->peers, TRUE);
+        g_free(group);
+    }
+}
+
+static void mock_tox_checksum(const uint8_t *address, uint8_t *checksum)
+{
+    guint i;
+    checksum[0] = checksum[1] = 0;
+    for (i = 0; i < TOX_CLIENT_ID_SIZE + sizeof(uint32_t); i++)
+    {
+        checksum[i % 2] ^= address[i];
+    }
+}
+
+static int32_t mock_tox_insert_friend(Tox *tox, const uint8_t *client_id)
+{
+    mock_friend f;
+    memset(&f, 0, sizeof(f));
+    memcpy(f.client_id, client_id, TOX_CLIENT_ID_SIZE);
+    f.exists = TRUE;
+    g_array_append_val(tox->friends, f);
+
+    int32_t friendnumber = (int32_t)tox->friends->len - 1;
+    g_hash_table_insert(tox->friend_index,
+                        g_memdup(client_id, TOX_CLIENT_ID_SIZE),
+                        GINT_TO_POINTER(friendnumber + 1));
+    return friendnumber;
+}
+
+static void mock_tox_event_free(mock_tox_event *event)
+{
+    g_free(event->data);
+    g_free(event->extra);
+    g_free(event);
+}
+
+static void mock_tox_queue(Tox *tox, mock_tox_event *event, guint delay)
+{
+    // delay 0 means the next tox_do(), keep the queue sorted by due tick
+    event->due = tox->tick + 1 + delay;
+    GList *link = tox->events->tail;
+    while ((link != NULL) && (((mock_tox_event *)link->data)->due > event->due))
+    {
+        link = link->prev;
+    }
+    if (link == NULL)
+    {
+        g_queue_push_head(tox->events, event);
+    }
+    else
+    {
+        g_queue_insert_after(tox->events, link, event);
+    }
+}
+
+static void mock_tox_deliver(Tox *tox, mock_tox_event *event)
+{
+    mock_friend *f = mock_tox_get_friend(tox, event->friendnumber);
+    mock_file *file;
+    mock_group *group;
+    int peernumber;
+    gint64 delivered = g_get_monotonic_time();
+
+    switch (event->type)
+    {
+        case MOCK_TOX_EVENT_MESSAGE:
+            if (tox->friend_message != NULL)
+            {
+                tox->friend_message(tox, event->friendnumber, event->data,
+                    event->length, tox->friend_message_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_ACTION:
+            if (tox->friend_action != NULL)
+            {
+                tox->friend_action(tox, event->friendnumber, event->data,
+                    event->length, tox->friend_action_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_NAME:
+            if (f != NULL)
+            {
+                f->name_length = MIN(event->length, TOX_MAX_NAME_LENGTH);
+                memcpy(f->name, event->data, f->name_length);
+            }
+            if (tox->name_change != NULL)
+            {
+                tox->name_change(tox, event->friendnumber, event->data,
+                    event->length, tox->name_change_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_STATUS_MESSAGE:
+            if (f != NULL)
+            {
+                f->status_message_length = MIN(event->length,
+                    TOX_MAX_STATUSMESSAGE_LENGTH);
+                memcpy(f->status_message, event->data,
+                       f->status_message_length);
+            }
+            if (tox->status_message_change != NULL)
+            {
+                tox->status_message_change(tox, event->friendnumber,
+                    event->data, event->length,
+                    tox->status_message_change_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_USER_STATUS:
+            if (f != NULL)
+            {
+                f->user_status = (uint8_t)event->arg;
+            }
+            if (tox->user_status_change != NULL)
+            {
+                tox->user_status_change(tox, event->friendnumber,
+                    (uint8_t)event->arg, tox->user_status_change_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_TYPING:
+            if (tox->typing_change != NULL)
+            {
+                tox->typing_change(tox, event->friendnumber,
+                    (uint8_t)event->arg, tox->typing_change_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_CONNECTION:
+            if (f != NULL)
+            {
+                f->online = (uint8_t)event->arg;
+            }
+            if (tox->connection_status != NULL)
+            {
+                tox->connection_status(tox, event->friendnumber,
+                    (uint8_t)event->arg, tox->connection_status_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_RECEIPT:
+            if (tox->read_receipt != NULL)
+            {
+                tox->read_receipt(tox, event->friendnumber, event->arg,
+                    tox->read_receipt_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_REQUEST:
+            if (tox->friend_request != NULL)
+            {
+                tox->friend_request(tox, event->data, event->extra,
+                    event->extra_length, tox->friend_request_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_FILE_SEND_REQUEST:
+            // an offer injected as a plain event, the data will follow as
+            // FILE_DATA events. the file still has to exist for the plugin
+            // to accept it
+            if ((f != NULL) && (mock_tox_find_file(tox, event->friendnumber,
+                    (uint8_t)event->arg, TRUE) == NULL))
+            {
+                file = g_new0(mock_file, 1);
+                file->friendnumber = event->friendnumber;
+                file->filenumber = (uint8_t)event->arg;
+                file->incoming = TRUE;
+                file->size = event->size;
+                tox->files = g_list_append(tox->files, file);
+            }
+            if (tox->file_send_request != NULL)
+            {
+                tox->file_send_request(tox, event->friendnumber,
+                    (uint8_t)event->arg, event->size, event->data,
+                    event->length, tox->file_send_request_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_FILE_CONTROL:
+            // the plugin expects receive_send 1 for files it is sending
+            file = mock_tox_find_file(tox, event->friendnumber,
+                (uint8_t)event->arg, event->send_receive == 0);
+            if ((file != NULL) && (event->control == TOX_FILECONTROL_ACCEPT))
+            {
+                file->accepted = TRUE;
+            }
+            if ((file != NULL) && (event->control == TOX_FILECONTROL_FINISHED))
+            {
+                file->done = TRUE;
+            }
+            if (tox->file_control != NULL)
+            {
+                tox->file_control(tox, event->friendnumber,
+                    event->send_receive, (uint8_t)event->arg, event->control,
+                    event->data, event->length, tox->file_control_data);
+            }
+            if ((file != NULL) && (event->control == TOX_FILECONTROL_KILL))
+            {
+                mock_tox_remove_file(tox, file);
+            }
+            break;
+        case MOCK_TOX_EVENT_FILE_DATA:
+            file = mock_tox_find_file(tox, event->friendnumber,
+                                      (uint8_t)event->arg, TRUE);
+            if ((file != NULL) && (file->chunks_per_tick == 0))
+            {
+                file->transferred += event->length;
+            }
+            tox->stats.file_bytes_received += event->length;
+            if (tox->file_data != NULL)
+            {
+                tox->file_data(tox, event->friendnumber, (uint8_t)event->arg,
+                    event->data, event->length, tox->file_data_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_GROUP_INVITE:
+            if ((tox->group_invite != NULL) &&
+                (event->length >= TOX_CLIENT_ID_SIZE))
+            {
+                tox->group_invite(tox, event->friendnumber, event->data,
+                    tox->group_invite_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_GROUP_MESSAGE:
+        case MOCK_TOX_EVENT_GROUP_ACTION:
+            // nothing arrives for a group that was left in the meantime
+            if (mock_tox_get_group(tox, event->friendnumber) == NULL)
+            {
+                break;
+            }
+            if ((event->type == MOCK_TOX_EVENT_GROUP_MESSAGE) &&
+                (tox->group_message != NULL))
+            {
+                tox->group_message(tox, event->friendnumber, (int)event->arg,
+                    event->data, event->length, tox->group_message_data);
+            }
+            else if ((event->type == MOCK_TOX_EVENT_GROUP_ACTION) &&
+                     (tox->group_action != NULL))
+            {
+                tox->group_action(tox, event->friendnumber, (int)event->arg,
+                    event->data, event->length, tox->group_action_data);
+            }
+            break;
+        case MOCK_TOX_EVENT_GROUP_NAMELIST:
+            group = mock_tox_get_group(tox, event->friendnumber);
+            peernumber = (int)event->arg;
+            if (group == NULL)
+            {
+                break;
+            }
+            if (event->control == TOX_CHAT_CHANGE_PEER_ADD)
+            {
+                g_ptr_array_add(group->peers, g_strndup(
+                    (const gchar *)event->data, event->length));
+                peernumber = (int)group->peers->len - 1;
+            }
+            else if ((peernumber < 0) ||
+                     ((guint)peernumber >= group->peers->len))
+            {
+                break;
+            }
+            else if (event->control == TOX_CHAT_CHANGE_PEER_DEL)
+            {
+                g_ptr_array_remove_index_fast(group->peers, peernumber);
+            }
+            else
+            {
+                g_free(g_ptr_array_index(group->peers, peernumber));
+                g_ptr_array_index(group->peers, peernumber) =
+                    g_strndup((const gchar *)event->data, event->length);
+            }
+            if (tox->group_namelist_change != NULL)
+            {
+                tox->group_namelist_change(tox, event->friendnumber,
+                    peernumber, event->control,
+                    tox->group_namelist_change_data);
+            }
+            break;
+        default:
+            break;
+    }
+
+    tox->stats.events++;
+    if (tox->event_hook != NULL)
+    {
+        tox->event_hook(tox, event, delivered, g_get_monotonic_time(),
+                        tox->event_hook_data);
+    }
+}
+
+// feeds accepted incoming files, one chunk after the other
+static void mock_tox_stream_files(Tox *tox)
+{
+    GList *iter = tox->files;
+    while (iter != NULL)
+    {
+        mock_file *file = iter->data;
+        iter = iter->next;
+        if (!file->incoming || !file->accepted || file->done ||
+            (file->chunks_per_tick == 0))
+        {
+            continue;
+        }
+
+        mock_tox_event event;
+        memset(&event, 0, sizeof(event));
+        event.type = MOCK_TOX_EVENT_FILE_DATA;
+        event.friendnumber = file->friendnumber;
+        event.arg = file->filenumber;
+        event.data = mock_tox_file_pattern;
+        event.due = tox->tick;
+
+        guint chunk;
+        for (chunk = 0; (chunk < file->chunks_per_tick) &&
+                        (file->transferred < file->size); chunk++)
+        {
+            event.length = (uint16_t)MIN(file->size - file->transferred,
+                                         MOCK_TOX_FILE_DATA_SIZE);
+            event.injected = g_get_monotonic_time();
+            file->transferred += event.length;
+            mock_tox_deliver(tox, &event);
+        }
+
+        if (file->transferred == file->size)
+        {
+            file->done = TRUE;
+            event.type = MOCK_TOX_EVENT_FILE_CONTROL;
+            event.control = TOX_FILECONTROL_FINISHED;
+            event.send_receive = 0;
+            event.data = NULL;
+            event.length = 0;
+            event.injected = g_get_monotonic_time();
+            mock_tox_deliver(tox, &event);
+        }
+    }
+}
+
+static int mock_tox_save_put(uint8_t *p, uint64_t value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; i++)
+    {
+        p[i] = (uint8_t)(value >> (8 * i));
+    }
+    return bytes;
+}
+
+static uint64_t mock_tox_save_get(const uint8_t *p, int bytes)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = bytes - 1; i >= 0; i--)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+/* scripting interface */
+void mock_tox_set_seed(guint32 seed)
+{
+    g_rand_set_seed(mock_tox_get_rand(), seed);
+}
+
+void mock_tox_set_new_hook(mock_tox_new_hook hook, void *user_data)
+{
+    mock_tox_new_cb = hook;
+    mock_tox_new_cb_data = user_data;
+}
+
+void mock_tox_set_event_hook(Tox *tox, mock_tox_event_hook hook,
+                             void *user_data)
+{
+    tox->event_hook = hook;
+    tox->event_hook_data = user_data;
+}
+
+void mock_tox_set_send_hook(Tox *tox, mock_tox_send_hook hook,
+                            void *user_data)
+{
+    tox->send_hook = hook;
+    tox->send_hook_data = user_data;
+}
+
+void mock_tox_set_connect_delay(Tox *tox, guint ticks)
+{
+    tox->connect_delay = ticks;
+}
+
+void mock_tox_set_receipt_delay(Tox *tox, guint ticks)
+{
+    tox->receipt_delay = ticks;
+}
+
+void mock_tox_set_event_budget(Tox *tox, guint events)
+{
+    tox->event_budget = events;
+}
+
+void mock_tox_set_file_window(Tox *tox, guint chunks)
+{
+    tox->file_window = chunks;
+}
+
+void mock_tox_set_auto_accept(Tox *tox, gboolean accept)
+{
+    tox->auto_accept = accept;
+}
+
+void mock_tox_random_client_id(uint8_t *client_id)
+{
+    GRand *rand = mock_tox_get_rand();
+    guint i;
+    for (i = 0; i < TOX_CLIENT_ID_SIZE; i += sizeof(guint32))
+    {
+        guint32 value = g_rand_int(rand);
+        memcpy(client_id + i, &value, sizeof(value));
+    }
+}
+
+int32_t mock_tox_add_friend(Tox *tox, const uint8_t *client_id,
+                            const char *name)
+{
+    if (g_hash_table_lookup(tox->friend_index, client_id) != NULL)
+    {
+        return -1;
+    }
+
+    int32_t friendnumber = mock_tox_insert_friend(tox, client_id);
+    if (name != NULL)
+    {
+        mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+        f->name_length = MIN(strlen(name) + 1, TOX_MAX_NAME_LENGTH);
+        memcpy(f->name, name, f->name_length);
+        f->name[TOX_MAX_NAME_LENGTH - 1] = '\0';
+    }
+    return friendnumber;
+}
+
+void mock_tox_add_friends(Tox *tox, guint count)
+{
+    uint8_t client_id[TOX_CLIENT_ID_SIZE];
+    guint i;
+    for (i = 0; i < count; i++)
+    {
+        gchar *name = g_strdup_printf("friend-%u", tox->friends->len);
+        mock_tox_random_client_id(client_id);
+        mock_tox_add_friend(tox, client_id, name);
+        g_free(name);
+    }
+}
+
+void mock_tox_set_online(Tox *tox, int32_t friendnumber, gboolean online)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    if (f != NULL)
+    {
+        f->online = online ? 1 : 0;
+    }
+}
+
+void mock_tox_inject(Tox *tox, mock_tox_event_type type,
+                     int32_t friendnumber, uint32_t arg,
+                     const void *data, uint16_t length, guint delay)
+{
+    mock_tox_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.friendnumber = friendnumber;
+    event.arg = arg;
+    event.data = (uint8_t *)data;
+    event.length = length;
+    mock_tox_inject_event(tox, &event, delay);
+}
+
+void mock_tox_inject_event(Tox *tox, const mock_tox_event *event,
+                           guint delay)
+{
+    mock_tox_event *copy = g_memdup(event, sizeof(mock_tox_event));
+    copy->data = event->data == NULL ? NULL :
+        g_memdup(event->data, event->length);
+    copy->extra = event->extra == NULL ? NULL :
+        g_memdup(event->extra, event->extra_length);
+    copy->injected = g_get_monotonic_time();
+    mock_tox_queue(tox, copy, delay);
+}
+
+void mock_tox_inject_request(Tox *tox, const uint8_t *client_id,
+                             const char *message)
+{
+    mock_tox_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = MOCK_TOX_EVENT_REQUEST;
+    event.friendnumber = -1;
+    event.data = (uint8_t *)client_id;
+    event.length = TOX_CLIENT_ID_SIZE;
+    event.extra = (uint8_t *)message;
+    event.extra_length = (uint16_t)strlen(message) + 1;
+    mock_tox_inject_event(tox, &event, 0);
+}
+
+int mock_tox_inject_file(Tox *tox, int32_t friendnumber, uint64_t size,
+                         const char *filename, guint chunks_per_tick)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    g_return_val_if_fail(f != NULL, -1);
+
+    mock_file *file = g_new0(mock_file, 1);
+    file->friendnumber = friendnumber;
+    file->filenumber = f->next_filenumber++;
+    file->incoming = TRUE;
+    file->size = size;
+    file->chunks_per_tick = MAX(chunks_per_tick, 1);
+    tox->files = g_list_append(tox->files, file);
+
+    mock_tox_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = MOCK_TOX_EVENT_FILE_SEND_REQUEST;
+    event.friendnumber = friendnumber;
+    event.arg = file->filenumber;
+    event.size = size;
+    event.data = (uint8_t *)filename;
+    event.length = (uint16_t)strlen(filename) + 1;
+    mock_tox_inject_event(tox, &event, 0);
+    return file->filenumber;
+}
+
+void mock_tox_inject_namelist(Tox *tox, int groupnumber, int peernumber,
+                              uint8_t change, const char *name)
+{
+    mock_tox_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = MOCK_TOX_EVENT_GROUP_NAMELIST;
+    event.friendnumber = groupnumber;
+    event.arg = (uint32_t)peernumber;
+    event.control = change;
+    event.data = (uint8_t *)name;
+    event.length = name != NULL ? (uint16_t)strlen(name) + 1 : 0;
+    mock_tox_inject_event(tox, &event, 0);
+}
+
+gboolean mock_tox_file_done(Tox *tox, int32_t friendnumber, int filenumber)
+{
+    mock_file *file = mock_tox_find_file(tox, friendnumber,
+                                         (uint8_t)filenumber, TRUE);
+    return (file != NULL) && file->done;
+}
+
+guint mock_tox_pending(Tox *tox)
+{
+    guint pending = g_queue_get_length(tox->events);
+    GList *iter;
+    for (iter = tox->files; iter != NULL; iter = iter->next)
+    {
+        mock_file *file = iter->data;
+        if (file->incoming && file->accepted && !file->done &&
+            (file->chunks_per_tick > 0))
+        {
+            pending++;
+        }
+    }
+    return pending;
+}
+
+const mock_tox_stats *mock_tox_get_stats(Tox *tox)
+{
+    return &tox->stats;
+}
+
+const char *mock_tox_event_name(mock_tox_event_type type)
+{
+    g_return_val_if_fail(type < MOCK_TOX_EVENT_COUNT, "unknown");
+    return mock_tox_event_names[type];
+}
+
+/* tox.h */
+Tox *tox_new(uint8_t ipv6enabled)
+{
+    Tox *tox = g_new0(Tox, 1);
+    guint i;
+
+    mock_tox_random_client_id(tox->self_id);
+    tox->nospam = g_rand_int(mock_tox_get_rand());
+    tox->friends = g_array_new(FALSE, FALSE, sizeof(mock_friend));
+    tox->friend_index = g_hash_table_new_full(mock_tox_client_id_hash,
+        mock_tox_client_id_equal, g_free, NULL);
+    tox->events = g_queue_new();
+    tox->groups = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)mock_tox_group_free);
+    tox->connect_delay = 1;
+    tox->receipt_delay = 1;
+    tox->auto_accept = TRUE;
+
+    for (i = 0; i < sizeof(mock_tox_file_pattern); i++)
+    {
+        mock_tox_file_pattern[i] = (uint8_t)i;
+    }
+
+    if (mock_tox_new_cb != NULL)
+    {
+        mock_tox_new_cb(tox, mock_tox_new_cb_data);
+    }
+    return tox;
+}
+
+void tox_kill(Tox *tox)
+{
+    g_queue_free_full(tox->events, (GDestroyNotify)mock_tox_event_free);
+    g_list_free_full(tox->files, g_free);
+    g_ptr_array_free(tox->groups, TRUE);
+    g_hash_table_destroy(tox->friend_index);
+    g_array_free(tox->friends, TRUE);
+    g_free(tox);
+}
+
+void tox_do(Tox *tox)
+{
+    guint delivered = 0;
+    guint i;
+
+    tox->tick++;
+    tox->stats.ticks++;
+    for (i = 0; i < tox->friends->len; i++)
+    {
+        g_array_index(tox->friends, mock_friend, i).window_used = 0;
+    }
+
+    while (!g_queue_is_empty(tox->events))
+    {
+        mock_tox_event *event = g_queue_peek_head(tox->events);
+        if ((event->due > tox->tick) ||
+            ((tox->event_budget > 0) && (delivered >= tox->event_budget)))
+        {
+            break;
+        }
+        g_queue_pop_head(tox->events);
+        mock_tox_deliver(tox, event);
+        mock_tox_event_free(event);
+        delivered++;
+    }
+
+    mock_tox_stream_files(tox);
+}
+
+int tox_isconnected(Tox *tox)
+{
+    return tox->tick >= tox->connect_delay;
+}
+
+int tox_bootstrap_from_address(Tox *tox, const char *address,
+                               uint8_t ipv6enabled, uint16_t port,
+                               uint8_t *public_key)
+{
+    return 1;
+}
+
+uint32_t tox_size(Tox *tox)
+{
+    uint32_t size = 4 + TOX_CLIENT_ID_SIZE + 4 + 2 + tox->name_length + 4;
+    guint i;
+    for (i = 0; i < tox->friends->len; i++)
+    {
+        mock_friend *f = &g_array_index(tox->friends, mock_friend, i);
+        if (f->exists)
+        {
+            size += TOX_CLIENT_ID_SIZE + 2 + f->name_length;
+        }
+    }
+    return size;
+}
+
+void tox_save(Tox *tox, uint8_t *data)
+{
+    uint8_t *p = data;
+    guint i;
+
+    memcpy(p, MOCK_TOX_SAVE_MAGIC, 4);
+    p += 4;
+    memcpy(p, tox->self_id, TOX_CLIENT_ID_SIZE);
+    p += TOX_CLIENT_ID_SIZE;
+    p += mock_tox_save_put(p, tox->nospam, 4);
+    p += mock_tox_save_put(p, tox->name_length, 2);
+    memcpy(p, tox->name, tox->name_length);
+    p += tox->name_length;
+    p += mock_tox_save_put(p, tox_count_friendlist(tox), 4);
+    for (i = 0; i < tox->friends->len; i++)
+    {
+        mock_friend *f = &g_array_index(tox->friends, mock_friend, i);
+        if (f->exists)
+        {
+            memcpy(p, f->client_id, TOX_CLIENT_ID_SIZE);
+            p += TOX_CLIENT_ID_SIZE;
+            p += mock_tox_save_put(p, f->name_length, 2);
+            memcpy(p, f->name, f->name_length);
+            p += f->name_length;
+        }
+    }
+
+    tox->stats.saves++;
+    tox->stats.save_bytes += p - data;
+}
+
+int tox_load(Tox *tox, uint8_t *data, uint32_t length)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + length;
+    uint32_t count, i;
+
+    if ((length < 4 + TOX_CLIENT_ID_SIZE + 4 + 2 + 4) ||
+        (memcmp(p, MOCK_TOX_SAVE_MAGIC, 4) != 0))
+    {
+        return -1;
+    }
+    p += 4;
+    memcpy(tox->self_id, p, TOX_CLIENT_ID_SIZE);
+    p += TOX_CLIENT_ID_SIZE;
+    tox->nospam = (uint32_t)mock_tox_save_get(p, 4);
+    p += 4;
+    tox->name_length = (uint16_t)mock_tox_save_get(p, 2);
+    p += 2;
+    if ((tox->name_length > TOX_MAX_NAME_LENGTH) ||
+        (end - p < tox->name_length + 4))
+    {
+        return -1;
+    }
+    memcpy(tox->name, p, tox->name_length);
+    p += tox->name_length;
+    count = (uint32_t)mock_tox_save_get(p, 4);
+    p += 4;
+
+    g_array_set_size(tox->friends, 0);
+    g_hash_table_remove_all(tox->friend_index);
+    for (i = 0; i < count; i++)
+    {
+        if (end - p < TOX_CLIENT_ID_SIZE + 2)
+        {
+            return -1;
+        }
+        int32_t friendnumber = mock_tox_insert_friend(tox, p);
+        mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+        p += TOX_CLIENT_ID_SIZE;
+        f->name_length = (uint16_t)mock_tox_save_get(p, 2);
+        p += 2;
+        if ((f->name_length > TOX_MAX_NAME_LENGTH) ||
+            (end - p < f->name_length))
+        {
+            return -1;
+        }
+        memcpy(f->name, p, f->name_length);
+        p += f->name_length;
+    }
+    return 0;
+}
+
+void tox_get_address(Tox *tox, uint8_t *address)
+{
+    memcpy(address, tox->self_id, TOX_CLIENT_ID_SIZE);
+    mock_tox_save_put(address + TOX_CLIENT_ID_SIZE, tox->nospam, 4);
+    mock_tox_checksum(address, address + TOX_CLIENT_ID_SIZE + 4);
+}
+
+int32_t tox_add_friend(Tox *tox, uint8_t *address, uint8_t *data,
+                       uint16_t length)
+{
+    uint8_t checksum[2];
+
+    if (length > MOCK_TOX_MAX_REQUEST)
+    {
+        return TOX_FAERR_TOOLONG;
+    }
+    if (length < 1)
+    {
+        return TOX_FAERR_NOMESSAGE;
+    }
+    if (memcmp(address, tox->self_id, TOX_CLIENT_ID_SIZE) == 0)
+    {
+        return TOX_FAERR_OWNKEY;
+    }
+    mock_tox_checksum(address, checksum);
+    if (memcmp(checksum, address + TOX_CLIENT_ID_SIZE + 4, 2) != 0)
+    {
+        return TOX_FAERR_BADCHECKSUM;
+    }
+    if (g_hash_table_lookup(tox->friend_index, address) != NULL)
+    {
+        return TOX_FAERR_ALREADYSENT;
+    }
+    return mock_tox_insert_friend(tox, address);
+}
+
+int32_t tox_add_friend_norequest(Tox *tox, uint8_t *client_id)
+{
+    if (g_hash_table_lookup(tox->friend_index, client_id) != NULL)
+    {
+        return -1;
+    }
+    return mock_tox_insert_friend(tox, client_id);
+}
+
+int32_t tox_get_friend_number(Tox *tox, uint8_t *client_id)
+{
+    return GPOINTER_TO_INT(g_hash_table_lookup(tox->friend_index,
+                                               client_id)) - 1;
+}
+
+int tox_get_client_id(Tox *tox, int32_t friendnumber, uint8_t *client_id)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    if (f == NULL)
+    {
+        return -1;
+    }
+    memcpy(client_id, f->client_id, TOX_CLIENT_ID_SIZE);
+    return 0;
+}
+
+int tox_del_friend(Tox *tox, int32_t friendnumber)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    if (f == NULL)
+    {
+        return -1;
+    }
+    g_hash_table_remove(tox->friend_index, f->client_id);
+    f->exists = FALSE;
+    return 0;
+}
+
+int tox_get_friend_connection_status(Tox *tox, int32_t friendnumber)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    return f == NULL ? -1 : f->online;
+}
+
+int tox_friend_exists(Tox *tox, int32_t friendnumber)
+{
+    return mock_tox_get_friend(tox, friendnumber) != NULL;
+}
+
+static uint32_t mock_tox_send(Tox *tox, int32_t friendnumber, uint32_t id,
+                              uint8_t *data, uint32_t length,
+                              gboolean action)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    if ((f == NULL) || !f->online || (length > TOX_MAX_MESSAGE_LENGTH))
+    {
+        tox->stats.send_failures++;
+        return 0;
+    }
+
+    if (action)
+    {
+        tox->stats.actions_sent++;
+    }
+    else
+    {
+        tox->stats.messages_sent++;
+    }
+    tox->stats.bytes_sent += length;
+
+    if (tox->send_hook != NULL)
+    {
+        tox->send_hook(tox, friendnumber, id, action, data, (uint16_t)length,
+                       tox->send_hook_data);
+    }
+
+    if (!action && (tox->receipt_delay > 0))
+    {
+        mock_tox_inject(tox, MOCK_TOX_EVENT_RECEIPT, friendnumber, id, NULL,
+                        0, tox->receipt_delay - 1);
+    }
+    return id;
+}
+
+static uint32_t mock_tox_next_message_id(Tox *tox)
+{
+    if (++tox->next_message_id == 0)
+    {
+        tox->next_message_id = 1;
+    }
+    return tox->next_message_id;
+}
+
+uint32_t tox_send_message(Tox *tox, int32_t friendnumber, uint8_t *message,
+                          uint32_t length)
+{
+    return mock_tox_send(tox, friendnumber, mock_tox_next_message_id(tox),
+                         message, length, FALSE);
+}
+
+uint32_t tox_send_message_withid(Tox *tox, int32_t friendnumber,
+                                 uint32_t theid, uint8_t *message,
+                                 uint32_t length)
+{
+    return mock_tox_send(tox, friendnumber, theid, message, length, FALSE);
+}
+
+uint32_t tox_send_action(Tox *tox, int32_t friendnumber, uint8_t *action,
+                         uint32_t length)
+{
+    return mock_tox_send(tox, friendnumber, mock_tox_next_message_id(tox),
+                         action, length, TRUE);
+}
+
+uint32_t tox_send_action_withid(Tox *tox, int32_t friendnumber,
+                                uint32_t theid, uint8_t *action,
+                                uint32_t length)
+{
+    return mock_tox_send(tox, friendnumber, theid, action, length, TRUE);
+}
+
+int tox_set_name(Tox *tox, uint8_t *name, uint16_t length)
+{
+    if (length > TOX_MAX_NAME_LENGTH)
+    {
+        return -1;
+    }
+    memcpy(tox->name, name, length);
+    tox->name_length = length;
+    return 0;
+}
+
+uint16_t tox_get_self_name(Tox *tox, uint8_t *name)
+{
+    memcpy(name, tox->name, tox->name_length);
+    return tox->name_length;
+}
+
+int tox_get_name(Tox *tox, int32_t friendnumber, uint8_t *name)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    if (f == NULL)
+    {
+        return -1;
+    }
+    memcpy(name, f->name, f->name_length);
+    return f->name_length;
+}
+
+int tox_set_status_message(Tox *tox, uint8_t *status, uint16_t length)
+{
+    if (length > TOX_MAX_STATUSMESSAGE_LENGTH)
+    {
+        return -1;
+    }
+    memcpy(tox->status_message, status, length);
+    tox->status_message_length = length;
+    return 0;
+}
+
+int tox_set_user_status(Tox *tox, uint8_t userstatus)
+{
+    if (userstatus >= TOX_USERSTATUS_INVALID)
+    {
+        return -1;
+    }
+    tox->user_status = userstatus;
+    return 0;
+}
+
+int tox_get_status_message(Tox *tox, int32_t friendnumber, uint8_t *buf,
+                           uint32_t maxlen)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    if (f == NULL)
+    {
+        return -1;
+    }
+    uint32_t length = MIN(maxlen, f->status_message_length);
+    memcpy(buf, f->status_message, length);
+    return (int)length;
+}
+
+uint8_t tox_get_user_status(Tox *tox, int32_t friendnumber)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    return f == NULL ? TOX_USERSTATUS_INVALID : f->user_status;
+}
+
+uint64_t tox_get_last_online(Tox *tox, int32_t friendnumber)
+{
+    return 0;
+}
+
+int tox_set_user_is_typing(Tox *tox, int32_t friendnumber, uint8_t is_typing)
+{
+    if (mock_tox_get_friend(tox, friendnumber) == NULL)
+    {
+        return -1;
+    }
+    tox->stats.typing_sent++;
+    return 0;
+}
+
+void tox_set_sends_receipts(Tox *tox, int32_t friendnumber, int yesno)
+{
+}
+
+uint32_t tox_count_friendlist(Tox *tox)
+{
+    return g_hash_table_size(tox->friend_index);
+}
+
+uint32_t tox_get_num_online_friends(Tox *tox)
+{
+    uint32_t online = 0;
+    guint i;
+    for (i = 0; i < tox->friends->len; i++)
+    {
+        mock_friend *f = &g_array_index(tox->friends, mock_friend, i);
+        if (f->exists && f->online)
+        {
+            online++;
+        }
+    }
+    return online;
+}
+
+uint32_t tox_get_friendlist(Tox *tox, int32_t *out_list, uint32_t list_size)
+{
+    uint32_t count = 0;
+    guint i;
+    for (i = 0; (i < tox->friends->len) && (count < list_size); i++)
+    {
+        if (g_array_index(tox->friends, mock_friend, i).exists)
+        {
+            out_list[count++] = (int32_t)i;
+        }
+    }
+    return count;
+}
+
+void tox_callback_friend_request(Tox *tox,
+    void (*function)(Tox *tox, uint8_t *, uint8_t *, uint16_t, void *),
+    void *userdata)
+{
+    tox->friend_request = function;
+    tox->friend_request_data = userdata;
+}
+
+void tox_callback_friend_message(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint8_t *, uint16_t, void *),
+    void *userdata)
+{
+    tox->friend_message = function;
+    tox->friend_message_data = userdata;
+}
+
+void tox_callback_friend_action(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint8_t *, uint16_t, void *),
+    void *userdata)
+{
+    tox->friend_action = function;
+    tox->friend_action_data = userdata;
+}
+
+void tox_callback_name_change(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint8_t *, uint16_t, void *),
+    void *userdata)
+{
+    tox->name_change = function;
+    tox->name_change_data = userdata;
+}
+
+void tox_callback_status_message(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint8_t *, uint16_t, void *),
+    void *userdata)
+{
+    tox->status_message_change = function;
+    tox->status_message_change_data = userdata;
+}
+
+void tox_callback_user_status(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint8_t, void *), void *userdata)
+{
+    tox->user_status_change = function;
+    tox->user_status_change_data = userdata;
+}
+
+void tox_callback_typing_change(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint8_t, void *), void *userdata)
+{
+    tox->typing_change = function;
+    tox->typing_change_data = userdata;
+}
+
+void tox_callback_read_receipt(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint32_t, void *), void *userdata)
+{
+    tox->read_receipt = function;
+    tox->read_receipt_data = userdata;
+}
+
+void tox_callback_connection_status(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint8_t, void *), void *userdata)
+{
+    tox->connection_status = function;
+    tox->connection_status_data = userdata;
+}
+
+void tox_callback_file_send_request(Tox *tox,
+    void (*function)(Tox *m, int32_t, uint8_t, uint64_t, uint8_t *, uint16_t,
+                     void *),
+    void *userdata)
+{
+    tox->file_send_request = function;
+    tox->file_send_request_data = userdata;
+}
+
+void tox_callback_file_control(Tox *tox,
+    void (*function)(Tox *m, int32_t, uint8_t, uint8_t, uint8_t, uint8_t *,
+                     uint16_t, void *),
+    void *userdata)
+{
+    tox->file_control = function;
+    tox->file_control_data = userdata;
+}
+
+void tox_callback_file_data(Tox *tox,
+    void (*function)(Tox *m, int32_t, uint8_t, uint8_t *, uint16_t length,
+                     void *),
+    void *userdata)
+{
+    tox->file_data = function;
+    tox->file_data_data = userdata;
+}
+
+void tox_callback_group_invite(Tox *tox,
+    void (*function)(Tox *tox, int32_t, uint8_t *, void *), void *userdata)
+{
+    tox->group_invite = function;
+    tox->group_invite_data = userdata;
+}
+
+void tox_callback_group_message(Tox *tox,
+    void (*function)(Tox *tox, int, int, uint8_t *, uint16_t, void *),
+    void *userdata)
+{
+    tox->group_message = function;
+    tox->group_message_data = userdata;
+}
+
+void tox_callback_group_action(Tox *tox,
+    void (*function)(Tox *tox, int, int, uint8_t *, uint16_t, void *),
+    void *userdata)
+{
+    tox->group_action = function;
+    tox->group_action_data = userdata;
+}
+
+void tox_callback_group_namelist_change(Tox *tox,
+    void (*function)(Tox *tox, int, int, uint8_t, void *), void *userdata)
+{
+    tox->group_namelist_change = function;
+    tox->group_namelist_change_data = userdata;
+}
+
+int tox_new_file_sender(Tox *tox, int32_t friendnumber, uint64_t filesize,
+                        uint8_t *filename, uint16_t filename_length)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    if ((f == NULL) || !f->online)
+    {
+        return -1;
+    }
+
+    mock_file *file = g_new0(mock_file, 1);
+    file->friendnumber = friendnumber;
+    file->filenumber = f->next_filenumber++;
+    file->size = filesize;
+    tox->files = g_list_append(tox->files, file);
+
+    if (tox->auto_accept)
+    {
+        mock_tox_event event;
+        memset(&event, 0, sizeof(event));
+        event.type = MOCK_TOX_EVENT_FILE_CONTROL;
+        event.friendnumber = friendnumber;
+        event.arg = file->filenumber;
+        event.control = TOX_FILECONTROL_ACCEPT;
+        event.send_receive = 1;
+        mock_tox_inject_event(tox, &event, 0);
+    }
+    return file->filenumber;
+}
+
+int tox_file_send_control(Tox *tox, int32_t friendnumber,
+                          uint8_t send_receive, uint8_t filenumber,
+                          uint8_t message_id, uint8_t *data, uint16_t length)
+{
+    mock_file *file = mock_tox_find_file(tox, friendnumber, filenumber,
+                                         send_receive == 1);
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    tox->stats.file_controls_sent++;
+    switch (message_id)
+    {
+        case TOX_FILECONTROL_ACCEPT:
+            file->accepted = TRUE;
+            break;
+        case TOX_FILECONTROL_KILL:
+            mock_tox_remove_file(tox, file);
+            break;
+        case TOX_FILECONTROL_FINISHED:
+            file->done = TRUE;
+            break;
+    }
+    return 0;
+}
+
+int tox_file_send_data(Tox *tox, int32_t friendnumber, uint8_t filenumber,
+                       uint8_t *data, uint16_t length)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    mock_file *file = mock_tox_find_file(tox, friendnumber, filenumber,
+                                         FALSE);
+    if ((f == NULL) || (file == NULL) || !file->accepted ||
+        (length > MOCK_TOX_FILE_DATA_SIZE) ||
+        (file->transferred + length > file->size))
+    {
+        return -1;
+    }
+    if ((tox->file_window > 0) && (f->window_used >= tox->file_window))
+    {
+        return -1;
+    }
+
+    f->window_used++;
+    file->transferred += length;
+    tox->stats.file_bytes_sent += length;
+    if (file->transferred == file->size)
+    {
+        file->done = TRUE;
+    }
+    return 0;
+}
+
+int tox_file_data_size(Tox *tox, int32_t friendnumber)
+{
+    return MOCK_TOX_FILE_DATA_SIZE;
+}
+
+uint64_t tox_file_data_remaining(Tox *tox, int32_t friendnumber,
+                                 uint8_t filenumber, uint8_t send_receive)
+{
+    mock_file *file = mock_tox_find_file(tox, friendnumber, filenumber,
+                                         send_receive == 1);
+    return file == NULL ? 0 : file->size - file->transferred;
+}
+
+int tox_add_groupchat(Tox *tox)
+{
+    return mock_tox_new_group(tox);
+}
+
+int tox_del_groupchat(Tox *tox, int groupnumber)
+{
+    if (mock_tox_get_group(tox, groupnumber) == NULL)
+    {
+        return -1;
+    }
+    mock_tox_group_free(g_ptr_array_index(tox->groups, groupnumber));
+    g_ptr_array_index(tox->groups, groupnumber) = NULL;
+    return 0;
+}
+
+int tox_group_peername(Tox *tox, int groupnumber, int peernumber,
+                       uint8_t *name)
+{
+    mock_group *group = mock_tox_get_group(tox, groupnumber);
+    if ((group == NULL) || (peernumber < 0) ||
+        ((guint)peernumber >= group->peers->len))
+    {
+        return -1;
+    }
+    const gchar *peer = g_ptr_array_index(group->peers, peernumber);
+    int length = (int)MIN(strlen(peer) + 1, TOX_MAX_NAME_LENGTH);
+    memcpy(name, peer, length);
+    return length;
+}
+
+int tox_invite_friend(Tox *tox, int32_t friendnumber, int groupnumber)
+{
+    mock_friend *f = mock_tox_get_friend(tox, friendnumber);
+    if ((f == NULL) || !f->online ||
+        (mock_tox_get_group(tox, groupnumber) == NULL))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int tox_join_groupchat(Tox *tox, int32_t friendnumber,
+                       uint8_t *friend_group_public_key)
+{
+    if (mock_tox_get_friend(tox, friendnumber) == NULL)
+    {
+        return -1;
+    }
+    return mock_tox_new_group(tox);
+}
+
+// like the core, our own messages come back through the callbacks, from
+// peer -1. sending fails while nobody else is in the group
+static int mock_tox_group_send(Tox *tox, int groupnumber, uint8_t *data,
+                               uint32_t length, gboolean action)
+{
+    mock_group *group = mock_tox_get_group(tox, groupnumber);
+    if ((group == NULL) || (group->peers->len == 0) ||
+        (length > TOX_MAX_MESSAGE_LENGTH))
+    {
+        tox->stats.send_failures++;
+        return -1;
+    }
+
+    tox->stats.group_messages_sent++;
+    tox->stats.bytes_sent += length;
+    mock_tox_inject(tox, action ? MOCK_TOX_EVENT_GROUP_ACTION :
+                    MOCK_TOX_EVENT_GROUP_MESSAGE, groupnumber, (uint32_t)-1,
+                    data, (uint16_t)length, 0);
+    return 0;
+}
+
+int tox_group_message_send(Tox *tox, int groupnumber, uint8_t *message,
+                           uint32_t length)
+{
+    return mock_tox_group_send(tox, groupnumber, message, length, FALSE);
+}
+
+int tox_group_action_send(Tox *tox, int groupnumber, uint8_t *action,
+                          uint32_t length)
+{
+    return mock_tox_group_send(tox, groupnumber, action, length, TRUE);
+}
+
+int tox_group_number_peers(Tox *tox, int groupnumber)
+{
+    mock_group *group = mock_tox_get_group(tox, groupnumber);
+    return group != NULL ? (int)group->peers->len : -1;
+}
@@ -0,0 +1,166 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Scriptable stand-in for libtoxcore. It implements the part of the tox.h API
+ * that the plugin uses without any networking: friends, messages, receipts,
+ * file transfers and group chats only exist in memory. Events are injected from the
+ * outside and delivered to the registered callbacks by tox_do(), just like
+ * the real core delivers what arrived from the network.
+ *
+ * Link it instead of $(LIBTOXCORE_LIBS).
+ */
+
+#ifndef MOCK_TOX_H
+#define MOCK_TOX_H
+
+#include <glib.h>
+#include <tox/tox.h>
+
+#ifndef TOX_MAX_MESSAGE_LENGTH
+    #define TOX_MAX_MESSAGE_LENGTH  1368
+#endif
+
+// what tox_file_data_size() reports, about what the real core fits in a packet
+#define MOCK_TOX_FILE_DATA_SIZE     1371
+
+typedef enum
+{
+    MOCK_TOX_EVENT_MESSAGE,
+    MOCK_TOX_EVENT_ACTION,
+    MOCK_TOX_EVENT_NAME,
+    MOCK_TOX_EVENT_STATUS_MESSAGE,
+    MOCK_TOX_EVENT_USER_STATUS,
+    MOCK_TOX_EVENT_TYPING,
+    MOCK_TOX_EVENT_CONNECTION,
+    MOCK_TOX_EVENT_RECEIPT,
+    MOCK_TOX_EVENT_REQUEST,
+    MOCK_TOX_EVENT_FILE_SEND_REQUEST,
+    MOCK_TOX_EVENT_FILE_CONTROL,
+    MOCK_TOX_EVENT_FILE_DATA,
+    MOCK_TOX_EVENT_GROUP_INVITE,
+    MOCK_TOX_EVENT_GROUP_MESSAGE,
+    MOCK_TOX_EVENT_GROUP_ACTION,
+    MOCK_TOX_EVENT_GROUP_NAMELIST,
+    MOCK_TOX_EVENT_COUNT
+} mock_tox_event_type;
+
+typedef struct
+{
+    mock_tox_event_type type;
+    int32_t friendnumber;   // group number for the group events
+    uint32_t arg;           // status, receipt, file or peer number
+    uint8_t control;        // file control type or peer list change
+    uint8_t send_receive;   // file control direction
+    uint64_t size;          // file size
+    uint8_t *data;          // message, name, key or file data
+    uint16_t length;
+    uint8_t *extra;         // friend request message
+    uint16_t extra_length;
+    guint64 due;            // tox_do() tick the event is delivered on
+    gint64 injected;        // monotonic time in microseconds
+} mock_tox_event;
+
+// called after each delivered event, times are monotonic microseconds
+typedef void (*mock_tox_event_hook)(Tox *tox, const mock_tox_event *event,
+                                    gint64 delivered, gint64 finished,
+                                    void *user_data);
+
+// called for every message or action the plugin hands to the core
+typedef void (*mock_tox_send_hook)(Tox *tox, int32_t friendnumber,
+                                   uint32_t message_id, gboolean action,
+                                   const uint8_t *data, uint16_t length,
+                                   void *user_data);
+
+// called from tox_new() for every new instance, before the plugin sees it
+typedef void (*mock_tox_new_hook)(Tox *tox, void *user_data);
+
+typedef struct
+{
+    guint64 ticks;                  // tox_do() calls
+    guint64 events;                 // events delivered
+    guint64 messages_sent;
+    guint64 actions_sent;
+    guint64 bytes_sent;
+    guint64 send_failures;          // sends refused because of the friend
+    guint64 typing_sent;
+    guint64 file_controls_sent;
+    guint64 file_bytes_sent;
+    guint64 file_bytes_received;
+    guint64 group_messages_sent;    // messages and actions
+    guint64 saves;
+    guint64 save_bytes;
+} mock_tox_stats;
+
+void mock_tox_set_seed(guint32 seed);
+void mock_tox_set_new_hook(mock_tox_new_hook hook, void *user_data);
+
+void mock_tox_set_event_hook(Tox *tox, mock_tox_event_hook hook,
+                             void *user_data);
+void mock_tox_set_send_hook(Tox *tox, mock_tox_send_hook hook,
+                            void *user_data);
+
+// tox_isconnected() turns true after this many tox_do() calls, default 1
+void mock_tox_set_connect_delay(Tox *tox, guint ticks);
+// answer every message with a read receipt after this many tox_do() calls,
+// 0 turns receipts off, default 1
+void mock_tox_set_receipt_delay(Tox *tox, guint ticks);
+// deliver at most this many events per tox_do(), 0 for no limit (default)
+void mock_tox_set_event_budget(Tox *tox, guint events);
+// accept at most this many outgoing file chunks per tox_do() and friend,
+// tox_file_send_data() fails beyond that. 0 for no limit (default)
+void mock_tox_set_file_window(Tox *tox, guint chunks);
+// accept outgoing file transfers on the next tox_do(), default TRUE
+void mock_tox_set_auto_accept(Tox *tox, gboolean accept);
+
+// friends are created with random keys from the seeded generator and are
+// offline until a connection event or mock_tox_set_online() says otherwise
+int32_t mock_tox_add_friend(Tox *tox, const uint8_t *client_id,
+                            const char *name);
+void mock_tox_add_friends(Tox *tox, guint count);
+void mock_tox_set_online(Tox *tox, int32_t friendnumber, gboolean online);
+void mock_tox_random_client_id(uint8_t *client_id);
+
+// queue an event for the next tox_do() (or later with delay > 0)
+void mock_tox_inject(Tox *tox, mock_tox_event_type type,
+                     int32_t friendnumber, uint32_t arg,
+                     const void *data, uint16_t length, guint delay);
+// same for a complete event, data and extra are copied
+void mock_tox_inject_event(Tox *tox, const mock_tox_event *event,
+                           guint delay);
+void mock_tox_inject_request(Tox *tox, const uint8_t *client_id,
+                             const char *message);
+// offer an incoming file, once the plugin accepts it the data is streamed
+// with chunks_per_tick chunks per tox_do() and finished with
+// TOX_FILECONTROL_FINISHED. returns the file number
+int mock_tox_inject_file(Tox *tox, int32_t friendnumber, uint64_t size,
+                         const char *filename, guint chunks_per_tick);
+// a peer joins (TOX_CHAT_CHANGE_PEER_ADD, peernumber is ignored), leaves or
+// changes its name. like the real core, the last peer takes the number of
+// one that leaves
+void mock_tox_inject_namelist(Tox *tox, int groupnumber, int peernumber,
+                              uint8_t change, const char *name);
+// TRUE once the incoming file has been accepted and completely delivered
+gboolean mock_tox_file_done(Tox *tox, int32_t friendnumber, int filenumber);
+
+guint mock_tox_pending(Tox *tox);   // queued events and running transfers
+const mock_tox_stats *mock_tox_get_stats(Tox *tox);
+const char *mock_tox_event_name(mock_tox_event_type type);
+
+#endif
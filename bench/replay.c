@@ -0,0 +1,472 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays a callback capture of the plugin (the "Capture core events for
+ * replay" account option) against the mock core in a headless libpurple.
+ * The events are delivered at the recorded pace, scaled by --speed, or as
+ * fast as the plugin takes them with --speed 0. The friend list consists of
+ * as many anonymous friends as the capture refers to, so friend numbers
+ * match but names and keys do not. File data was captured without its
+ * contents and is replayed as zeros. Group chats are joined through the
+ * recorded invites, the group numbers only match if the capture started
+ * before the groups were joined. The results are printed as JSON.
+ *
+ * usage: replay [options] CAPTURE, see replay --help
+ */
+
+// pull in the plugin to get at its static functions
+#include "toxprpl.c"
+
+#include "headless.h"
+#include "bench_util.h"
+#include "mock_tox.h"
+
+// give up on draining the core when it makes no progress for this long
+#define REPLAY_STALL_TIMEOUT    (10 * G_USEC_PER_SEC)
+// longest sleep between two tox_do() while waiting for the next record
+#define REPLAY_MAX_SLEEP        (10 * 1000)
+
+typedef struct
+{
+    guint64 at;             // microseconds since the start of the capture
+    mock_tox_event event;   // data and extra point into the capture file
+} replay_record;
+
+static gdouble replay_speed = 1.0;
+static gint replay_batch = 256;
+static gboolean replay_verbose = FALSE;
+
+static GOptionEntry replay_options[] =
+{
+    { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &replay_speed,
+      "replay speed relative to the capture, 0 for as fast as possible",
+      "FACTOR" },
+    { "batch", 'b', 0, G_OPTION_ARG_INT, &replay_batch,
+      "events per tox_do() with --speed 0", "N" },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &replay_verbose,
+      "print the libpurple debug log", NULL },
+    { NULL }
+};
+
+static Tox *replay_tox;
+static guint replay_friends = 1;
+static toxprpl_histogram replay_callback[MOCK_TOX_EVENT_COUNT];
+static toxprpl_histogram replay_late;   // injected after it was due
+static toxprpl_histogram replay_queue;  // injected until delivered
+
+// file data is not part of the capture
+static uint8_t replay_file_data[G_MAXUINT16];
+
+static gboolean replay_varint(const guint8 **p, const guint8 *end,
+                              guint64 *value)
+{
+    guint shift;
+
+    *value = 0;
+    for (shift = 0; (*p < end) && (shift < 64); shift += 7)
+    {
+        guint8 byte = *(*p)++;
+        *value |= (guint64)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean replay_event_type(guint8 event, mock_tox_event_type *type)
+{
+    switch (event)
+    {
+        case TOXPRPL_CAPTURE_REQUEST:
+            *type = MOCK_TOX_EVENT_REQUEST;
+            break;
+        case TOXPRPL_CAPTURE_MESSAGE:
+            *type = MOCK_TOX_EVENT_MESSAGE;
+            break;
+        case TOXPRPL_CAPTURE_ACTION:
+            *type = MOCK_TOX_EVENT_ACTION;
+            break;
+        case TOXPRPL_CAPTURE_NAME:
+            *type = MOCK_TOX_EVENT_NAME;
+            break;
+        case TOXPRPL_CAPTURE_STATUS_MESSAGE:
+            *type = MOCK_TOX_EVENT_STATUS_MESSAGE;
+            break;
+        case TOXPRPL_CAPTURE_USER_STATUS:
+            *type = MOCK_TOX_EVENT_USER_STATUS;
+            break;
+        case TOXPRPL_CAPTURE_CONNECTION:
+            *type = MOCK_TOX_EVENT_CONNECTION;
+            break;
+        case TOXPRPL_CAPTURE_RECEIPT:
+            *type = MOCK_TOX_EVENT_RECEIPT;
+            break;
+        case TOXPRPL_CAPTURE_TYPING:
+            *type = MOCK_TOX_EVENT_TYPING;
+            break;
+        case TOXPRPL_CAPTURE_FILE_SEND_REQUEST:
+            *type = MOCK_TOX_EVENT_FILE_SEND_REQUEST;
+            break;
+        case TOXPRPL_CAPTURE_FILE_CONTROL:
+            *type = MOCK_TOX_EVENT_FILE_CONTROL;
+            break;
+        case TOXPRPL_CAPTURE_FILE_DATA:
+            *type = MOCK_TOX_EVENT_FILE_DATA;
+            break;
+        case TOXPRPL_CAPTURE_GROUP_INVITE:
+            *type = MOCK_TOX_EVENT_GROUP_INVITE;
+            break;
+        case TOXPRPL_CAPTURE_GROUP_MESSAGE:
+            *type = MOCK_TOX_EVENT_GROUP_MESSAGE;
+            break;
+        case TOXPRPL_CAPTURE_GROUP_ACTION:
+            *type = MOCK_TOX_EVENT_GROUP_ACTION;
+            break;
+        case TOXPRPL_CAPTURE_GROUP_NAMELIST:
+            *type = MOCK_TOX_EVENT_GROUP_NAMELIST;
+            break;
+        default:
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * decodes the capture into an array of replay_record. a truncated last
+ * record, as left behind by a crash, ends the capture early. unknown events
+ * are an error because their length cannot be trusted
+ */
+static GArray *replay_load(const guint8 *contents, gsize size)
+{
+    const guint8 *p;
+    const guint8 *end = contents + size;
+    GArray *records = g_array_new(FALSE, TRUE, sizeof(replay_record));
+    guint64 at = 0;
+
+    if ((size < strlen(TOXPRPL_CAPTURE_MAGIC)) ||
+        (memcmp(contents, TOXPRPL_CAPTURE_MAGIC,
+                strlen(TOXPRPL_CAPTURE_MAGIC)) != 0))
+    {
+        fprintf(stderr, "not a toxprpl capture\n");
+        g_array_free(records, TRUE);
+        return NULL;
+    }
+
+    for (p = contents + strlen(TOXPRPL_CAPTURE_MAGIC); p < end;)
+    {
+        replay_record record;
+        guint64 delta, friend, arg, arg2, length;
+        guint8 event = *p++;
+
+        memset(&record, 0, sizeof(record));
+        if (!replay_varint(&p, end, &delta) ||
+            !replay_varint(&p, end, &friend) ||
+            !replay_varint(&p, end, &arg) ||
+            !replay_varint(&p, end, &arg2) ||
+            !replay_varint(&p, end, &length) ||
+            (length > (guint64)(end - p)))
+        {
+            fprintf(stderr, "capture is truncated after %u records\n",
+                    records->len);
+            break;
+        }
+        if (!replay_event_type(event, &record.event.type) ||
+            (length > G_MAXUINT16 + TOX_CLIENT_ID_SIZE))
+        {
+            fprintf(stderr, "bad record %u (event %u)\n", records->len,
+                    event);
+            g_array_free(records, TRUE);
+            return NULL;
+        }
+
+        at += delta;
+        record.at = at;
+        record.event.friendnumber = (int32_t)friend - 1;
+        record.event.arg = (uint32_t)arg;
+        record.event.data = (uint8_t *)p;
+        record.event.length = (uint16_t)length;
+        switch (record.event.type)
+        {
+            case MOCK_TOX_EVENT_REQUEST:
+                if (length < TOX_CLIENT_ID_SIZE)
+                {
+                    fprintf(stderr, "bad friend request in record %u\n",
+                            records->len);
+                    g_array_free(records, TRUE);
+                    return NULL;
+                }
+                record.event.length = TOX_CLIENT_ID_SIZE;
+                record.event.extra = (uint8_t *)p + TOX_CLIENT_ID_SIZE;
+                record.event.extra_length =
+                    (uint16_t)(length - TOX_CLIENT_ID_SIZE);
+                break;
+            case MOCK_TOX_EVENT_FILE_SEND_REQUEST:
+                record.event.size = arg2;
+                break;
+            case MOCK_TOX_EVENT_FILE_CONTROL:
+                record.event.control = (uint8_t)arg2;
+                record.event.send_receive = (uint8_t)(arg2 >> 8);
+                break;
+            case MOCK_TOX_EVENT_FILE_DATA:
+                record.event.data = replay_file_data;
+                record.event.length = (uint16_t)MIN(arg2, G_MAXUINT16);
+                break;
+            case MOCK_TOX_EVENT_GROUP_NAMELIST:
+                record.event.control = (uint8_t)arg2;
+                break;
+            default:
+                break;
+        }
+        p += length;
+
+        // the group events carry a group number instead
+        gboolean group = (record.event.type == MOCK_TOX_EVENT_GROUP_MESSAGE) ||
+                         (record.event.type == MOCK_TOX_EVENT_GROUP_ACTION) ||
+                         (record.event.type == MOCK_TOX_EVENT_GROUP_NAMELIST);
+        if (!group && (record.event.friendnumber >= (int32_t)replay_friends))
+        {
+            replay_friends = record.event.friendnumber + 1;
+        }
+        g_array_append_val(records, record);
+    }
+    return records;
+}
+
+static void replay_new_tox(Tox *tox, void *user_data)
+{
+    replay_tox = tox;
+    // only what is in the capture, no receipts for what the plugin sends
+    mock_tox_set_receipt_delay(tox, 0);
+    mock_tox_add_friends(tox, replay_friends);
+}
+
+static void replay_event(Tox *tox, const mock_tox_event *event,
+                         gint64 delivered, gint64 finished, void *user_data)
+{
+    toxprpl_histogram_record(&replay_callback[event->type],
+                             (guint64)(finished - delivered));
+    toxprpl_histogram_record(&replay_queue,
+                             (guint64)(delivered - event->injected));
+}
+
+/*
+ * hands the records to the core when they are due and runs the messenger.
+ * with --speed 0 every tox_do() gets a batch, which ends early after a file
+ * offer so that the transfer is accepted before its data arrives
+ */
+static void replay_run(PurpleConnection *gc, GArray *records)
+{
+    gint64 start = g_get_monotonic_time();
+    guint next = 0;
+
+    while (next < records->len)
+    {
+        const replay_record *record;
+
+        if (replay_speed > 0)
+        {
+            gint64 now = g_get_monotonic_time();
+            for (; next < records->len; next++)
+            {
+                record = &g_array_index(records, replay_record, next);
+                gint64 due = start + (gint64)(record->at / replay_speed);
+                if (due > now)
+                {
+                    break;
+                }
+                toxprpl_histogram_record(&replay_late, (guint64)(now - due));
+                mock_tox_inject_event(replay_tox, &record->event, 0);
+            }
+        }
+        else
+        {
+            gint batch;
+            for (batch = 0; (batch < replay_batch) && (next < records->len);
+                 batch++)
+            {
+                record = &g_array_index(records, replay_record, next++);
+                mock_tox_inject_event(replay_tox, &record->event, 0);
+                if (record->event.type == MOCK_TOX_EVENT_FILE_SEND_REQUEST)
+                {
+                    break;
+                }
+            }
+        }
+
+        tox_messenger_loop(gc);
+        headless_iterate();
+
+        if ((replay_speed > 0) && (next < records->len))
+        {
+            record = &g_array_index(records, replay_record, next);
+            gint64 due = start + (gint64)(record->at / replay_speed);
+            gint64 wait = due - g_get_monotonic_time();
+            if (wait > 0)
+            {
+                g_usleep((gulong)MIN(wait, REPLAY_MAX_SLEEP));
+            }
+        }
+    }
+}
+
+// delivers what is still queued in the core
+static gboolean replay_drain(PurpleConnection *gc)
+{
+    guint64 events = mock_tox_get_stats(replay_tox)->events;
+    gint64 progress = g_get_monotonic_time();
+
+    while (mock_tox_pending(replay_tox) > 0)
+    {
+        tox_messenger_loop(gc);
+        headless_iterate();
+
+        const mock_tox_stats *stats = mock_tox_get_stats(replay_tox);
+        if (stats->events != events)
+        {
+            events = stats->events;
+            progress = g_get_monotonic_time();
+        }
+        else if (g_get_monotonic_time() - progress > REPLAY_STALL_TIMEOUT)
+        {
+            fprintf(stderr, "no progress, %u events still pending\n",
+                    mock_tox_pending(replay_tox));
+            return FALSE;
+        }
+    }
+    headless_iterate();
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context = g_option_context_new("CAPTURE");
+    GError *error = NULL;
+    gchar *contents;
+    gsize size;
+
+    g_option_context_add_main_entries(context, replay_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s [options] CAPTURE\n", argv[0]);
+        return 1;
+    }
+    replay_speed = MAX(replay_speed, 0.0);
+    replay_batch = MAX(replay_batch, 1);
+
+    if (!g_file_get_contents(argv[1], &contents, &size, &error))
+    {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    GArray *records = replay_load((const guint8 *)contents, size);
+    if (records == NULL)
+    {
+        g_free(contents);
+        return 1;
+    }
+
+    mock_tox_set_new_hook(replay_new_tox, NULL);
+    if (!headless_init(replay_verbose) ||
+        !headless_register_plugin(purple_init_plugin))
+    {
+        return 1;
+    }
+
+    PurpleAccount *account = headless_account_new(TOXPRPL_ID, "replay");
+    PurpleConnection *gc = headless_connect(account);
+    if ((gc == NULL) || (purple_connection_get_protocol_data(gc) == NULL) ||
+        (replay_tox == NULL))
+    {
+        fprintf(stderr, "login failed\n");
+        headless_shutdown();
+        return 1;
+    }
+
+    // come online without waiting for the connection timer
+    tox_messenger_loop(gc);
+    tox_connection_check(gc);
+    mock_tox_set_event_hook(replay_tox, replay_event, NULL);
+    guint64 events = mock_tox_get_stats(replay_tox)->events;
+
+    gint64 start = g_get_monotonic_time();
+    replay_run(gc, records);
+    gboolean ok = replay_drain(gc);
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    const mock_tox_stats *stats = mock_tox_get_stats(replay_tox);
+    guint64 delivered = stats->events - events;
+    guint64 recorded = records->len > 0 ?
+        g_array_index(records, replay_record, records->len - 1).at : 0;
+    ok = ok && (delivered == records->len);
+
+    GString *json = g_string_new(NULL);
+    g_string_append(json, "{\"benchmark\":\"replay\",\"capture\":");
+    toxprpl_json_append_string(json, argv[1]);
+    g_string_append_printf(json, ",\"records\":%u,\"friends\":%u,"
+        "\"speed\":%g,\"recorded_seconds\":%.3f,\"seconds\":%.3f,"
+        "\"events\":%" G_GUINT64_FORMAT ",\"per_second\":%.0f,",
+        records->len, replay_friends, replay_speed,
+        recorded / (double)G_USEC_PER_SEC, elapsed / (double)G_USEC_PER_SEC,
+        delivered, bench_rate(delivered, elapsed));
+    if (replay_speed > 0)
+    {
+        bench_json_histogram(json, "late_us", &replay_late);
+        g_string_append_c(json, ',');
+    }
+    bench_json_histogram(json, "queue_us", &replay_queue);
+    g_string_append(json, ",\"callback_us\":{");
+
+    gboolean first = TRUE;
+    guint type;
+    for (type = 0; type < MOCK_TOX_EVENT_COUNT; type++)
+    {
+        if (replay_callback[type].count == 0)
+        {
+            continue;
+        }
+        if (!first)
+        {
+            g_string_append_c(json, ',');
+        }
+        first = FALSE;
+        bench_json_histogram(json, mock_tox_event_name(type),
+                             &replay_callback[type]);
+    }
+    g_string_append_printf(json, "},\"core\":{\"ticks\":%" G_GUINT64_FORMAT
+        ",\"file_bytes_received\":%" G_GUINT64_FORMAT ",\"saves\":%"
+        G_GUINT64_FORMAT "},\"ok\":%s}\n", stats->ticks,
+        stats->file_bytes_received, stats->saves, ok ? "true" : "false");
+    fputs(json->str, stdout);
+    g_string_free(json, TRUE);
+
+    purple_account_disconnect(account);
+    headless_shutdown();
+    g_array_free(records, TRUE);
+    g_free(contents);
+    return ok ? 0 : 1;
+}
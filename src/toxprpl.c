@@ -37,6 +37,8 @@
     #include <sys/socket.h>
     #include <netdb.h>
     #include <arpa/inet.h>
+    #include <signal.h>
+    #include <unistd.h>
 #endif
 
 #ifndef O_BINARY
@@ -50,6 +52,16 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+#ifdef TOXPRPL_USDT
+    // every probe gets a semaphore the tracer bumps while it is attached
+    #define _SDT_HAS_SEMAPHORES 1
+    #include <sys/sdt.h>
+#endif
+
 #include <glib.h>
 #include <glib/gstdio.h>
 
@@ -87,6 +99,13 @@
 
 #define DEFAULT_NICKNAME    "ToxedPidgin"
 
+#ifndef TOX_MAX_MESSAGE_LENGTH
+    #define TOX_MAX_MESSAGE_LENGTH  1368
+#endif
+
+// longest piece of text per message, one byte is needed for the terminator
+#define TOXPRPL_MAX_FRAGMENT_LENGTH (TOX_MAX_MESSAGE_LENGTH - 1)
+
 #define toxprpl_return_val_if_fail(expr,val)     \
     if (!(expr))                                 \
     {                                            \
@@ -99,6 +118,76 @@
         return;                                  \
     }
 
+/*
+ * per event messages of the hot paths go through toxprpl_debug() and are
+ * only compiled in with --enable-debug-log, the format arguments are not
+ * even evaluated otherwise. everything else uses purple_debug_*() directly
+ */
+#ifdef TOXPRPL_DEBUG_LOG
+    #define toxprpl_debug(...) purple_debug_misc("toxprpl", __VA_ARGS__)
+#else
+    #define toxprpl_debug(...) ((void)0)
+#endif
+
+/*
+ * USDT probes for perf, bpftrace and SystemTap, compiled in with
+ * --enable-usdt. all durations are in microseconds
+ *
+ *   toxprpl:loop__entry
+ *   toxprpl:loop__return      (tox_do duration)
+ *   toxprpl:callback__entry   (name, friend, length or state)
+ *   toxprpl:callback__return  (name, friend, duration)
+ *   toxprpl:send__im          (friend, bytes, bytes accepted by the core,
+ *                              duration)
+ *   toxprpl:xfer__write       (friend, file number, bytes)
+ *   toxprpl:xfer__read        (friend, file number, bytes)
+ *   toxprpl:save__account     (bytes, duration)
+ *
+ * a probe only tests its semaphore while no tracer is attached, so its
+ * arguments are not evaluated and toxprpl_probe_time() does not read the
+ * clock. without --enable-usdt the probes compile out entirely
+ */
+#ifdef TOXPRPL_USDT
+    #define toxprpl_probe_semaphore(name)       \
+        volatile unsigned short toxprpl_##name##_semaphore \
+            __attribute__((used, section(".probes")))
+    #define toxprpl_probe_enabled(name)         \
+        G_UNLIKELY(toxprpl_##name##_semaphore != 0)
+    #define toxprpl_probe0(name)                \
+        do { if (toxprpl_probe_enabled(name)) \
+                 DTRACE_PROBE(toxprpl, name); } while (0)
+    #define toxprpl_probe1(name, a)             \
+        do { if (toxprpl_probe_enabled(name)) \
+                 DTRACE_PROBE1(toxprpl, name, a); } while (0)
+    #define toxprpl_probe2(name, a, b)          \
+        do { if (toxprpl_probe_enabled(name)) \
+                 DTRACE_PROBE2(toxprpl, name, a, b); } while (0)
+    #define toxprpl_probe3(name, a, b, c)       \
+        do { if (toxprpl_probe_enabled(name)) \
+                 DTRACE_PROBE3(toxprpl, name, a, b, c); } while (0)
+    #define toxprpl_probe4(name, a, b, c, d)    \
+        do { if (toxprpl_probe_enabled(name)) \
+                 DTRACE_PROBE4(toxprpl, name, a, b, c, d); } while (0)
+    #define toxprpl_probe_time(name)            \
+        (toxprpl_probe_enabled(name) ? g_get_monotonic_time() : (gint64)0)
+
+    static toxprpl_probe_semaphore(loop__entry);
+    static toxprpl_probe_semaphore(loop__return);
+    static toxprpl_probe_semaphore(callback__entry);
+    static toxprpl_probe_semaphore(callback__return);
+    static toxprpl_probe_semaphore(send__im);
+    static toxprpl_probe_semaphore(xfer__write);
+    static toxprpl_probe_semaphore(xfer__read);
+    static toxprpl_probe_semaphore(save__account);
+#else
+    #define toxprpl_probe0(name)                ((void)0)
+    #define toxprpl_probe1(name, a)             ((void)0)
+    #define toxprpl_probe2(name, a, b)          ((void)0)
+    #define toxprpl_probe3(name, a, b, c)       ((void)0)
+    #define toxprpl_probe4(name, a, b, c, d)    ((void)0)
+    #define toxprpl_probe_time(name)            ((gint64)0)
+#endif
+
 static const char *g_HEX_CHARS = "0123456789abcdef";
 
 typedef struct
@@ -114,20 +203,407 @@ typedef struct
     int tox_friendlist_number;
 } toxprpl_buddy_data;
 
+/*
+ * log-linear histogram in the spirit of HdrHistogram: each power of two is
+ * split into TOXPRPL_HISTOGRAM_SUB_COUNT buckets, so every recorded value is
+ * kept with a relative error below 1 / TOXPRPL_HISTOGRAM_SUB_COUNT. values
+ * of 2^32 and above end up in the last bucket.
+ */
+#define TOXPRPL_HISTOGRAM_SUB_BITS      3
+#define TOXPRPL_HISTOGRAM_SUB_COUNT     (1 << TOXPRPL_HISTOGRAM_SUB_BITS)
+#define TOXPRPL_HISTOGRAM_BUCKETS       \
+    ((32 - TOXPRPL_HISTOGRAM_SUB_BITS + 1) * TOXPRPL_HISTOGRAM_SUB_COUNT)
+
+typedef struct
+{
+    guint64 count;
+    guint64 sum;
+    guint64 min;
+    guint64 max;
+    guint32 buckets[TOXPRPL_HISTOGRAM_BUCKETS];
+} toxprpl_histogram;
+
+/*
+ * metrics registry: counters and gauges are plain integers, histograms use
+ * toxprpl_histogram. both are indexed by enum so that updating a metric on
+ * the hot path is a single array access. names are listed in the same order
+ * in toxprpl_metric_infos and toxprpl_histogram_infos
+ */
+typedef enum
+{
+    TOXPRPL_METRIC_CB_FRIEND_REQUEST,
+    TOXPRPL_METRIC_CB_FRIEND_MESSAGE,
+    TOXPRPL_METRIC_CB_FRIEND_ACTION,
+    TOXPRPL_METRIC_CB_NAME_CHANGE,
+    TOXPRPL_METRIC_CB_USER_STATUS,
+    TOXPRPL_METRIC_CB_STATUS_MESSAGE,
+    TOXPRPL_METRIC_CB_CONNECTION_STATUS,
+    TOXPRPL_METRIC_CB_READ_RECEIPT,
+    TOXPRPL_METRIC_CB_TYPING_CHANGE,
+    TOXPRPL_METRIC_CB_FILE_SEND_REQUEST,
+    TOXPRPL_METRIC_CB_FILE_CONTROL,
+    TOXPRPL_METRIC_CB_FILE_DATA,
+    TOXPRPL_METRIC_CB_GROUP_INVITE,
+    TOXPRPL_METRIC_CB_GROUP_MESSAGE,
+    TOXPRPL_METRIC_CB_GROUP_ACTION,
+    TOXPRPL_METRIC_CB_GROUP_NAMELIST,
+    TOXPRPL_METRIC_MESSAGES_IN,
+    TOXPRPL_METRIC_MESSAGES_OUT,
+    TOXPRPL_METRIC_BYTES_IN,
+    TOXPRPL_METRIC_BYTES_OUT,
+    TOXPRPL_METRIC_SAVES,
+    TOXPRPL_METRIC_BOOTSTRAP_IPV4,
+    TOXPRPL_METRIC_BOOTSTRAP_IPV6,
+    TOXPRPL_METRIC_LAN_ANNOUNCEMENTS,
+    TOXPRPL_METRIC_FRIENDS,             // gauges from here on
+    TOXPRPL_METRIC_FRIENDS_ONLINE,
+    TOXPRPL_METRIC_FRIENDS_LAN,
+    TOXPRPL_METRIC_OFFLINE_QUEUED,
+    TOXPRPL_METRIC_RECEIPTS_PENDING,
+    TOXPRPL_METRIC_REQUESTS_PENDING,
+    TOXPRPL_METRIC_TRANSFERS,
+    TOXPRPL_METRIC_ARENA_HIGH_WATER,
+    TOXPRPL_METRIC_POOL_SIZE,
+    TOXPRPL_METRIC_IPV6,
+    TOXPRPL_METRIC_UDP_RCVBUF,
+    TOXPRPL_METRIC_UDP_SNDBUF,
+    TOXPRPL_METRIC_UDP_DROPS,
+    TOXPRPL_METRIC_GROUPS,
+    TOXPRPL_METRIC_GROUP_PEERS,
+    TOXPRPL_METRIC_COUNT
+} toxprpl_metric;
+
+#define TOXPRPL_METRIC_FIRST_GAUGE  TOXPRPL_METRIC_FRIENDS
+
+typedef enum
+{
+    TOXPRPL_HISTOGRAM_TOX_DO,
+    TOXPRPL_HISTOGRAM_DELIVERY_LATENCY,
+    TOXPRPL_HISTOGRAM_DHT_CONNECT,
+    TOXPRPL_HISTOGRAM_DHT_CONNECT_IPV4,
+    TOXPRPL_HISTOGRAM_DHT_CONNECT_IPV6,
+    TOXPRPL_HISTOGRAM_SAVE_SIZE,
+    TOXPRPL_HISTOGRAM_TRANSFER_SIZE,
+    TOXPRPL_HISTOGRAM_SCHEDULER_LAG,
+    TOXPRPL_HISTOGRAM_COUNT
+} toxprpl_histogram_metric;
+
+typedef struct
+{
+    const char *name;
+    const char *unit;
+} toxprpl_metric_info;
+
+static const toxprpl_metric_info toxprpl_metric_infos[] =
+{
+    { "callbacks.friend_request",   NULL },
+    { "callbacks.friend_message",   NULL },
+    { "callbacks.friend_action",    NULL },
+    { "callbacks.name_change",      NULL },
+    { "callbacks.user_status",      NULL },
+    { "callbacks.status_message",   NULL },
+    { "callbacks.connection_status", NULL },
+    { "callbacks.read_receipt",     NULL },
+    { "callbacks.typing_change",    NULL },
+    { "callbacks.file_send_request", NULL },
+    { "callbacks.file_control",     NULL },
+    { "callbacks.file_data",        NULL },
+    { "callbacks.group_invite",     NULL },
+    { "callbacks.group_message",    NULL },
+    { "callbacks.group_action",     NULL },
+    { "callbacks.group_namelist",   NULL },
+    { "messages.in",                NULL },
+    { "messages.out",               NULL },
+    { "messages.bytes_in",          "bytes" },
+    { "messages.bytes_out",         "bytes" },
+    { "account.saves",              NULL },
+    { "bootstrap.ipv4",             NULL },
+    { "bootstrap.ipv6",             NULL },
+    { "lan.announcements",          NULL },
+    { "friends",                    NULL },
+    { "friends.online",             NULL },
+    { "friends.lan",                NULL },
+    { "queue.offline_messages",     NULL },
+    { "queue.read_receipts",        NULL },
+    { "queue.friend_requests",      NULL },
+    { "transfers.active",           NULL },
+    { "arena.high_water",           "bytes" },
+    { "pools.size",                 "bytes" },
+    { "network.ipv6",               NULL },
+    { "udp.rcvbuf",                 "bytes" },
+    { "udp.sndbuf",                 "bytes" },
+    { "udp.drops",                  NULL },
+    { "groups",                     NULL },
+    { "groups.peers",               NULL }
+};
+
+static const toxprpl_metric_info toxprpl_histogram_infos[] =
+{
+    { "tox_do",                     "us" },
+    { "delivery_latency",           "us" },
+    { "dht_connect",                "us" },
+    { "dht_connect.ipv4",           "us" },
+    { "dht_connect.ipv6",           "us" },
+    { "account.save_size",          "bytes" },
+    { "transfers.size",             "bytes" },
+    { "scheduler.lag",              "us" }
+};
+
+G_STATIC_ASSERT(G_N_ELEMENTS(toxprpl_metric_infos) == TOXPRPL_METRIC_COUNT);
+G_STATIC_ASSERT(G_N_ELEMENTS(toxprpl_histogram_infos) ==
+                TOXPRPL_HISTOGRAM_COUNT);
+
+typedef struct
+{
+    gint64 values[TOXPRPL_METRIC_COUNT];
+    toxprpl_histogram histograms[TOXPRPL_HISTOGRAM_COUNT];
+} toxprpl_metrics;
+
+/*
+ * binary trace of recent events, kept in a fixed size ring that is shared
+ * by all accounts. writing a record is a few stores, the ring can be dumped
+ * with /toxtrace and, for accounts with the "crash_trace" option, is written
+ * out when the process crashes. compiled out with --disable-trace
+ */
+typedef enum
+{
+    TOXPRPL_TRACE_CALLBACK,     // arg0: toxprpl_metric of the callback
+    TOXPRPL_TRACE_TOX_DO,       // arg0: duration in microseconds
+    TOXPRPL_TRACE_SEND,         // arg0: bytes sent, arg1: bytes requested
+    TOXPRPL_TRACE_RECEIPT,      // arg0: latency in microseconds
+    TOXPRPL_TRACE_SAVE,         // arg0: bytes, arg1: duration in microseconds
+    TOXPRPL_TRACE_XFER_WRITE,   // arg0: file number, arg1: bytes
+    TOXPRPL_TRACE_XFER_READ,    // arg0: file number, arg1: bytes
+    TOXPRPL_TRACE_DHT,          // arg0: 1 connected, 0 disconnected
+    TOXPRPL_TRACE_COUNT
+} toxprpl_trace_event;
+
+static const char *toxprpl_trace_names[] =
+{
+    "callback",
+    "tox_do",
+    "send",
+    "receipt",
+    "save",
+    "xfer_write",
+    "xfer_read",
+    "dht"
+};
+
+G_STATIC_ASSERT(G_N_ELEMENTS(toxprpl_trace_names) == TOXPRPL_TRACE_COUNT);
+
+typedef struct
+{
+    guint64 time;       // monotonic time in microseconds
+    guint32 event;
+    gint32 friendnumber;
+    guint32 arg0;
+    guint32 arg1;
+} toxprpl_trace_record;
+
+#define TOXPRPL_TRACE_RECORDS   4096    // must be a power of two
+
+// outgoing message waiting for its read receipt
+typedef struct
+{
+    gint64 key;         // friend number << 32 | message id, hash table key
+    int friendnumber;
+    gint64 sent;        // monotonic time in microseconds
+    gchar *excerpt;     // start of the text, to report unconfirmed messages
+    gboolean truncated; // excerpt is shorter than the message
+} toxprpl_receipt;
+
+// messages without a receipt are reported after this many seconds. the
+// receipt may still arrive later, or the message may have been lost
+#define TOXPRPL_RECEIPT_TIMEOUT     120
+#define TOXPRPL_RECEIPT_EXCERPT     40
+
+/*
+ * bump allocator for temporary data of the messenger loop, e.g. buddy keys
+ * and message copies in tox callbacks. everything allocated from it is
+ * released at once by toxprpl_arena_reset() after each tox_do() iteration.
+ */
+typedef struct toxprpl_arena_block
+{
+    struct toxprpl_arena_block *next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+} toxprpl_arena_block;
+
+typedef struct
+{
+    toxprpl_arena_block *head;
+    size_t block_size;      // size of the next block taken from the heap
+    size_t in_use;          // bytes handed out since the last reset
+    size_t high_water;
+    guint64 allocs;         // allocations served by the arena
+    guint64 heap_allocs;    // blocks that had to be taken from the heap
+} toxprpl_arena;
+
+#define TOXPRPL_ARENA_BLOCK_SIZE    (16 * 1024)
+
+/*
+ * pool of equally sized objects that live no longer than the connection,
+ * e.g. the toxprpl_buddy_data of every buddy. objects are carved from slabs
+ * and recycled through a free list, all slabs are released at once by
+ * toxprpl_pool_destroy() in toxprpl_close()
+ */
+typedef struct toxprpl_pool_slab
+{
+    struct toxprpl_pool_slab *next;
+    uint8_t data[];
+} toxprpl_pool_slab;
+
+typedef struct
+{
+    toxprpl_pool_slab *slabs;   // newest first
+    gpointer free_list;         // linked through the first word of objects
+    size_t object_size;
+    guint slab_objects;         // objects per slab
+    guint slab_used;            // objects carved from the newest slab
+    size_t in_use;
+    size_t slab_count;
+} toxprpl_pool;
+
+#define TOXPRPL_POOL_SLAB_SIZE      (16 * 1024)
+
+// typing notification state towards one friend
+typedef struct
+{
+    Tox *tox;
+    int friendnumber;
+    gboolean sent;      // state the friend was last told about
+    gboolean wanted;    // state libpurple asked for
+    guint timer;        // pending delayed "stopped typing"
+} toxprpl_typing_data;
+
+// a "stopped typing" followed by "typing" within this many milliseconds
+// does not go out at all
+#define TOXPRPL_TYPING_COALESCE_MS  750
+
+/*
+ * mirror of the friend list of the core, indexed by friend number and kept
+ * up to date by the callbacks. status queries do not go back to the core and
+ * roster wide operations are linear scans. there is one array per field, so
+ * a scan only touches the field it looks at
+ */
+typedef struct
+{
+    guint size;                 // friend numbers the arrays have room for
+    uint8_t *exists;
+    uint8_t *keys;              // TOX_CLIENT_ID_SIZE bytes per friend
+    uint8_t *connection;        // 1 while online
+    uint8_t *user_status;       // TOX_USERSTATUS
+    uint8_t *typing;            // friend is typing to us
+    time_t *last_seen;          // last time the friend was online, 0 = never
+    gint64 *lan_seen;           // monotonic time of the last LAN announcement
+    PurpleBuddy **buddies;      // NULL until the buddy is attached
+} toxprpl_friend_table;
+
+#define TOXPRPL_FRIEND_TABLE_MIN_SIZE   64
+
+/*
+ * opt-in LAN discovery. every account broadcasts its DHT key and port to
+ * TOXPRPL_LAN_PORT on the local segment and bootstraps from whatever it
+ * hears there, so friends on the same network find each other through a
+ * direct DHT neighbour instead of the internet. the socket is shared with
+ * SO_REUSEADDR, so several instances on one machine hear each other
+ */
+#define TOXPRPL_LAN_PORT            33440
+#define TOXPRPL_LAN_MAGIC           "TOXPLAN1"
+#define TOXPRPL_LAN_MAGIC_SIZE      8
+#define TOXPRPL_LAN_PACKET_SIZE     \
+    (TOXPRPL_LAN_MAGIC_SIZE + TOX_CLIENT_ID_SIZE + 2)
+#define TOXPRPL_LAN_INTERVAL_US     (5 * G_USEC_PER_SEC)
+// a friend counts as on the LAN for this long after an announcement
+#define TOXPRPL_LAN_TIMEOUT_US      (3 * TOXPRPL_LAN_INTERVAL_US)
+
+/*
+ * a group chat of the core. peers mirrors its peer list and is indexed by
+ * peer number: when a peer leaves, the core moves its last peer into the
+ * free slot and so do we. the callbacks only collect joins, leaves and
+ * messages, they are handed to the conversation after tox_do(), so a busy
+ * room costs one user list update per messenger tick instead of one per
+ * peer. the purple chat id is the group number
+ */
+typedef struct
+{
+    int groupnumber;
+    gchar *self;                 // our nick in the room
+    GPtrArray *peers;            // peer number -> nick, unique in the room
+    GHashTable *nicks;           // nicks in use, including ours
+    GHashTable *joined;          // nicks not yet added to the conversation
+    GPtrArray *left;             // nicks still to remove from it
+    GQueue *messages;            // toxprpl_group_message, oldest first
+    guint suffix;                // last number used to make a nick unique
+} toxprpl_group;
+
 typedef struct
 {
-    PurpleConnection *gc;
-    char *buddy_key;
-} toxprpl_accept_friend_data;
+    gchar *who;
+    gchar *text;                 // actions start with "/me "
+    time_t mtime;
+} toxprpl_group_message;
+
+#define TOXPRPL_GROUP_FLUSH_BURST   256 // messages per group and tick
 
 typedef struct
 {
     Tox *tox;
-    guint tox_timer;
-    guint connection_timer;
+    gint64 loop_due;             // monotonic time of the next tox_do()
+    gint64 check_due;            // same for tox_connection_check()
     guint connected;
+    uint8_t ipv6;                // dual stack core
+    int dht_fd;                  // UDP socket of the core, -1 if not known
+    uint16_t dht_port;
+    GArray *bootstrap_tried;     // ids of the bootstrap nodes we tried
+    int lan_fd;                  // LAN discovery socket, -1 if disabled
+    guint lan_input;
+    gint64 lan_due;              // monotonic time of the next announcement
+    uint8_t lan_packet[TOXPRPL_LAN_PACKET_SIZE];
     PurpleCmdId myid_command_id;
     PurpleCmdId nick_command_id;
+    PurpleCmdId latency_command_id;
+    PurpleCmdId stats_command_id;
+    PurpleCmdId trace_command_id;
+    toxprpl_arena scratch;       // reset after every tox_do()
+    toxprpl_pool buddy_pool;     // toxprpl_buddy_data
+    toxprpl_pool xfer_pool;      // toxprpl_xfer_data
+    toxprpl_pool message_pool;   // GOfflineMessage
+    toxprpl_pool group_pool;     // toxprpl_group_message
+    toxprpl_friend_table friends;
+    GHashTable *receipts;        // toxprpl_receipt.key -> toxprpl_receipt
+    GHashTable *friend_latency;  // friend number -> toxprpl_histogram
+    toxprpl_metrics metrics;
+    guint metrics_timer;         // periodic JSON dump, 0 if disabled
+    gchar *metrics_path;
+    gint64 connect_started;      // monotonic time the DHT connect began
+    gboolean chrome_trace;       // account takes part in the timing trace
+    guint trace_id;              // pid and tid of its spans in that trace
+    gboolean crash_trace;        // account keeps the crash handler installed
+    FILE *capture;               // callback capture for bench/replay
+    gchar *capture_path;
+    gint64 capture_last;         // monotonic time of the previous record
+    gsize capture_size;
+    GHashTable *typing;          // friend number -> toxprpl_typing_data
+    GHashTable *offline_queues;  // buddy key -> GQueue of GOfflineMessage
+    guint offline_queued;        // total number of queued messages
+    gboolean offline_flush;      // some queue may be deliverable now
+    gchar *offline_path;
+    FILE *offline_file;
+    GHashTable *groups;          // group number -> toxprpl_group
+    gboolean group_flush;        // some group has pending updates
+    GHashTable *inbox;           // buddy key -> toxprpl_friend_request
+    gchar *inbox_path;
+    gboolean inbox_dirty;        // inbox differs from the file
+    gboolean inbox_unseen;       // requests not yet shown in a review dialog
+    time_t inbox_window;         // start of the current rate limit window
+    guint inbox_window_count;    // new requests accepted in that window
+    guint inbox_dropped;         // requests dropped since the last review
+    guint inbox_timer;           // pending review dialog
+    gpointer inbox_dialog;       // open review dialog
+    GPtrArray *inbox_dialog_keys;
 } toxprpl_plugin_data;
 
 typedef struct
@@ -173,21 +649,49 @@ static toxprpl_status toxprpl_statuses[] =
 };
 
 /*
- * stores offline messages that haven't been delivered yet. maps username
- * (char *) to GList * of GOfflineMessages. initialized in toxprpl_init.
+ * outgoing message that could not be handed to the core yet, either because
+ * the friend is offline or because the core refused it. queued per friend in
+ * toxprpl_plugin_data->offline_queues and persisted to an append-only file
+ * in the purple user dir, see toxprpl_offline_load()
  */
-GHashTable* goffline_messages = NULL;
-
 typedef struct
 {
-    char *from;
-    char *message;
+    char *message;      // plain text, markup already stripped
+    uint32_t length;
     time_t mtime;
-    PurpleMessageFlags flags;
+    gboolean action;
 } GOfflineMessage;
 
-static void toxprpl_add_to_buddylist(toxprpl_accept_friend_data *data);
-static void toxprpl_do_not_add_to_buddylist(toxprpl_accept_friend_data *data);
+#define TOXPRPL_OFFLINE_MAX_MESSAGES    512 // per friend
+#define TOXPRPL_OFFLINE_FLUSH_BURST     16  // per friend and messenger tick
+
+// record types of the offline queue file
+#define TOXPRPL_OFFLINE_RECORD_PUSH     1
+#define TOXPRPL_OFFLINE_RECORD_POP      2
+#define TOXPRPL_OFFLINE_RECORD_TRIM     3   // head lost its first bytes
+
+/*
+ * friend request waiting for a decision in the inbox. repeated requests from
+ * the same key only update the entry, the whole inbox is reviewed in one
+ * dialog, see toxprpl_inbox_review()
+ */
+typedef struct
+{
+    gchar *buddy_key;
+    gchar *message;     // sanitized, may be empty
+    time_t received;    // last time the request came in
+    guint count;        // number of times it came in
+} toxprpl_friend_request;
+
+// result of adding a friend whose address is malformed, next to TOX_FAERR_*
+#define TOXPRPL_FAERR_INVALID_ID    (-100)
+
+#define TOXPRPL_INBOX_MAX_REQUESTS  256
+#define TOXPRPL_INBOX_RATE_WINDOW   60  // seconds
+#define TOXPRPL_INBOX_RATE_LIMIT    20  // new requests per window
+#define TOXPRPL_INBOX_REVIEW_DELAY  2   // seconds for a burst to settle
+
+static void toxprpl_inbox_schedule_review(PurpleConnection *gc);
 
 static void toxprpl_login(PurpleAccount *acct);
 static void toxprpl_query_buddy_info(gpointer data, gpointer user_data);
@@ -195,23 +699,22 @@ static void toxprpl_set_status(PurpleAccount *account, PurpleStatus *status);
 static PurpleXfer *toxprpl_new_xfer_receive(PurpleConnection *gc,
     const char *who, int friendnumber, int filenumber, const goffset filesize,
     const char *filename);
+static gint64 toxprpl_udp_buffer_size(int fd, int option);
+static gint64 toxprpl_udp_drops(int fd);
+static int toxprpl_udp_core_fd(toxprpl_plugin_data *plugin);
 
 // utilitis
 
-// returned buffer must be freed by the caller
-static char *toxprpl_data_to_hex_string(const unsigned char *data,
-                                        const size_t len)
+// buf must have room for (len * 2) + 1 characters
+static char *toxprpl_data_to_hex(const unsigned char *data, const size_t len,
+                                 char *buf)
 {
-    unsigned char *chars;
     unsigned char hi, lo;
     size_t i;
-    char *buf = malloc((len * 2) + 1);
     char *p = buf;
-    chars = (unsigned char *)data;
-    chars = (unsigned char *)data;
     for (i = 0; i < len; i++)
     {
-        unsigned char c = chars[i];
+        unsigned char c = data[i];
         hi = c >> 4;
         lo = c & 0xF;
         *p = g_HEX_CHARS[hi];
@@ -223,6 +726,13 @@ static char *toxprpl_data_to_hex_string(const unsigned char *data,
     return buf;
 }
 
+// returned buffer must be freed by the caller
+static char *toxprpl_data_to_hex_string(const unsigned char *data,
+                                        const size_t len)
+{
+    return toxprpl_data_to_hex(data, len, malloc((len * 2) + 1));
+}
+
 unsigned char *toxprpl_hex_string_to_data(const char *s)
 {
     size_t len = strlen(s);
@@ -260,10 +770,152 @@ unsigned char *toxprpl_hex_string_to_data(const char *s)
     return buf;
 }
 
+/* friend table */
+static gpointer toxprpl_friends_grow_array(gpointer array, size_t element,
+                                           guint old_size, guint new_size)
+{
+    array = g_realloc(array, element * new_size);
+    memset((uint8_t *)array + element * old_size, 0,
+           element * (new_size - old_size));
+    return array;
+}
+
+// makes room for friend numbers below size
+static void toxprpl_friends_reserve(toxprpl_friend_table *friends, guint size)
+{
+    if (size <= friends->size)
+    {
+        return;
+    }
+
+    guint old_size = friends->size;
+    size = MAX(size, MAX(old_size * 2, TOXPRPL_FRIEND_TABLE_MIN_SIZE));
+    friends->exists = toxprpl_friends_grow_array(friends->exists,
+        sizeof(uint8_t), old_size, size);
+    friends->keys = toxprpl_friends_grow_array(friends->keys,
+        TOX_CLIENT_ID_SIZE, old_size, size);
+    friends->connection = toxprpl_friends_grow_array(friends->connection,
+        sizeof(uint8_t), old_size, size);
+    friends->user_status = toxprpl_friends_grow_array(friends->user_status,
+        sizeof(uint8_t), old_size, size);
+    friends->typing = toxprpl_friends_grow_array(friends->typing,
+        sizeof(uint8_t), old_size, size);
+    friends->last_seen = toxprpl_friends_grow_array(friends->last_seen,
+        sizeof(time_t), old_size, size);
+    friends->lan_seen = toxprpl_friends_grow_array(friends->lan_seen,
+        sizeof(gint64), old_size, size);
+    friends->buddies = toxprpl_friends_grow_array(friends->buddies,
+        sizeof(PurpleBuddy *), old_size, size);
+    friends->size = size;
+}
+
+static gboolean toxprpl_friend_known(const toxprpl_friend_table *friends,
+                                     int fnum)
+{
+    return (fnum >= 0) && ((guint)fnum < friends->size) &&
+           friends->exists[fnum];
+}
+
+static void toxprpl_friend_remove(toxprpl_friend_table *friends, int fnum)
+{
+    if ((fnum < 0) || ((guint)fnum >= friends->size))
+    {
+        return;
+    }
+    friends->exists[fnum] = 0;
+    memset(friends->keys + fnum * TOX_CLIENT_ID_SIZE, 0, TOX_CLIENT_ID_SIZE);
+    friends->connection[fnum] = 0;
+    friends->user_status[fnum] = TOX_USERSTATUS_NONE;
+    friends->typing[fnum] = 0;
+    friends->last_seen[fnum] = 0;
+    friends->lan_seen[fnum] = 0;
+    friends->buddies[fnum] = NULL;
+}
+
+// (re)reads a friend from the core, e.g. after it was added
+static void toxprpl_friend_update(toxprpl_friend_table *friends, Tox *tox,
+                                  int fnum)
+{
+    uint8_t client_id[TOX_CLIENT_ID_SIZE];
+    if ((fnum < 0) || (tox_get_client_id(tox, fnum, client_id) < 0))
+    {
+        toxprpl_friend_remove(friends, fnum);
+        return;
+    }
+
+    toxprpl_friends_reserve(friends, (guint)fnum + 1);
+    uint8_t *key = friends->keys + fnum * TOX_CLIENT_ID_SIZE;
+    if (friends->exists[fnum] &&
+        (memcmp(key, client_id, TOX_CLIENT_ID_SIZE) != 0))
+    {
+        // the number was reused for somebody else
+        toxprpl_friend_remove(friends, fnum);
+    }
+    friends->exists[fnum] = 1;
+    memcpy(key, client_id, TOX_CLIENT_ID_SIZE);
+    friends->connection[fnum] =
+        tox_get_friend_connection_status(tox, fnum) == 1;
+    friends->user_status[fnum] = tox_get_user_status(tox, fnum);
+    if (friends->connection[fnum])
+    {
+        friends->last_seen[fnum] = time(NULL);
+    }
+}
+
+static void toxprpl_friends_load(toxprpl_friend_table *friends, Tox *tox)
+{
+    uint32_t count = tox_count_friendlist(tox);
+    int *friendlist = g_new0(int, MAX(count, 1));
+    uint32_t i;
+
+    count = tox_get_friendlist(tox, friendlist, count);
+    for (i = 0; i < count; i++)
+    {
+        toxprpl_friend_update(friends, tox, friendlist[i]);
+    }
+    g_free(friendlist);
+}
+
+// friend number of a client id, -1 if it is no friend
+static int toxprpl_friend_find(const toxprpl_friend_table *friends,
+                               const uint8_t *client_id)
+{
+    guint i;
+    for (i = 0; i < friends->size; i++)
+    {
+        if (friends->exists[i] &&
+            (memcmp(friends->keys + i * TOX_CLIENT_ID_SIZE, client_id,
+                    TOX_CLIENT_ID_SIZE) == 0))
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static void toxprpl_friends_free(toxprpl_friend_table *friends)
+{
+    g_free(friends->exists);
+    g_free(friends->keys);
+    g_free(friends->connection);
+    g_free(friends->user_status);
+    g_free(friends->typing);
+    g_free(friends->last_seen);
+    g_free(friends->lan_seen);
+    g_free(friends->buddies);
+    memset(friends, 0, sizeof(toxprpl_friend_table));
+}
+
 // stay independent from the lib
-static int toxprpl_get_status_index(Tox *tox, int fnum, TOX_USERSTATUS status)
+static int toxprpl_get_status_index(const toxprpl_friend_table *friends,
+                                    int fnum)
 {
-    switch (status)
+    if (!toxprpl_friend_known(friends, fnum))
+    {
+        return TOXPRPL_STATUS_OFFLINE;
+    }
+
+    switch (friends->user_status[fnum])
     {
         case TOX_USERSTATUS_AWAY:
             return TOXPRPL_STATUS_AWAY;
@@ -272,12 +924,9 @@ static int toxprpl_get_status_index(Tox *tox, int fnum, TOX_USERSTATUS status)
         case TOX_USERSTATUS_NONE:
         case TOX_USERSTATUS_INVALID:
         default:
-            if (fnum != -1)
+            if (friends->connection[fnum])
             {
-                if (tox_get_friend_connection_status(tox, fnum) == 1)
-                {
-                    return TOXPRPL_STATUS_ONLINE;
-                }
+                return TOXPRPL_STATUS_ONLINE;
             }
     }
     return TOXPRPL_STATUS_OFFLINE;
@@ -307,343 +956,3575 @@ static gchar *toxprpl_tox_friend_id_to_string(uint8_t *bin_id)
     return toxprpl_data_to_hex_string(bin_id, TOX_FRIEND_ADDRESS_SIZE);
 }
 
-/* tox specific stuff */
-static void on_connectionstatus(Tox *tox, int fnum, uint8_t status,
-                                void *user_data)
+/* text helpers */
+// returns the length of the first piece of text that fits into one message,
+// without splitting a UTF-8 sequence
+static uint32_t toxprpl_utf8_fragment_length(const char *text, uint32_t length,
+                                             uint32_t max)
 {
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-    int tox_status = TOXPRPL_STATUS_OFFLINE;
-    if (status == 1)
+    if (length <= max)
     {
-        tox_status = TOXPRPL_STATUS_ONLINE;
+        return length;
     }
 
-    purple_debug_info("toxprpl", "Friend status change: %d\n", status);
-    uint8_t client_id[TOX_CLIENT_ID_SIZE];
-    if (tox_get_client_id(tox, fnum, client_id) < 0)
+    uint32_t cut = max;
+    // text[cut] starts the next piece, it must not be a continuation byte
+    while ((cut > 0) && (((uint8_t)text[cut] & 0xC0) == 0x80))
     {
-        purple_debug_info("toxprpl", "Could not get id of friend #%d\n",
-                          fnum);
-        return;
+        cut--;
     }
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
-    PurpleAccount *account = purple_connection_get_account(gc);
-    purple_prpl_got_user_status(account, buddy_key,
-        toxprpl_statuses[tox_status].id, NULL);
-    g_free(buddy_key);
+    if (cut == 0)
+    {
+        // not UTF-8 at all, cut where we have to
+        cut = max;
+    }
+    return cut;
 }
 
-static void on_request(struct Tox *tox, uint8_t* public_key, uint8_t* data,
-                       uint16_t length, void *user_data)
+// length of the valid UTF-8 sequence at p, 0 if it is invalid
+static size_t toxprpl_utf8_sequence_length(const uint8_t *p, size_t avail)
 {
-    purple_debug_info("toxprpl", "incoming friend request!\n");
-    gchar *dialog_message;
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-    purple_debug_info("toxprpl", "Buddy request from %s: %s\n",
-                      buddy_key, data);
+    uint8_t c = p[0];
+    uint8_t lo = 0x80, hi = 0xBF;
+    size_t n, i;
 
-    PurpleAccount *account = purple_connection_get_account(gc);
-    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
-    if (buddy != NULL)
+    if (c < 0x80)
     {
-        purple_debug_info("toxprpl", "Buddy %s already in buddy list!\n",
-                          buddy_key);
-        g_free(buddy_key);
-        return;
+        return 1;
     }
-
-    dialog_message = g_strdup_printf("The user %s has sent you a friend "
-                                    "request, do you want to add him?",
-                                    buddy_key);
-
-    gchar *request_msg = NULL;
-    if (length > 0)
+    else if ((c >= 0xC2) && (c <= 0xDF))
     {
-        request_msg = g_strndup((const gchar *)data, length);
+        n = 2;
     }
-
-    toxprpl_accept_friend_data *fdata = g_new0(toxprpl_accept_friend_data, 1);
-    fdata->gc = gc;
-    fdata->buddy_key = buddy_key;
-    purple_request_yes_no(gc, "New friend request", dialog_message,
-                          request_msg,
-                          PURPLE_DEFAULT_ACTION_NONE,
-                          account, NULL,
-                          NULL,
-                          fdata, // buddy key will be freed elsewhere
-                          G_CALLBACK(toxprpl_add_to_buddylist),
-                          G_CALLBACK(toxprpl_do_not_add_to_buddylist));
-    g_free(dialog_message);
-    g_free(request_msg);
-}
-
-static void on_friend_action(Tox *tox, int friendnum, uint8_t* string,
-                             uint16_t length, void *user_data)
-{
-    purple_debug_info("toxprpl", "action received\n");
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-
-    uint8_t client_id[TOX_CLIENT_ID_SIZE];
-    if (tox_get_client_id(tox, friendnum, client_id) < 0)
+    else if ((c >= 0xE0) && (c <= 0xEF))
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
-        return;
+        n = 3;
+        if (c == 0xE0)
+        {
+            lo = 0xA0; // overlong
+        }
+        else if (c == 0xED)
+        {
+            hi = 0x9F; // surrogates
+        }
     }
-
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
-    gchar *safemsg = g_strndup((const char *)string, length);
-    gchar *message = g_strdup_printf("/me %s", safemsg);
-    g_free(safemsg);
-
-    serv_got_im(gc, buddy_key, message, PURPLE_MESSAGE_RECV,
-                time(NULL));
-    g_free(buddy_key);
-    g_free(message);
-}
-
-static void on_incoming_message(Tox *tox, int friendnum, uint8_t* string,
-                                uint16_t length, void *user_data)
-{
-    purple_debug_info("toxprpl", "Message received!\n");
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-
-    uint8_t client_id[TOX_CLIENT_ID_SIZE];
-    if (tox_get_client_id(tox, friendnum, client_id) < 0)
+    else if ((c >= 0xF0) && (c <= 0xF4))
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
-        return;
+        n = 4;
+        if (c == 0xF0)
+        {
+            lo = 0x90; // overlong
+        }
+        else if (c == 0xF4)
+        {
+            hi = 0x8F; // above U+10FFFF
+        }
+    }
+    else
+    {
+        return 0;
     }
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
-    gchar *safemsg = g_strndup((const char *)string, length);
-    serv_got_im(gc, buddy_key, safemsg, PURPLE_MESSAGE_RECV,
-                time(NULL));
-    g_free(buddy_key);
-    g_free(safemsg);
+    if ((avail < n) || (p[1] < lo) || (p[1] > hi))
+    {
+        return 0;
+    }
+    for (i = 2; i < n; i++)
+    {
+        if ((p[i] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+    }
+    return n;
 }
 
-static void on_nick_change(Tox *tox, int friendnum, uint8_t* data,
-                           uint16_t length, void *user_data)
+/*
+ * makes peer supplied text safe to hand to libpurple, in place: invalid UTF-8
+ * bytes are replaced by '?', control characters other than tab and newline
+ * (including NUL and the C1 range) are removed. returns the new length, the
+ * text is not terminated. with SSE2, runs of printable ASCII are skipped 16
+ * bytes at a time.
+ */
+static size_t toxprpl_utf8_sanitize(char *text, size_t length)
 {
-    purple_debug_info("toxprpl", "Nick change!\n");
+    uint8_t *r = (uint8_t *)text;
+    uint8_t *w = r;
+    uint8_t *end = r + length;
 
-    PurpleConnection *gc = (PurpleConnection *)user_data;
+    while (r < end)
+    {
+#ifdef __SSE2__
+        const __m128i space = _mm_set1_epi8(0x20);
+        const __m128i del = _mm_set1_epi8(0x7F);
+        while (end - r >= 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)r);
+            // bytes >= 0x80 are negative and thus also below 0x20
+            int mask = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)));
+            if (mask != 0)
+            {
+                int skip = 0;
+                while (!(mask & (1 << skip)))
+                {
+                    skip++;
+                }
+                memmove(w, r, skip);
+                w += skip;
+                r += skip;
+                break;
+            }
+            if (w != r)
+            {
+                _mm_storeu_si128((__m128i *)w, v);
+            }
+            w += 16;
+            r += 16;
+        }
+        if (r == end)
+        {
+            break;
+        }
+#endif
+        uint8_t c = *r;
+        if (c < 0x80)
+        {
+            if (((c >= 0x20) && (c != 0x7F)) || (c == '\t') || (c == '\n'))
+            {
+                *w++ = c;
+            }
+            r++;
+            continue;
+        }
+
+        size_t n = toxprpl_utf8_sequence_length(r, end - r);
+        if (n == 0)
+        {
+            *w++ = '?';
+            r++;
+        }
+        else if ((c == 0xC2) && (r[1] < 0xA0))
+        {
+            r += n; // C1 control character
+        }
+        else
+        {
+            memmove(w, r, n);
+            w += n;
+            r += n;
+        }
+    }
+    return w - (uint8_t *)text;
+}
+
+// sanitizes a NUL terminated string in place
+static char *toxprpl_utf8_sanitize_string(char *str)
+{
+    str[toxprpl_utf8_sanitize(str, strlen(str))] = '\0';
+    return str;
+}
+
+/* object pools */
+static void toxprpl_pool_init(toxprpl_pool *pool, size_t object_size)
+{
+    memset(pool, 0, sizeof(toxprpl_pool));
+    // room for the free list link, objects stay pointer aligned
+    object_size = MAX(object_size, sizeof(gpointer));
+    pool->object_size = (object_size + sizeof(gpointer) - 1) &
+                        ~(sizeof(gpointer) - 1);
+    pool->slab_objects = (TOXPRPL_POOL_SLAB_SIZE - sizeof(toxprpl_pool_slab)) /
+                         pool->object_size;
+    pool->slab_used = pool->slab_objects;
+}
+
+// zero filled like g_new0()
+static gpointer toxprpl_pool_alloc0(toxprpl_pool *pool)
+{
+    gpointer object = pool->free_list;
+    if (object != NULL)
+    {
+        pool->free_list = *(gpointer *)object;
+    }
+    else
+    {
+        if (pool->slab_used == pool->slab_objects)
+        {
+            toxprpl_pool_slab *slab = g_malloc(TOXPRPL_POOL_SLAB_SIZE);
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            pool->slab_used = 0;
+            pool->slab_count++;
+        }
+        object = pool->slabs->data + pool->slab_used++ * pool->object_size;
+    }
+    pool->in_use++;
+    return memset(object, 0, pool->object_size);
+}
+
+static void toxprpl_pool_free(toxprpl_pool *pool, gpointer object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+    *(gpointer *)object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+}
+
+// releases all objects at once, the pool can be used again afterwards
+static void toxprpl_pool_destroy(toxprpl_pool *pool)
+{
+    while (pool->slabs != NULL)
+    {
+        toxprpl_pool_slab *next = pool->slabs->next;
+        g_free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free_list = NULL;
+    pool->in_use = 0;
+    pool->slab_count = 0;
+    pool->slab_used = pool->slab_objects;
+}
+
+#define toxprpl_pool_new0(pool, type) ((type *)toxprpl_pool_alloc0(pool))
+
+/* scratch arena */
+static gpointer toxprpl_arena_alloc(toxprpl_arena *arena, size_t size)
+{
+    // only strings and byte buffers live here, pointer alignment is enough
+    size = (size + sizeof(gpointer) - 1) & ~(sizeof(gpointer) - 1);
+
+    toxprpl_arena_block *block = arena->head;
+    if ((block == NULL) || (block->size - block->used < size))
+    {
+        size_t block_size = MAX(MAX(arena->block_size,
+                                    TOXPRPL_ARENA_BLOCK_SIZE), size);
+        block = g_malloc(sizeof(toxprpl_arena_block) + block_size);
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+        arena->heap_allocs++;
+    }
+
+    gpointer p = block->data + block->used;
+    block->used += size;
+    arena->in_use += size;
+    arena->allocs++;
+    return p;
+}
+
+static void toxprpl_arena_free_blocks(toxprpl_arena *arena)
+{
+    while (arena->head != NULL)
+    {
+        toxprpl_arena_block *next = arena->head->next;
+        g_free(arena->head);
+        arena->head = next;
+    }
+}
+
+static void toxprpl_arena_reset(toxprpl_arena *arena)
+{
+    arena->high_water = MAX(arena->high_water, arena->in_use);
+    arena->in_use = 0;
+
+    if ((arena->head != NULL) && (arena->head->next != NULL))
+    {
+        // this iteration needed more than one block, replace them by one
+        // that is big enough for next time
+        toxprpl_arena_free_blocks(arena);
+        arena->block_size = arena->high_water;
+    }
+    else if (arena->head != NULL)
+    {
+        arena->head->used = 0;
+    }
+}
+
+// NUL terminated copy of len bytes of data
+static gchar *toxprpl_arena_strndup(toxprpl_arena *arena, const void *data,
+                                    size_t len)
+{
+    gchar *str = toxprpl_arena_alloc(arena, len + 1);
+    memcpy(str, data, len);
+    str[len] = '\0';
+    return str;
+}
+
+// NUL terminated and sanitized copy of peer supplied text
+static gchar *toxprpl_arena_strndup_utf8(toxprpl_arena *arena,
+                                         const void *data, size_t len)
+{
+    gchar *str = toxprpl_arena_alloc(arena, len + 1);
+    memcpy(str, data, len);
+    str[toxprpl_utf8_sanitize(str, len)] = '\0';
+    return str;
+}
+
+static gchar *toxprpl_arena_bin_id_to_string(toxprpl_arena *arena,
+                                             const uint8_t *bin_id)
+{
+    return toxprpl_data_to_hex(bin_id, TOX_CLIENT_ID_SIZE,
+        toxprpl_arena_alloc(arena, TOX_CLIENT_ID_SIZE * 2 + 1));
+}
+
+/* friend table lookups */
+// hex key of a friend in the scratch arena, NULL if there is no such friend
+static gchar *toxprpl_friend_buddy_key(toxprpl_plugin_data *plugin, int fnum)
+{
+    if (!toxprpl_friend_known(&plugin->friends, fnum))
+    {
+        // added behind our back, e.g. by a friend request callback
+        toxprpl_friend_update(&plugin->friends, plugin->tox, fnum);
+        if (!toxprpl_friend_known(&plugin->friends, fnum))
+        {
+            return NULL;
+        }
+    }
+    return toxprpl_arena_bin_id_to_string(&plugin->scratch,
+        plugin->friends.keys + fnum * TOX_CLIENT_ID_SIZE);
+}
+
+static PurpleBuddy *toxprpl_friend_buddy(toxprpl_plugin_data *plugin,
+                                         int fnum)
+{
+    if (!toxprpl_friend_known(&plugin->friends, fnum))
+    {
+        return NULL;
+    }
+    return plugin->friends.buddies[fnum];
+}
+
+// online and announced on the LAN lately. announcements are not signed, so
+// this is only what someone on the LAN claims, not the path the core uses
+static gboolean toxprpl_friend_on_lan(toxprpl_plugin_data *plugin, int fnum)
+{
+    return toxprpl_friend_known(&plugin->friends, fnum) &&
+           plugin->friends.connection[fnum] &&
+           (plugin->friends.lan_seen[fnum] != 0) &&
+           (g_get_monotonic_time() - plugin->friends.lan_seen[fnum] <
+            TOXPRPL_LAN_TIMEOUT_US);
+}
+
+// ties a buddy to a friend number in both directions
+static toxprpl_buddy_data *toxprpl_buddy_attach(toxprpl_plugin_data *plugin,
+                                                PurpleBuddy *buddy, int fnum)
+{
+    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+    if (buddy_data == NULL)
+    {
+        buddy_data = toxprpl_pool_new0(&plugin->buddy_pool,
+                                       toxprpl_buddy_data);
+        purple_buddy_set_protocol_data(buddy, buddy_data);
+    }
+    buddy_data->tox_friendlist_number = fnum;
+    if (toxprpl_friend_known(&plugin->friends, fnum))
+    {
+        plugin->friends.buddies[fnum] = buddy;
+    }
+    return buddy_data;
+}
+
+/* histograms */
+static guint toxprpl_histogram_index(guint64 value)
+{
+    if (value < TOXPRPL_HISTOGRAM_SUB_COUNT)
+    {
+        return (guint)value;
+    }
+
+    guint msb = 0;
+    guint64 v = value;
+    while (v >>= 1)
+    {
+        msb++;
+    }
+
+    guint shift = msb - TOXPRPL_HISTOGRAM_SUB_BITS;
+    guint index = (shift + 1) * TOXPRPL_HISTOGRAM_SUB_COUNT +
+        (guint)((value >> shift) & (TOXPRPL_HISTOGRAM_SUB_COUNT - 1));
+    return MIN(index, TOXPRPL_HISTOGRAM_BUCKETS - 1);
+}
+
+// smallest value that is counted in the given bucket
+static guint64 toxprpl_histogram_bucket_value(guint index)
+{
+    if (index < TOXPRPL_HISTOGRAM_SUB_COUNT)
+    {
+        return index;
+    }
+
+    guint shift = index / TOXPRPL_HISTOGRAM_SUB_COUNT - 1;
+    guint64 mantissa = TOXPRPL_HISTOGRAM_SUB_COUNT +
+                       index % TOXPRPL_HISTOGRAM_SUB_COUNT;
+    return mantissa << shift;
+}
+
+static void toxprpl_histogram_record(toxprpl_histogram *h, guint64 value)
+{
+    if ((h->count == 0) || (value < h->min))
+    {
+        h->min = value;
+    }
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+    h->count++;
+    h->sum += value;
+    h->buckets[toxprpl_histogram_index(value)]++;
+}
+
+// percentile in the range 0 - 100
+static guint64 toxprpl_histogram_percentile(const toxprpl_histogram *h,
+                                            double percentile)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+
+    guint64 rank = (guint64)(percentile / 100.0 * h->count + 0.5);
+    guint64 seen = 0;
+    guint i;
+    rank = CLAMP(rank, 1, h->count);
+    for (i = 0; i < TOXPRPL_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            return CLAMP(toxprpl_histogram_bucket_value(i), h->min, h->max);
+        }
+    }
+    return h->max;
+}
+
+// one line summary, values are reported in milliseconds
+static gchar *toxprpl_histogram_summary_ms(const toxprpl_histogram *h)
+{
+    if (h->count == 0)
+    {
+        return g_strdup(_("no samples"));
+    }
+
+    return g_strdup_printf("n=%" G_GUINT64_FORMAT " min=%.1f p50=%.1f "
+        "p90=%.1f p99=%.1f max=%.1f avg=%.1f ms", h->count, h->min / 1000.0,
+        toxprpl_histogram_percentile(h, 50) / 1000.0,
+        toxprpl_histogram_percentile(h, 90) / 1000.0,
+        toxprpl_histogram_percentile(h, 99) / 1000.0,
+        h->max / 1000.0, (double)h->sum / h->count / 1000.0);
+}
+
+/* metrics */
+#define toxprpl_metric_add(plugin, metric, n) \
+    ((plugin)->metrics.values[(metric)] += (n))
+
+#define toxprpl_metric_observe(plugin, metric, value) \
+    toxprpl_histogram_record(&(plugin)->metrics.histograms[(metric)], (value))
+
+/* trace ring */
+#ifndef TOXPRPL_NO_TRACE
+static toxprpl_trace_record toxprpl_trace_ring[TOXPRPL_TRACE_RECORDS];
+static volatile gint toxprpl_trace_head;
+
+static void toxprpl_trace(toxprpl_trace_event event, int friendnumber,
+                          guint32 arg0, guint32 arg1)
+{
+    guint index = (guint)g_atomic_int_add(&toxprpl_trace_head, 1);
+    toxprpl_trace_record *record =
+        &toxprpl_trace_ring[index & (TOXPRPL_TRACE_RECORDS - 1)];
+    record->time = (guint64)g_get_monotonic_time();
+    record->event = event;
+    record->friendnumber = friendnumber;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+}
+
+// writes the decimal representation of value to p, returns the end
+static char *toxprpl_trace_format(char *p, gint64 value)
+{
+    char digits[20];
+    int n = 0;
+    guint64 v = value < 0 ? (guint64)-value : (guint64)value;
+
+    if (value < 0)
+    {
+        *p++ = '-';
+    }
+    do
+    {
+        digits[n++] = '0' + (char)(v % 10);
+        v /= 10;
+    } while (v > 0);
+    while (n > 0)
+    {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+/*
+ * writes the ring as text, oldest record first: time, event, friend number
+ * and the two arguments. only uses async-signal-safe functions so that it
+ * can run in the crash handler
+ */
+static void toxprpl_trace_write(int fd)
+{
+    guint head = (guint)g_atomic_int_get(&toxprpl_trace_head);
+    guint i = head > TOXPRPL_TRACE_RECORDS ? head - TOXPRPL_TRACE_RECORDS : 0;
+    char line[128];
+
+    for (; i != head; i++)
+    {
+        const toxprpl_trace_record *record =
+            &toxprpl_trace_ring[i & (TOXPRPL_TRACE_RECORDS - 1)];
+        if ((record->time == 0) || (record->event >= TOXPRPL_TRACE_COUNT))
+        {
+            continue;
+        }
+
+        const char *name = toxprpl_trace_names[record->event];
+        size_t name_len = strlen(name);
+        char *p = toxprpl_trace_format(line, (gint64)record->time);
+        *p++ = ' ';
+        memcpy(p, name, name_len);
+        p += name_len;
+        *p++ = ' ';
+        p = toxprpl_trace_format(p, record->friendnumber);
+        *p++ = ' ';
+        p = toxprpl_trace_format(p, record->arg0);
+        *p++ = ' ';
+        p = toxprpl_trace_format(p, record->arg1);
+        *p++ = '\n';
+        if (write(fd, line, p - line) < 0)
+        {
+            return;
+        }
+    }
+}
+
+static gboolean toxprpl_trace_dump(const char *path)
+{
+    int fd = g_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                    S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        purple_debug_warning("toxprpl", "could not write %s: %s\n", path,
+                             strerror(errno));
+        return FALSE;
+    }
+    toxprpl_trace_write(fd);
+    close(fd);
+    return TRUE;
+}
+
+#ifndef __WIN32__
+static const int toxprpl_crash_signals[] =
+{
+    SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT
+};
+
+static struct sigaction toxprpl_crash_old[G_N_ELEMENTS(toxprpl_crash_signals)];
+static char *toxprpl_crash_path;
+static guint toxprpl_crash_users;   // accounts with the "crash_trace" option
+
+// dumps the trace and hands the signal on to the previous handler
+static void toxprpl_crash_handler(int sig)
+{
+    guint i;
+    int fd = open(toxprpl_crash_path, O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR);
+    if (fd >= 0)
+    {
+        toxprpl_trace_write(fd);
+        close(fd);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(toxprpl_crash_signals); i++)
+    {
+        if (toxprpl_crash_signals[i] == sig)
+        {
+            sigaction(sig, &toxprpl_crash_old[i], NULL);
+        }
+    }
+    raise(sig);
+}
+
+// the handlers of the whole process are only replaced while an account
+// asked for it, the first one installs them and the last one restores the
+// previous handlers
+static void toxprpl_crash_handler_install(void)
+{
+    struct sigaction action;
+    guint i;
+
+    if (toxprpl_crash_users++ > 0)
+    {
+        return;
+    }
+
+    gchar *dir = g_build_filename(purple_user_dir(), "tox", NULL);
+    purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    toxprpl_crash_path = g_build_filename(dir, "crash.trace", NULL);
+    g_free(dir);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = toxprpl_crash_handler;
+    sigemptyset(&action.sa_mask);
+    for (i = 0; i < G_N_ELEMENTS(toxprpl_crash_signals); i++)
+    {
+        sigaction(toxprpl_crash_signals[i], &action, &toxprpl_crash_old[i]);
+    }
+}
+
+static void toxprpl_crash_handler_remove(void)
+{
+    guint i;
+
+    if ((toxprpl_crash_users == 0) || (--toxprpl_crash_users > 0))
+    {
+        return;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(toxprpl_crash_signals); i++)
+    {
+        sigaction(toxprpl_crash_signals[i], &toxprpl_crash_old[i], NULL);
+    }
+    g_free(toxprpl_crash_path);
+    toxprpl_crash_path = NULL;
+}
+#endif
+#else
+    #define toxprpl_trace(event, friendnumber, arg0, arg1) ((void)0)
+#endif
+
+/* chrome trace */
+/*
+ * opt-in timing trace in the Chrome trace event format, one complete ("X")
+ * event per span. the file is a JSON array that is never closed, which trace
+ * viewers accept, so it stays valid when pidgin is killed. once it grows
+ * beyond TOXPRPL_CHROME_TRACE_MAX_SIZE it is moved to <name>.1 and a new one
+ * is started. shared by all accounts that enabled it, only their spans are
+ * recorded and each account shows up as a process of its own
+ */
+#define TOXPRPL_CHROME_TRACE_MAX_SIZE   (32 * 1024 * 1024)
+
+static FILE *toxprpl_chrome_trace;
+static gchar *toxprpl_chrome_trace_path;
+static guint toxprpl_chrome_trace_users;
+static guint toxprpl_chrome_trace_last_id;
+
+static void toxprpl_chrome_trace_open(void)
+{
+    toxprpl_chrome_trace = g_fopen(toxprpl_chrome_trace_path, "wb");
+    if (toxprpl_chrome_trace == NULL)
+    {
+        purple_debug_warning("toxprpl", "could not write %s: %s\n",
+                             toxprpl_chrome_trace_path, strerror(errno));
+        return;
+    }
+    setvbuf(toxprpl_chrome_trace, NULL, _IOFBF, 64 * 1024);
+    fputs("[\n", toxprpl_chrome_trace);
+}
+
+// returns the id of the account in the trace
+static guint toxprpl_chrome_trace_start(void)
+{
+    if (toxprpl_chrome_trace_users++ > 0)
+    {
+        return ++toxprpl_chrome_trace_last_id;
+    }
+
+    gchar *dir = g_build_filename(purple_user_dir(), "tox", NULL);
+    purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    toxprpl_chrome_trace_path = g_build_filename(dir, "toxprpl-trace.json",
+                                                 NULL);
+    g_free(dir);
+    toxprpl_chrome_trace_open();
+    purple_debug_info("toxprpl", "writing timing trace to %s\n",
+                      toxprpl_chrome_trace_path);
+    return ++toxprpl_chrome_trace_last_id;
+}
+
+static void toxprpl_chrome_trace_stop(void)
+{
+    if ((toxprpl_chrome_trace_users == 0) ||
+        (--toxprpl_chrome_trace_users > 0))
+    {
+        return;
+    }
+
+    if (toxprpl_chrome_trace != NULL)
+    {
+        fclose(toxprpl_chrome_trace);
+        toxprpl_chrome_trace = NULL;
+    }
+    g_free(toxprpl_chrome_trace_path);
+    toxprpl_chrome_trace_path = NULL;
+}
+
+static void toxprpl_chrome_trace_rotate(void)
+{
+    gchar *old_path = g_strconcat(toxprpl_chrome_trace_path, ".1", NULL);
+    fclose(toxprpl_chrome_trace);
+    g_unlink(old_path);
+    g_rename(toxprpl_chrome_trace_path, old_path);
+    g_free(old_path);
+    toxprpl_chrome_trace_open();
+}
+
+static gboolean toxprpl_span_traced(toxprpl_plugin_data *plugin)
+{
+    return (plugin != NULL) && plugin->chrome_trace &&
+           (toxprpl_chrome_trace != NULL);
+}
+
+// returns the start time of a span, 0 if the account is not traced
+static gint64 toxprpl_span_begin(toxprpl_plugin_data *plugin)
+{
+    return toxprpl_span_traced(plugin) ? g_get_monotonic_time() : 0;
+}
+
+static void toxprpl_span_end(toxprpl_plugin_data *plugin, const char *name,
+                             const char *category, gint64 start,
+                             int friendnumber)
+{
+    if ((start == 0) || !toxprpl_span_traced(plugin))
+    {
+        return;
+    }
+
+    gint64 end = g_get_monotonic_time();
+    fprintf(toxprpl_chrome_trace, "{\"name\":\"%s\",\"cat\":\"%s\","
+            "\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT ",\"dur\":%"
+            G_GINT64_FORMAT ",\"pid\":%u,\"tid\":%u", name, category,
+            start, end - start, plugin->trace_id, plugin->trace_id);
+    if (friendnumber >= 0)
+    {
+        fprintf(toxprpl_chrome_trace, ",\"args\":{\"friend\":%d}",
+                friendnumber);
+    }
+    fputs("},\n", toxprpl_chrome_trace);
+
+    if (ftell(toxprpl_chrome_trace) > TOXPRPL_CHROME_TRACE_MAX_SIZE)
+    {
+        toxprpl_chrome_trace_rotate();
+    }
+}
+
+// around every tox callback, see toxprpl_cb_incoming_message() and friends
+static gint64 toxprpl_callback_begin(PurpleConnection *gc,
+                                     toxprpl_metric metric, int friendnumber,
+                                     guint32 arg)
+{
+    toxprpl_trace(TOXPRPL_TRACE_CALLBACK, friendnumber, metric, arg);
+    toxprpl_probe3(callback__entry, toxprpl_metric_infos[metric].name,
+                   friendnumber, arg);
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if (plugin != NULL)
+    {
+        plugin->metrics.values[metric]++;
+    }
+    gint64 start = toxprpl_span_begin(plugin);
+    return start != 0 ? start : toxprpl_probe_time(callback__return);
+}
+
+static void toxprpl_callback_end(PurpleConnection *gc, toxprpl_metric metric,
+                                 gint64 start, int friendnumber)
+{
+    toxprpl_probe3(callback__return, toxprpl_metric_infos[metric].name,
+                   friendnumber, toxprpl_probe_time(callback__return) - start);
+    // skip the "callbacks." prefix
+    toxprpl_span_end(purple_connection_get_protocol_data(gc),
+                     strchr(toxprpl_metric_infos[metric].name, '.') + 1,
+                     "callback", start, friendnumber);
+}
+
+// gauges are sampled when the metrics are read, not maintained on updates
+static void toxprpl_metrics_refresh(PurpleConnection *gc,
+                                    toxprpl_plugin_data *plugin)
+{
+    gint64 *values = plugin->metrics.values;
+    values[TOXPRPL_METRIC_FRIENDS] = tox_count_friendlist(plugin->tox);
+    values[TOXPRPL_METRIC_IPV6] = plugin->ipv6;
+    values[TOXPRPL_METRIC_FRIENDS_ONLINE] = 0;
+    guint i;
+    for (i = 0; i < plugin->friends.size; i++)
+    {
+        values[TOXPRPL_METRIC_FRIENDS_ONLINE] += plugin->friends.connection[i];
+    }
+    values[TOXPRPL_METRIC_FRIENDS_LAN] = 0;
+    for (i = 0; i < plugin->friends.size; i++)
+    {
+        values[TOXPRPL_METRIC_FRIENDS_LAN] +=
+            toxprpl_friend_on_lan(plugin, (int)i);
+    }
+    values[TOXPRPL_METRIC_OFFLINE_QUEUED] = plugin->offline_queued;
+    values[TOXPRPL_METRIC_RECEIPTS_PENDING] =
+        g_hash_table_size(plugin->receipts);
+    values[TOXPRPL_METRIC_REQUESTS_PENDING] = g_hash_table_size(plugin->inbox);
+    PurpleAccount *account = purple_connection_get_account(gc);
+    GList *l;
+    values[TOXPRPL_METRIC_TRANSFERS] = 0;
+    for (l = purple_xfers_get_all(); l != NULL; l = l->next)
+    {
+        if (purple_xfer_get_account(l->data) == account)
+        {
+            values[TOXPRPL_METRIC_TRANSFERS]++;
+        }
+    }
+    values[TOXPRPL_METRIC_ARENA_HIGH_WATER] = plugin->scratch.high_water;
+    values[TOXPRPL_METRIC_POOL_SIZE] = (plugin->buddy_pool.slab_count +
+        plugin->xfer_pool.slab_count + plugin->message_pool.slab_count +
+        plugin->group_pool.slab_count) * TOXPRPL_POOL_SLAB_SIZE;
+    int dht_fd = toxprpl_udp_core_fd(plugin);
+    values[TOXPRPL_METRIC_UDP_RCVBUF] =
+        toxprpl_udp_buffer_size(dht_fd, SO_RCVBUF);
+    values[TOXPRPL_METRIC_UDP_SNDBUF] =
+        toxprpl_udp_buffer_size(dht_fd, SO_SNDBUF);
+    values[TOXPRPL_METRIC_UDP_DROPS] = toxprpl_udp_drops(dht_fd);
+    values[TOXPRPL_METRIC_GROUPS] = g_hash_table_size(plugin->groups);
+    values[TOXPRPL_METRIC_GROUP_PEERS] = 0;
+    GHashTableIter iter;
+    gpointer group;
+    g_hash_table_iter_init(&iter, plugin->groups);
+    while (g_hash_table_iter_next(&iter, NULL, &group))
+    {
+        values[TOXPRPL_METRIC_GROUP_PEERS] +=
+            ((toxprpl_group *)group)->peers->len;
+    }
+}
+
+static void toxprpl_json_append_string(GString *json, const char *str)
+{
+    g_string_append_c(json, '"');
+    for (; *str != '\0'; str++)
+    {
+        unsigned char c = (unsigned char)*str;
+        if ((c == '"') || (c == '\\'))
+        {
+            g_string_append_c(json, '\\');
+            g_string_append_c(json, c);
+        }
+        else if (c < 0x20)
+        {
+            g_string_append_printf(json, "\\u%04x", c);
+        }
+        else
+        {
+            g_string_append_c(json, c);
+        }
+    }
+    g_string_append_c(json, '"');
+}
+
+static gchar *toxprpl_metrics_to_json(PurpleConnection *gc,
+                                      toxprpl_plugin_data *plugin)
+{
+    PurpleAccount *account = purple_connection_get_account(gc);
+    GString *json = g_string_new("{\"account\":");
+    guint i;
+
+    toxprpl_metrics_refresh(gc, plugin);
+    toxprpl_json_append_string(json, purple_account_get_username(account));
+    g_string_append_printf(json, ",\"time\":%ld,\"counters\":{",
+                           (long)time(NULL));
+    for (i = 0; i < TOXPRPL_METRIC_COUNT; i++)
+    {
+        if (i == TOXPRPL_METRIC_FIRST_GAUGE)
+        {
+            g_string_truncate(json, json->len - 1);
+            g_string_append(json, "},\"gauges\":{");
+        }
+        g_string_append_printf(json, "\"%s\":%" G_GINT64_FORMAT ",",
+            toxprpl_metric_infos[i].name, plugin->metrics.values[i]);
+    }
+    g_string_truncate(json, json->len - 1);
+    g_string_append(json, "},\"histograms\":{");
+    for (i = 0; i < TOXPRPL_HISTOGRAM_COUNT; i++)
+    {
+        const toxprpl_histogram *h = &plugin->metrics.histograms[i];
+        g_string_append_printf(json, "%s\"%s\":{\"unit\":\"%s\","
+            "\"count\":%" G_GUINT64_FORMAT ",\"sum\":%" G_GUINT64_FORMAT ","
+            "\"min\":%" G_GUINT64_FORMAT ",\"p50\":%" G_GUINT64_FORMAT ","
+            "\"p90\":%" G_GUINT64_FORMAT ",\"p99\":%" G_GUINT64_FORMAT ","
+            "\"max\":%" G_GUINT64_FORMAT "}", i == 0 ? "" : ",",
+            toxprpl_histogram_infos[i].name, toxprpl_histogram_infos[i].unit,
+            h->count, h->sum, h->min, toxprpl_histogram_percentile(h, 50),
+            toxprpl_histogram_percentile(h, 90),
+            toxprpl_histogram_percentile(h, 99), h->max);
+    }
+    g_string_append(json, "}}\n");
+    return g_string_free(json, FALSE);
+}
+
+static gboolean toxprpl_metrics_dump(gpointer data)
+{
+    PurpleConnection *gc = (PurpleConnection *)data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin != NULL, FALSE);
+
+    GError *error = NULL;
+    gchar *json = toxprpl_metrics_to_json(gc, plugin);
+    if (!g_file_set_contents(plugin->metrics_path, json, -1, &error))
+    {
+        purple_debug_warning("toxprpl", "could not write %s: %s\n",
+                             plugin->metrics_path, error->message);
+        g_error_free(error);
+    }
+    g_free(json);
+    return TRUE;
+}
+
+/* delivery tracking */
+static void toxprpl_receipt_free(toxprpl_receipt *receipt)
+{
+    g_free(receipt->excerpt);
+    g_free(receipt);
+}
+
+static gint64 toxprpl_receipt_key(int friendnumber, uint32_t message_id)
+{
+    return ((gint64)friendnumber << 32) | message_id;
+}
+
+static void toxprpl_receipt_track(toxprpl_plugin_data *plugin,
+                                  int friendnumber, uint32_t message_id,
+                                  const uint8_t *text, uint32_t length)
+{
+    toxprpl_return_if_fail(plugin->receipts != NULL);
+
+    toxprpl_receipt *receipt = g_new0(toxprpl_receipt, 1);
+    receipt->key = toxprpl_receipt_key(friendnumber, message_id);
+    receipt->friendnumber = friendnumber;
+    receipt->sent = g_get_monotonic_time();
+    uint32_t excerpt_length = toxprpl_utf8_fragment_length(
+        (const char *)text, length, TOXPRPL_RECEIPT_EXCERPT);
+    receipt->excerpt = g_strndup((const gchar *)text, excerpt_length);
+    receipt->truncated = excerpt_length < length;
+    g_hash_table_replace(plugin->receipts, &receipt->key, receipt);
+}
+
+// nothing is known about the message, it may have arrived anyway
+static void toxprpl_receipt_unconfirmed(PurpleConnection *gc,
+                                        toxprpl_plugin_data *plugin,
+                                        toxprpl_receipt *receipt)
+{
+    uint8_t client_id[TOX_CLIENT_ID_SIZE];
+    if (tox_get_client_id(plugin->tox, receipt->friendnumber, client_id) < 0)
+    {
+        return;
+    }
+
+    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
+    PurpleAccount *account = purple_connection_get_account(gc);
+    purple_debug_info("toxprpl", "message to %s was not confirmed\n",
+                      buddy_key);
+
+    PurpleConversation *conv = purple_find_conversation_with_account(
+        PURPLE_CONV_TYPE_IM, buddy_key, account);
+    if (conv != NULL)
+    {
+        gchar *excerpt = g_markup_escape_text(receipt->excerpt, -1);
+        gchar *message = g_strdup_printf(_("Delivery not confirmed: %s%s"),
+            excerpt, receipt->truncated ? "..." : "");
+        purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_ERROR,
+                                  time(NULL));
+        g_free(message);
+        g_free(excerpt);
+    }
+    g_free(buddy_key);
+}
+
+// reports and drops receipts that did not arrive in time, or all receipts
+// of a friend that went offline if friendnumber is not -1. the ones of a
+// removed friend are dropped silently, the core does not know it anymore
+static void toxprpl_receipt_expire(PurpleConnection *gc,
+                                   toxprpl_plugin_data *plugin,
+                                   int friendnumber)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    toxprpl_return_if_fail(plugin->receipts != NULL);
+    gint64 deadline = g_get_monotonic_time() -
+                      (gint64)TOXPRPL_RECEIPT_TIMEOUT * G_USEC_PER_SEC;
+
+    g_hash_table_iter_init(&iter, plugin->receipts);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_receipt *receipt = value;
+        if ((friendnumber == -1) ? (receipt->sent < deadline) :
+                                   (receipt->friendnumber == friendnumber))
+        {
+            toxprpl_receipt_unconfirmed(gc, plugin, receipt);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+}
+
+/* typing notifications */
+static void toxprpl_typing_free(toxprpl_typing_data *typing)
+{
+    if (typing->timer != 0)
+    {
+        purple_timeout_remove(typing->timer);
+    }
+    g_free(typing);
+}
+
+static void toxprpl_typing_update(toxprpl_typing_data *typing)
+{
+    if (typing->wanted != typing->sent)
+    {
+        toxprpl_debug("Send typing state %d to friend %d\n",
+                      typing->wanted, typing->friendnumber);
+        tox_set_user_is_typing(typing->tox, typing->friendnumber,
+                               typing->wanted);
+        typing->sent = typing->wanted;
+    }
+}
+
+static gboolean toxprpl_typing_timeout(gpointer data)
+{
+    toxprpl_typing_data *typing = data;
+    typing->timer = 0;
+    toxprpl_typing_update(typing);
+    return FALSE;
+}
+
+// friend went offline, it will assume that we are not typing anymore
+static void toxprpl_typing_reset(toxprpl_plugin_data *plugin, int fnum)
+{
+    toxprpl_return_if_fail(plugin->typing != NULL);
+    g_hash_table_remove(plugin->typing, GINT_TO_POINTER(fnum));
+}
+
+/* offline message queue */
+static void toxprpl_offline_message_free(toxprpl_plugin_data *plugin,
+                                         GOfflineMessage *msg)
+{
+    g_free(msg->message);
+    toxprpl_pool_free(&plugin->message_pool, msg);
+}
+
+static void toxprpl_offline_message_free_text(GOfflineMessage *msg)
+{
+    g_free(msg->message);
+}
+
+// only when the connection closes, the messages themselves go with the pool
+static void toxprpl_offline_queue_free(GQueue *queue)
+{
+    g_queue_free_full(queue,
+                      (GDestroyNotify)toxprpl_offline_message_free_text);
+}
+
+// hands one NUL terminated piece of a message to a friend or group of the
+// core, FALSE if the core refused it
+typedef gboolean (*toxprpl_send_piece_func)(toxprpl_plugin_data *plugin,
+                                            int target, uint8_t *piece,
+                                            uint32_t piece_len,
+                                            gboolean action);
+
+// splits plain text into as many pieces as needed and hands them to send
+// until one is refused, returns the number of bytes that went out. there
+// is nothing to send in an empty message, it is refused
+static uint32_t toxprpl_send_pieces(toxprpl_plugin_data *plugin, int target,
+                                    const char *text, uint32_t length,
+                                    gboolean action,
+                                    toxprpl_send_piece_func send)
+{
+    toxprpl_return_val_if_fail(length > 0, 0);
+
+    uint8_t piece[TOX_MAX_MESSAGE_LENGTH];
+    uint32_t offset = 0;
+
+    while (offset < length)
+    {
+        uint32_t piece_len = toxprpl_utf8_fragment_length(text + offset,
+            length - offset, TOXPRPL_MAX_FRAGMENT_LENGTH);
+        memcpy(piece, text + offset, piece_len);
+        piece[piece_len] = '\0';
+
+        if (!send(plugin, target, piece, piece_len, action))
+        {
+            break;
+        }
+        toxprpl_metric_add(plugin, TOXPRPL_METRIC_MESSAGES_OUT, 1);
+        toxprpl_metric_add(plugin, TOXPRPL_METRIC_BYTES_OUT, piece_len);
+        offset += piece_len;
+    }
+    return offset;
+}
+
+static gboolean toxprpl_friend_send_piece(toxprpl_plugin_data *plugin,
+                                          int fnum, uint8_t *piece,
+                                          uint32_t piece_len, gboolean action)
+{
+    if (action)
+    {
+        return tox_send_action(plugin->tox, fnum, piece, piece_len + 1) != 0;
+    }
+
+    // only messages are acknowledged with read receipts
+    uint32_t ret = tox_send_message(plugin->tox, fnum, piece, piece_len + 1);
+    if (ret == 0)
+    {
+        return FALSE;
+    }
+    toxprpl_receipt_track(plugin, fnum, ret, piece, piece_len);
+    return TRUE;
+}
+
+// sends plain text to a friend, all pieces are handed to the core right
+// away. returns the number of bytes it accepted
+static uint32_t toxprpl_tox_send(toxprpl_plugin_data *plugin, int fnum,
+                                 const char *text, uint32_t length,
+                                 gboolean action)
+{
+    uint32_t sent = toxprpl_send_pieces(plugin, fnum, text, length, action,
+                                        toxprpl_friend_send_piece);
+    toxprpl_trace(TOXPRPL_TRACE_SEND, fnum, sent, length);
+    return sent;
+}
+
+static void toxprpl_put_le(uint8_t *p, uint64_t value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; i++)
+    {
+        p[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t toxprpl_get_le(const uint8_t *p, int bytes)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = bytes - 1; i >= 0; i--)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void toxprpl_offline_write_record(toxprpl_plugin_data *plugin,
+                                         FILE *fp, uint8_t type,
+                                         const gchar *buddy_key,
+                                         const GOfflineMessage *msg,
+                                         uint32_t count)
+{
+    uint8_t header[1 + TOX_CLIENT_ID_SIZE + 13];
+    size_t header_len = 1 + TOX_CLIENT_ID_SIZE;
+
+    toxprpl_return_if_fail(fp != NULL);
+
+    unsigned char *bin_key = toxprpl_hex_string_to_data(buddy_key);
+    header[0] = type;
+    memcpy(header + 1, bin_key, TOX_CLIENT_ID_SIZE);
+    g_free(bin_key);
+
+    if (type == TOXPRPL_OFFLINE_RECORD_PUSH)
+    {
+        header[header_len] = msg->action ? 1 : 0;
+        toxprpl_put_le(header + header_len + 1, (uint64_t)msg->mtime, 8);
+        toxprpl_put_le(header + header_len + 9, msg->length, 4);
+        header_len += 13;
+    }
+    else
+    {
+        toxprpl_put_le(header + header_len, count, 4);
+        header_len += 4;
+    }
+
+    if ((fwrite(header, 1, header_len, fp) != header_len) ||
+        ((type == TOXPRPL_OFFLINE_RECORD_PUSH) &&
+         (fwrite(msg->message, 1, msg->length, fp) != msg->length)))
+    {
+        purple_debug_warning("toxprpl", "could not write offline queue "
+                                        "record to %s\n", plugin->offline_path);
+    }
+    fflush(fp);
+}
+
+static GQueue *toxprpl_offline_queue_get(toxprpl_plugin_data *plugin,
+                                         const gchar *buddy_key,
+                                         gboolean create)
+{
+    GQueue *queue = g_hash_table_lookup(plugin->offline_queues, buddy_key);
+    if ((queue == NULL) && create)
+    {
+        queue = g_queue_new();
+        g_hash_table_insert(plugin->offline_queues, g_strdup(buddy_key),
+                            queue);
+    }
+    return queue;
+}
+
+static guint toxprpl_offline_queue_depth(toxprpl_plugin_data *plugin,
+                                         const gchar *buddy_key)
+{
+    GQueue *queue = toxprpl_offline_queue_get(plugin, buddy_key, FALSE);
+    return queue == NULL ? 0 : g_queue_get_length(queue);
+}
+
+// takes ownership of msg, returns FALSE if the queue of this friend is full
+static gboolean toxprpl_offline_push(toxprpl_plugin_data *plugin,
+                                     const gchar *buddy_key,
+                                     GOfflineMessage *msg, gboolean persist)
+{
+    GQueue *queue = toxprpl_offline_queue_get(plugin, buddy_key, TRUE);
+    if (g_queue_get_length(queue) >= TOXPRPL_OFFLINE_MAX_MESSAGES)
+    {
+        purple_debug_warning("toxprpl", "offline queue for %s is full\n",
+                             buddy_key);
+        toxprpl_offline_message_free(plugin, msg);
+        return FALSE;
+    }
+
+    g_queue_push_tail(queue, msg);
+    plugin->offline_queued++;
+    plugin->offline_flush = TRUE;
+    if (persist)
+    {
+        toxprpl_offline_write_record(plugin, plugin->offline_file,
+                                     TOXPRPL_OFFLINE_RECORD_PUSH, buddy_key,
+                                     msg, 0);
+    }
+    purple_debug_info("toxprpl", "queued message for %s (%u pending)\n",
+                      buddy_key, g_queue_get_length(queue));
+    return TRUE;
+}
+
+static guint toxprpl_offline_pop(toxprpl_plugin_data *plugin,
+                                 const gchar *buddy_key, guint count)
+{
+    GQueue *queue = toxprpl_offline_queue_get(plugin, buddy_key, FALSE);
+    guint popped = 0;
+    while ((queue != NULL) && (popped < count) && !g_queue_is_empty(queue))
+    {
+        toxprpl_offline_message_free(plugin, g_queue_pop_head(queue));
+        popped++;
+    }
+    plugin->offline_queued -= popped;
+    return popped;
+}
+
+// drops the first count bytes of the head message of a friend, the part
+// of a long message the core already took
+static void toxprpl_offline_trim(toxprpl_plugin_data *plugin,
+                                 const gchar *buddy_key, uint32_t count)
+{
+    GQueue *queue = toxprpl_offline_queue_get(plugin, buddy_key, FALSE);
+    GOfflineMessage *msg = queue == NULL ? NULL : g_queue_peek_head(queue);
+    if ((msg == NULL) || (count >= msg->length))
+    {
+        return;
+    }
+    memmove(msg->message, msg->message + count, msg->length - count + 1);
+    msg->length -= count;
+}
+
+// per account file in the tox directory of the purple user dir
+static gchar *toxprpl_get_data_path(PurpleAccount *account, const char *suffix)
+{
+    gchar *dir = g_build_filename(purple_user_dir(), "tox", NULL);
+    if (purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+    {
+        purple_debug_warning("toxprpl", "could not create %s\n", dir);
+    }
+
+    gchar *name = g_strdup_printf("%s.%s",
+        purple_escape_filename(purple_account_get_username(account)), suffix);
+    gchar *path = g_build_filename(dir, name, NULL);
+    g_free(name);
+    g_free(dir);
+    return path;
+}
+
+// rewrites the queue file so that it only contains undelivered messages
+static void toxprpl_offline_compact(toxprpl_plugin_data *plugin)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (plugin->offline_file != NULL)
+    {
+        fclose(plugin->offline_file);
+        plugin->offline_file = NULL;
+    }
+
+    gchar *tmp_path = g_strconcat(plugin->offline_path, ".tmp", NULL);
+    FILE *fp = g_fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        purple_debug_warning("toxprpl", "could not write %s: %s\n", tmp_path,
+                             strerror(errno));
+        g_free(tmp_path);
+        plugin->offline_file = g_fopen(plugin->offline_path, "ab");
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, plugin->offline_queues);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        GList *l;
+        for (l = g_queue_peek_head_link(value); l != NULL; l = l->next)
+        {
+            toxprpl_offline_write_record(plugin, fp,
+                TOXPRPL_OFFLINE_RECORD_PUSH, key, l->data, 0);
+        }
+    }
+    fclose(fp);
+
+    if (g_rename(tmp_path, plugin->offline_path) != 0)
+    {
+        purple_debug_warning("toxprpl", "could not replace %s: %s\n",
+                             plugin->offline_path, strerror(errno));
+        g_unlink(tmp_path);
+    }
+    g_free(tmp_path);
+    plugin->offline_file = g_fopen(plugin->offline_path, "ab");
+}
+
+// forgets the messages queued for a friend the core does not know anymore,
+// with persist they are popped in the file as well. the caller removes the
+// queue from plugin->offline_queues
+static void toxprpl_offline_discard(toxprpl_plugin_data *plugin,
+                                    const gchar *buddy_key, gboolean persist)
+{
+    guint dropped = toxprpl_offline_pop(plugin, buddy_key, G_MAXUINT);
+    if (dropped == 0)
+    {
+        return;
+    }
+    if (persist)
+    {
+        toxprpl_offline_write_record(plugin, plugin->offline_file,
+            TOXPRPL_OFFLINE_RECORD_POP, buddy_key, NULL, dropped);
+    }
+    purple_debug_info("toxprpl", "dropped %u queued messages for removed "
+                      "friend %s\n", dropped, buddy_key);
+}
+
+// the friend was removed, nothing queued for it may stay on disk
+static void toxprpl_offline_drop(toxprpl_plugin_data *plugin,
+                                 const gchar *buddy_key)
+{
+    if (toxprpl_offline_queue_get(plugin, buddy_key, FALSE) == NULL)
+    {
+        return;
+    }
+    toxprpl_offline_discard(plugin, buddy_key, TRUE);
+    g_hash_table_remove(plugin->offline_queues, buddy_key);
+    if (plugin->offline_queued == 0)
+    {
+        toxprpl_offline_compact(plugin);
+    }
+}
+
+// replays the append-only queue file of the account
+static void toxprpl_offline_load(toxprpl_plugin_data *plugin,
+                                 PurpleAccount *account)
+{
+    gchar *contents = NULL;
+    gsize length = 0;
+
+    plugin->offline_queues = g_hash_table_new_full(g_str_hash, g_str_equal,
+        g_free, (GDestroyNotify)toxprpl_offline_queue_free);
+    plugin->offline_path = toxprpl_get_data_path(account, "queue");
+
+    if (g_file_get_contents(plugin->offline_path, &contents, &length, NULL))
+    {
+        const uint8_t *p = (const uint8_t *)contents;
+        const uint8_t *end = p + length;
+        while (end - p >= 1 + TOX_CLIENT_ID_SIZE + 4)
+        {
+            uint8_t type = p[0];
+            gchar *buddy_key = toxprpl_tox_bin_id_to_string((uint8_t *)p + 1);
+            p += 1 + TOX_CLIENT_ID_SIZE;
+
+            if (type == TOXPRPL_OFFLINE_RECORD_POP)
+            {
+                toxprpl_offline_pop(plugin, buddy_key,
+                                    (guint)toxprpl_get_le(p, 4));
+                p += 4;
+            }
+            else if (type == TOXPRPL_OFFLINE_RECORD_TRIM)
+            {
+                toxprpl_offline_trim(plugin, buddy_key,
+                                     (uint32_t)toxprpl_get_le(p, 4));
+                p += 4;
+            }
+            else if ((type == TOXPRPL_OFFLINE_RECORD_PUSH) && (end - p >= 13))
+            {
+                uint32_t len = (uint32_t)toxprpl_get_le(p + 9, 4);
+                if ((uint64_t)(end - p - 13) < len)
+                {
+                    g_free(buddy_key);
+                    break; // truncated by a crash while appending
+                }
+
+                GOfflineMessage *msg = toxprpl_pool_new0(
+                    &plugin->message_pool, GOfflineMessage);
+                msg->action = p[0] != 0;
+                msg->mtime = (time_t)toxprpl_get_le(p + 1, 8);
+                msg->length = len;
+                msg->message = g_strndup((const gchar *)p + 13, len);
+                toxprpl_offline_push(plugin, buddy_key, msg, FALSE);
+                p += 13 + len;
+            }
+            else
+            {
+                g_free(buddy_key);
+                break;
+            }
+            g_free(buddy_key);
+        }
+        g_free(contents);
+        purple_debug_info("toxprpl", "loaded %u queued messages from %s\n",
+                          plugin->offline_queued, plugin->offline_path);
+    }
+
+    // friends removed while the account was offline, or before the file
+    // caught up with the removal. compacting leaves them out of the file
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, plugin->offline_queues);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+    {
+        unsigned char *bin_key = toxprpl_hex_string_to_data(key);
+        int fnum = tox_get_friend_number(plugin->tox, bin_key);
+        g_free(bin_key);
+        if (fnum < 0)
+        {
+            toxprpl_offline_discard(plugin, key, FALSE);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+
+    toxprpl_offline_compact(plugin);
+}
+
+static void toxprpl_offline_close(toxprpl_plugin_data *plugin)
+{
+    if (plugin->offline_file != NULL)
+    {
+        fclose(plugin->offline_file);
+        plugin->offline_file = NULL;
+    }
+    if (plugin->offline_queues != NULL)
+    {
+        g_hash_table_destroy(plugin->offline_queues);
+        plugin->offline_queues = NULL;
+    }
+    g_free(plugin->offline_path);
+    plugin->offline_path = NULL;
+}
+
+// hands queued messages of online friends to the core, at most
+// TOXPRPL_OFFLINE_FLUSH_BURST per friend so that one backlog can not starve
+// the main loop; stops early for a friend once the core refuses a message
+static void toxprpl_offline_flush(toxprpl_plugin_data *plugin)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean again = FALSE;
+
+    plugin->offline_flush = FALSE;
+    if (plugin->offline_queued == 0)
+    {
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, plugin->offline_queues);
+    while (g_hash_table_iter_next(&iter, &key, &value))
+    {
+        GQueue *queue = value;
+        if (g_queue_is_empty(queue))
+        {
+            continue;
+        }
+
+        unsigned char *bin_key = toxprpl_hex_string_to_data(key);
+        int fnum = tox_get_friend_number(plugin->tox, bin_key);
+        g_free(bin_key);
+        if (fnum < 0)
+        {
+            // not a friend anymore, the messages would go to nobody or to
+            // whoever adds the key again
+            toxprpl_offline_discard(plugin, key, TRUE);
+            g_hash_table_iter_remove(&iter);
+            continue;
+        }
+        if (!toxprpl_friend_known(&plugin->friends, fnum) ||
+            !plugin->friends.connection[fnum])
+        {
+            continue;
+        }
+
+        guint sent = 0;
+        uint32_t trimmed = 0;
+        while ((sent < TOXPRPL_OFFLINE_FLUSH_BURST) &&
+               !g_queue_is_empty(queue))
+        {
+            GOfflineMessage *msg = g_queue_peek_head(queue);
+            uint32_t accepted = toxprpl_tox_send(plugin, fnum, msg->message,
+                                                 msg->length, msg->action);
+            if (accepted < msg->length)
+            {
+                // core send queue is full, keep what is left of a long
+                // message and retry on the next tick
+                trimmed = accepted;
+                break;
+            }
+            toxprpl_offline_message_free(plugin, g_queue_pop_head(queue));
+            sent++;
+        }
+
+        // the file has to follow, or the part that went out is sent again
+        // after a restart
+        if (sent > 0)
+        {
+            toxprpl_offline_write_record(plugin, plugin->offline_file,
+                TOXPRPL_OFFLINE_RECORD_POP, key, NULL, sent);
+            plugin->offline_queued -= sent;
+            purple_debug_info("toxprpl", "delivered %u queued messages to %s "
+                              "(%u pending)\n", sent, (const char *)key,
+                              g_queue_get_length(queue));
+        }
+        if (trimmed > 0)
+        {
+            toxprpl_offline_trim(plugin, key, trimmed);
+            toxprpl_offline_write_record(plugin, plugin->offline_file,
+                TOXPRPL_OFFLINE_RECORD_TRIM, key, NULL, trimmed);
+        }
+
+        if (!g_queue_is_empty(queue))
+        {
+            again = TRUE;
+        }
+    }
+
+    if (plugin->offline_queued == 0)
+    {
+        // everything went out, start over with an empty file
+        toxprpl_offline_compact(plugin);
+    }
+    plugin->offline_flush = again;
+}
+
+/* tox specific stuff */
+// friend request inbox
+static void toxprpl_friend_request_free(toxprpl_friend_request *request)
+{
+    g_free(request->buddy_key);
+    g_free(request->message);
+    g_free(request);
+}
+
+static void toxprpl_inbox_save(toxprpl_plugin_data *plugin)
+{
+    GHashTableIter iter;
+    gpointer value;
+    GError *error = NULL;
+
+    plugin->inbox_dirty = FALSE;
+    if (g_hash_table_size(plugin->inbox) == 0)
+    {
+        g_unlink(plugin->inbox_path);
+        return;
+    }
+
+    GKeyFile *keyfile = g_key_file_new();
+    g_hash_table_iter_init(&iter, plugin->inbox);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_friend_request *request = value;
+        g_key_file_set_string(keyfile, request->buddy_key, "message",
+                              request->message);
+        g_key_file_set_int64(keyfile, request->buddy_key, "received",
+                             (gint64)request->received);
+        g_key_file_set_integer(keyfile, request->buddy_key, "count",
+                               (gint)request->count);
+    }
+
+    gsize length;
+    gchar *data = g_key_file_to_data(keyfile, &length, NULL);
+    if (!g_file_set_contents(plugin->inbox_path, data, length, &error))
+    {
+        purple_debug_warning("toxprpl", "could not write %s: %s\n",
+                             plugin->inbox_path, error->message);
+        g_error_free(error);
+    }
+    g_free(data);
+    g_key_file_free(keyfile);
+}
+
+static void toxprpl_inbox_load(toxprpl_plugin_data *plugin,
+                               PurpleAccount *account)
+{
+    gsize i, n;
+
+    plugin->inbox = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+        (GDestroyNotify)toxprpl_friend_request_free);
+    plugin->inbox_path = toxprpl_get_data_path(account, "requests");
+
+    GKeyFile *keyfile = g_key_file_new();
+    if (!g_key_file_load_from_file(keyfile, plugin->inbox_path,
+                                   G_KEY_FILE_NONE, NULL))
+    {
+        g_key_file_free(keyfile);
+        return;
+    }
+
+    gchar **groups = g_key_file_get_groups(keyfile, &n);
+    for (i = 0; (i < n) && (i < TOXPRPL_INBOX_MAX_REQUESTS); i++)
+    {
+        if ((strlen(groups[i]) != TOX_CLIENT_ID_SIZE * 2) ||
+            (purple_find_buddy(account, groups[i]) != NULL))
+        {
+            continue;
+        }
+
+        toxprpl_friend_request *request = g_new0(toxprpl_friend_request, 1);
+        request->buddy_key = g_strdup(groups[i]);
+        request->message = g_key_file_get_string(keyfile, groups[i],
+                                                 "message", NULL);
+        if (request->message == NULL)
+        {
+            request->message = g_strdup("");
+        }
+        toxprpl_utf8_sanitize_string(request->message);
+        request->received = (time_t)g_key_file_get_int64(keyfile, groups[i],
+                                                          "received", NULL);
+        request->count = MAX(1, g_key_file_get_integer(keyfile, groups[i],
+                                                       "count", NULL));
+        g_hash_table_replace(plugin->inbox, request->buddy_key, request);
+    }
+    g_strfreev(groups);
+    g_key_file_free(keyfile);
+
+    plugin->inbox_unseen = g_hash_table_size(plugin->inbox) > 0;
+    purple_debug_info("toxprpl", "loaded %u pending friend requests\n",
+                      g_hash_table_size(plugin->inbox));
+}
+
+// returns TRUE if the request is new, repeated requests only update the
+// existing entry. new keys are subject to the size and rate limits
+static gboolean toxprpl_inbox_add(toxprpl_plugin_data *plugin,
+                                  const gchar *buddy_key,
+                                  const gchar *message)
+{
+    time_t now = time(NULL);
+    toxprpl_friend_request *request = g_hash_table_lookup(plugin->inbox,
+                                                          buddy_key);
+    if (request != NULL)
+    {
+        request->count++;
+        request->received = now;
+        g_free(request->message);
+        request->message = g_strdup(message ? message : "");
+        plugin->inbox_dirty = TRUE;
+        return FALSE;
+    }
+
+    if (now - plugin->inbox_window >= TOXPRPL_INBOX_RATE_WINDOW)
+    {
+        plugin->inbox_window = now;
+        plugin->inbox_window_count = 0;
+    }
+
+    if ((plugin->inbox_window_count >= TOXPRPL_INBOX_RATE_LIMIT) ||
+        (g_hash_table_size(plugin->inbox) >= TOXPRPL_INBOX_MAX_REQUESTS))
+    {
+        if (plugin->inbox_dropped++ == 0)
+        {
+            purple_debug_warning("toxprpl", "too many friend requests, "
+                                 "dropping new ones\n");
+        }
+        return FALSE;
+    }
+    plugin->inbox_window_count++;
+
+    request = g_new0(toxprpl_friend_request, 1);
+    request->buddy_key = g_strdup(buddy_key);
+    request->message = g_strdup(message ? message : "");
+    request->received = now;
+    request->count = 1;
+    g_hash_table_replace(plugin->inbox, request->buddy_key, request);
+    plugin->inbox_dirty = TRUE;
+    plugin->inbox_unseen = TRUE;
+    return TRUE;
+}
+
+static void toxprpl_inbox_remove(toxprpl_plugin_data *plugin,
+                                 const gchar *buddy_key)
+{
+    if (g_hash_table_remove(plugin->inbox, buddy_key))
+    {
+        plugin->inbox_dirty = TRUE;
+    }
+}
+
+static void toxprpl_inbox_close(toxprpl_plugin_data *plugin)
+{
+    if (plugin->inbox_timer != 0)
+    {
+        purple_timeout_remove(plugin->inbox_timer);
+        plugin->inbox_timer = 0;
+    }
+    if (plugin->inbox_dialog != NULL)
+    {
+        purple_request_close(PURPLE_REQUEST_FIELDS, plugin->inbox_dialog);
+        plugin->inbox_dialog = NULL;
+    }
+    if (plugin->inbox_dialog_keys != NULL)
+    {
+        g_ptr_array_free(plugin->inbox_dialog_keys, TRUE);
+        plugin->inbox_dialog_keys = NULL;
+    }
+    if (plugin->inbox != NULL)
+    {
+        if (plugin->inbox_dirty)
+        {
+            toxprpl_inbox_save(plugin);
+        }
+        g_hash_table_destroy(plugin->inbox);
+        plugin->inbox = NULL;
+    }
+    g_free(plugin->inbox_path);
+    plugin->inbox_path = NULL;
+}
+
+static void on_connectionstatus(Tox *tox, int fnum, uint8_t status,
+                                void *user_data)
+{
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    int tox_status = TOXPRPL_STATUS_OFFLINE;
+    if (status == 1)
+    {
+        tox_status = TOXPRPL_STATUS_ONLINE;
+    }
+
+    toxprpl_debug("Friend status change: %d\n", status);
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, fnum);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend #%d\n",
+                          fnum);
+        return;
+    }
+    PurpleAccount *account = purple_connection_get_account(gc);
+    purple_prpl_got_user_status(account, buddy_key,
+        toxprpl_statuses[tox_status].id, NULL);
+
+    plugin->friends.connection[fnum] = status == 1;
+    plugin->friends.last_seen[fnum] = time(NULL);
+    if (status == 0)
+    {
+        plugin->friends.typing[fnum] = 0;
+    }
+
+    if ((status == 1) &&
+        (toxprpl_offline_queue_depth(plugin, buddy_key) > 0))
+    {
+        // deliver queued messages from the messenger loop
+        plugin->offline_flush = TRUE;
+    }
+    else if (status == 0)
+    {
+        // receipts for messages sent so far will not arrive anymore
+        toxprpl_receipt_expire(gc, plugin, fnum);
+        toxprpl_typing_reset(plugin, fnum);
+    }
+}
+
+static void on_read_receipt(Tox *tox, int32_t friendnum, uint32_t receipt,
+                            void *user_data)
+{
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->receipts != NULL);
+
+    gint64 key = toxprpl_receipt_key(friendnum, receipt);
+    toxprpl_receipt *pending = g_hash_table_lookup(plugin->receipts, &key);
+    if (pending == NULL)
+    {
+        // also the ones that come after TOXPRPL_RECEIPT_TIMEOUT
+        purple_debug_info("toxprpl", "late or unexpected read receipt %u "
+                          "from friend %d\n", receipt, friendnum);
+        return;
+    }
+
+    guint64 latency = (guint64)(g_get_monotonic_time() - pending->sent);
+    toxprpl_histogram *h = g_hash_table_lookup(plugin->friend_latency,
+                                               GINT_TO_POINTER(friendnum));
+    if (h == NULL)
+    {
+        h = g_new0(toxprpl_histogram, 1);
+        g_hash_table_insert(plugin->friend_latency,
+                            GINT_TO_POINTER(friendnum), h);
+    }
+    toxprpl_histogram_record(h, latency);
+    toxprpl_metric_observe(plugin, TOXPRPL_HISTOGRAM_DELIVERY_LATENCY, latency);
+    toxprpl_trace(TOXPRPL_TRACE_RECEIPT, friendnum, (guint32)latency, 0);
+    g_hash_table_remove(plugin->receipts, &key);
+}
+
+static void on_request(struct Tox *tox, uint8_t* public_key, uint8_t* data,
+                       uint16_t length, void *user_data)
+{
+    toxprpl_debug("incoming friend request!\n");
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_arena_bin_id_to_string(&plugin->scratch,
+                                                      public_key);
+    gchar *request_msg = NULL;
+    if (length > 0)
+    {
+        request_msg = toxprpl_arena_strndup_utf8(&plugin->scratch, data,
+                                                 length);
+    }
+    toxprpl_debug("Buddy request from %s: %s\n",
+                  buddy_key, request_msg ? request_msg : "");
+
+    PurpleAccount *account = purple_connection_get_account(gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
+    if (buddy != NULL)
+    {
+        purple_debug_info("toxprpl", "Buddy %s already in buddy list!\n",
+                          buddy_key);
+        return;
+    }
+
+    // one dialog for all requests that come in within a short time
+    if (toxprpl_inbox_add(plugin, buddy_key, request_msg))
+    {
+        toxprpl_inbox_schedule_review(gc);
+    }
+}
+
+static void on_friend_action(Tox *tox, int friendnum, uint8_t* string,
+                             uint16_t length, void *user_data)
+{
+    toxprpl_debug("action received\n");
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, friendnum);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+    gchar *message = toxprpl_arena_alloc(&plugin->scratch, length + 5);
+    memcpy(message, "/me ", 4);
+    memcpy(message + 4, string, length);
+    message[toxprpl_utf8_sanitize(message + 4, length) + 4] = '\0';
+    toxprpl_metric_add(plugin, TOXPRPL_METRIC_MESSAGES_IN, 1);
+    toxprpl_metric_add(plugin, TOXPRPL_METRIC_BYTES_IN, length);
+
+    serv_got_im(gc, buddy_key, message, PURPLE_MESSAGE_RECV,
+                time(NULL));
+}
+
+static void on_incoming_message(Tox *tox, int friendnum, uint8_t* string,
+                                uint16_t length, void *user_data)
+{
+    toxprpl_debug("Message received!\n");
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, friendnum);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+    gchar *safemsg = toxprpl_arena_strndup_utf8(&plugin->scratch, string,
+                                                length);
+    toxprpl_metric_add(plugin, TOXPRPL_METRIC_MESSAGES_IN, 1);
+    toxprpl_metric_add(plugin, TOXPRPL_METRIC_BYTES_IN, length);
+    serv_got_im(gc, buddy_key, safemsg, PURPLE_MESSAGE_RECV,
+                time(NULL));
+}
+
+static void on_nick_change(Tox *tox, int friendnum, uint8_t* data,
+                           uint16_t length, void *user_data)
+{
+    toxprpl_debug("Nick change!\n");
+
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, friendnum);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+    PurpleBuddy *buddy = toxprpl_friend_buddy(plugin, friendnum);
+    if (buddy == NULL)
+    {
+        PurpleAccount *account = purple_connection_get_account(gc);
+        buddy = purple_find_buddy(account, buddy_key);
+    }
+    if (buddy == NULL)
+    {
+        purple_debug_info("toxprpl", "Ignoring nick change because buddy %s was not found\n", buddy_key);
+        return;
+    }
+
+    gchar *safedata = toxprpl_arena_strndup_utf8(&plugin->scratch, data,
+                                                 length);
+    purple_blist_alias_buddy(buddy, safedata);
+}
+
+static void on_status_change(struct Tox *tox, int32_t friendnum,
+                             uint8_t userstatus, void *user_data)
+{
+    toxprpl_debug("Status change: %d\n", userstatus);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, friendnum);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+    plugin->friends.user_status[friendnum] = userstatus;
+    int status_index = toxprpl_get_status_index(&plugin->friends, friendnum);
+    PurpleAccount *account = purple_connection_get_account(gc);
+    toxprpl_debug("Setting user status for user %s to %s\n",
+        buddy_key, toxprpl_statuses[status_index].id);
+    purple_prpl_got_user_status(account, buddy_key,
+        toxprpl_statuses[status_index].id, NULL);
+}
+
+static void on_status_message(Tox *tox, int32_t friendnum, uint8_t *data,
+                              uint16_t length, void *user_data)
+{
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, friendnum);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+    gchar *message = toxprpl_arena_strndup_utf8(&plugin->scratch, data,
+                                                length);
+    PurpleAccount *account = purple_connection_get_account(gc);
+    purple_prpl_got_user_status(account, buddy_key,
+        toxprpl_statuses[toxprpl_get_status_index(&plugin->friends,
+                                                  friendnum)].id,
+        "message", message, NULL);
+}
+
+//TODO create an inverted table to speed this up
+static PurpleXfer *toxprpl_find_xfer(PurpleConnection *gc, int friendnumber, uint8_t filenumber)
+{
+    PurpleAccount *account = purple_connection_get_account(gc);
+    toxprpl_return_val_if_fail(account != NULL, NULL);
+    GList *xfers = purple_xfers_get_all();
+    toxprpl_return_val_if_fail(xfers != NULL, NULL);
+
+    while (xfers != NULL && xfers->data != NULL)
+    {
+        PurpleXfer *xfer = xfers->data;
+        toxprpl_xfer_data *xfer_data = xfer->data;
+        if (xfer_data != NULL &&
+            xfer_data->friendnumber == friendnumber &&
+            xfer_data->filenumber == filenumber)
+        {
+            return xfer;
+        }
+        xfers = g_list_next(xfers);
+    }
+    return NULL;
+}
+
+static void on_file_control(Tox *tox, int friendnumber, uint8_t receive_send,
+                            uint8_t filenumber, uint8_t control_type,
+                            uint8_t *data, uint16_t length, void *userdata)
+{
+    toxprpl_debug("file control: %i (%s) %i\n", friendnumber,
+        receive_send == 0 ? "rx" : "tx", filenumber);
+    PurpleConnection *gc = userdata;
+    toxprpl_return_if_fail(gc != NULL);
+
+    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnumber, filenumber);
+    toxprpl_return_if_fail(xfer != NULL);
+
+    if (receive_send == 0) //receiving
+    {
+        switch (control_type)
+        {
+            case TOX_FILECONTROL_FINISHED:
+                purple_xfer_set_completed(xfer, TRUE);
+                purple_xfer_end(xfer);
+                break;
+            case TOX_FILECONTROL_KILL:
+                purple_xfer_cancel_remote(xfer);
+                break;
+        }
+    }
+    else //sending
+    {
+        switch (control_type)
+        {
+            case TOX_FILECONTROL_ACCEPT:
+                purple_xfer_start(xfer, -1, NULL, 0);
+                break;
+            case TOX_FILECONTROL_KILL:
+                purple_xfer_cancel_remote(xfer);
+                break;
+        }
+    }
+}
+
+static void on_file_send_request(Tox *tox, int friendnumber, uint8_t filenumber,
+                                 uint64_t filesize, uint8_t *filename,
+                                 uint16_t filename_length, void *userdata)
+{
+    toxprpl_debug("file_send_request: %i %i\n", friendnumber,
+        filenumber);
+    PurpleConnection *gc = userdata;
+
+    toxprpl_return_if_fail(gc != NULL);
+    toxprpl_return_if_fail(filename != NULL);
+    toxprpl_return_if_fail(tox != NULL);
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, friendnumber);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnumber);
+        return;
+    }
+
+    PurpleXfer *xfer = toxprpl_new_xfer_receive(gc, buddy_key, friendnumber,
+        filenumber, filesize, (const char*) filename);
+    if (xfer == NULL)
+    {
+        purple_debug_warning("toxprpl", "could not create xfer\n");
+        return;
+    }
+    toxprpl_return_if_fail(xfer != NULL);
+    purple_xfer_request(xfer);
+}
+
+static void on_file_data(Tox *tox, int friendnumber, uint8_t filenumber,
+                         uint8_t *data, uint16_t length, void *userdata)
+{
+    PurpleConnection *gc = userdata;
+
+    toxprpl_return_if_fail(gc != NULL);
+
+    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnumber, filenumber);
+    toxprpl_return_if_fail(xfer != NULL);
+    toxprpl_return_if_fail(xfer->dest_fp != NULL);
+
+    size_t written = fwrite(data, sizeof(uint8_t), length, xfer->dest_fp);
+    toxprpl_trace(TOXPRPL_TRACE_XFER_READ, friendnumber, filenumber,
+                  (guint32)written);
+    toxprpl_probe3(xfer__read, friendnumber, filenumber, written);
+    if (written != length)
+    {
+        purple_debug_warning("toxprpl", "could not write whole buffer\n");
+        purple_xfer_cancel_local(xfer);
+        return;
+    }
+
+    if (purple_xfer_get_size(xfer) > 0)
+    {
+        xfer->bytes_remaining -= written;
+        xfer->bytes_sent += written;
+        purple_xfer_update_progress(xfer);
+    }
+}
+
+static void on_typing_change(Tox *tox, int32_t friendnum, uint8_t is_typing,
+                            void *userdata)
+{
+    toxprpl_debug("Friend typing status change: %d\n", friendnum);
+    
+    PurpleConnection *gc = userdata;
+    toxprpl_return_if_fail(gc != NULL);
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, friendnum);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+    plugin->friends.typing[friendnum] = is_typing != 0;
+    PurpleBuddy *buddy = toxprpl_friend_buddy(plugin, friendnum);
+    if (buddy == NULL)
+    {
+        PurpleAccount *account = purple_connection_get_account(gc);
+        buddy = purple_find_buddy(account, buddy_key);
+    }
+    if (buddy == NULL)
+    {
+        purple_debug_info("toxprpl", "Ignoring typing change because buddy %s was not found\n", buddy_key);
+        return;
+    }
+
+    
+    if (is_typing)
+    {
+        serv_got_typing(gc, buddy->name, 5, PURPLE_TYPING);
+                                    /*   ^ timeout for typing status (0 = disabled) */
+    }
+    else
+    {
+        serv_got_typing_stopped(gc, buddy->name);
+    }
+}
+
+/* group chats */
+static void toxprpl_group_message_free(toxprpl_plugin_data *plugin,
+                                       toxprpl_group_message *msg)
+{
+    g_free(msg->who);
+    g_free(msg->text);
+    toxprpl_pool_free(&plugin->group_pool, msg);
+}
+
+static void toxprpl_group_free(toxprpl_plugin_data *plugin,
+                               toxprpl_group *group)
+{
+    toxprpl_group_message *msg;
+    while ((msg = g_queue_pop_head(group->messages)) != NULL)
+    {
+        toxprpl_group_message_free(plugin, msg);
+    }
+    g_queue_free(group->messages);
+    g_ptr_array_free(group->peers, TRUE);
+    g_ptr_array_free(group->left, TRUE);
+    g_hash_table_destroy(group->nicks);
+    g_hash_table_destroy(group->joined);
+    g_free(group->self);
+    g_free(group);
+}
+
+// a nick for name that is not taken in the room yet, it is registered in
+// group->nicks. names are not unique in tox, so a number is appended to
+// the ones that are taken already
+static gchar *toxprpl_group_nick(toxprpl_group *group, const uint8_t *name,
+                                 int length)
+{
+    gchar *base = g_strndup((const gchar *)name, MAX(length, 0));
+    base[toxprpl_utf8_sanitize(base, strlen(base))] = '\0';
+    if (*base == '\0')
+    {
+        g_free(base);
+        base = g_strdup(_("Tox User"));
+    }
+
+    gchar *nick = base;
+    while (g_hash_table_lookup(group->nicks, nick) != NULL)
+    {
+        if (nick != base)
+        {
+            g_free(nick);
+        }
+        nick = g_strdup_printf("%s (%u)", base, ++group->suffix);
+    }
+    if (nick != base)
+    {
+        g_free(base);
+    }
+    g_hash_table_insert(group->nicks, nick, nick);
+    return nick;
+}
+
+static gchar *toxprpl_group_peer_nick(toxprpl_plugin_data *plugin,
+                                      toxprpl_group *group, int peernumber)
+{
+    uint8_t name[TOX_MAX_NAME_LENGTH];
+    int length = tox_group_peername(plugin->tox, group->groupnumber,
+                                    peernumber, name);
+    return toxprpl_group_nick(group, name, length);
+}
+
+static void toxprpl_group_peer_add(toxprpl_plugin_data *plugin,
+                                   toxprpl_group *group)
+{
+    gchar *nick = toxprpl_group_peer_nick(plugin, group, group->peers->len);
+    g_ptr_array_add(group->peers, nick);
+    g_hash_table_insert(group->joined, nick, nick);
+}
+
+// like the core, moves the last peer into the slot that becomes free
+static void toxprpl_group_peer_remove(toxprpl_group *group, int peernumber)
+{
+    gchar *nick = g_ptr_array_index(group->peers, peernumber);
+    // the array would free the nick, which may still be needed for left
+    g_ptr_array_index(group->peers, peernumber) = NULL;
+    g_ptr_array_remove_index_fast(group->peers, peernumber);
+    g_hash_table_remove(group->nicks, nick);
+    if (g_hash_table_remove(group->joined, nick))
+    {
+        // never made it into the conversation
+        g_free(nick);
+    }
+    else
+    {
+        g_ptr_array_add(group->left, nick);
+    }
+}
+
+// rereads the whole peer list, only needed if we lost track of the core
+static void toxprpl_group_sync(toxprpl_plugin_data *plugin,
+                               toxprpl_group *group)
+{
+    while (group->peers->len > 0)
+    {
+        toxprpl_group_peer_remove(group, group->peers->len - 1);
+    }
+
+    int count = tox_group_number_peers(plugin->tox, group->groupnumber);
+    while ((int)group->peers->len < count)
+    {
+        toxprpl_group_peer_add(plugin, group);
+    }
+}
+
+// hands the collected leaves and joins to the conversation, one batch each
+static void toxprpl_group_flush_users(PurpleConnection *gc,
+                                      toxprpl_group *group,
+                                      gboolean new_arrivals)
+{
+    PurpleConversation *conv = purple_find_chat(gc, group->groupnumber);
+    PurpleConvChat *chat = conv != NULL ? PURPLE_CONV_CHAT(conv) : NULL;
+    GList *users = NULL;
+    guint i;
+
+    if (group->left->len > 0)
+    {
+        for (i = group->left->len; i > 0; i--)
+        {
+            users = g_list_prepend(users,
+                                   g_ptr_array_index(group->left, i - 1));
+        }
+        if (chat != NULL)
+        {
+            purple_conv_chat_remove_users(chat, users, NULL);
+        }
+        g_list_free(users);
+        g_ptr_array_set_size(group->left, 0);
+    }
+
+    if (g_hash_table_size(group->joined) > 0)
+    {
+        GList *flags = NULL;
+        GList *l;
+        users = g_hash_table_get_keys(group->joined);
+        for (l = users; l != NULL; l = l->next)
+        {
+            flags = g_list_prepend(flags,
+                                   GINT_TO_POINTER(PURPLE_CBFLAGS_NONE));
+        }
+        if (chat != NULL)
+        {
+            purple_conv_chat_add_users(chat, users, NULL, flags,
+                                       new_arrivals);
+        }
+        g_list_free(flags);
+        g_list_free(users);
+        g_hash_table_remove_all(group->joined);
+    }
+}
+
+static void toxprpl_group_peer_rename(PurpleConnection *gc,
+                                      toxprpl_plugin_data *plugin,
+                                      toxprpl_group *group, int peernumber)
+{
+    uint8_t name[TOX_MAX_NAME_LENGTH + 1];
+    int length = tox_group_peername(plugin->tox, group->groupnumber,
+                                    peernumber, name);
+    gchar *old = g_ptr_array_index(group->peers, peernumber);
+
+    // the core reports names again that did not change, keep the number a
+    // taken name got
+    name[CLAMP(length, 0, TOX_MAX_NAME_LENGTH)] = '\0';
+    const char *base = *name != '\0' ? (const char *)name : _("Tox User");
+    size_t base_length = strlen(base);
+    if ((strncmp(old, base, base_length) == 0) &&
+        ((old[base_length] == '\0') ||
+         g_str_has_prefix(old + base_length, " (")))
+    {
+        return;
+    }
+
+    g_hash_table_remove(group->nicks, old);
+    gchar *nick = toxprpl_group_nick(group, name, length);
+    g_ptr_array_index(group->peers, peernumber) = nick;
+    if (g_hash_table_remove(group->joined, old))
+    {
+        g_hash_table_insert(group->joined, nick, nick);
+    }
+    else
+    {
+        // a peer that left may still hold the new nick in the conversation
+        toxprpl_group_flush_users(gc, group, TRUE);
+        PurpleConversation *conv = purple_find_chat(gc, group->groupnumber);
+        if (conv != NULL)
+        {
+            purple_conv_chat_rename_user(PURPLE_CONV_CHAT(conv), old, nick);
+        }
+    }
+    g_free(old);
+}
+
+static toxprpl_group *toxprpl_group_open(PurpleConnection *gc,
+                                         toxprpl_plugin_data *plugin,
+                                         int groupnumber, const char *name)
+{
+    toxprpl_group *group = g_new0(toxprpl_group, 1);
+    group->groupnumber = groupnumber;
+    group->peers = g_ptr_array_new_with_free_func(g_free);
+    group->nicks = g_hash_table_new(g_str_hash, g_str_equal);
+    group->joined = g_hash_table_new(g_str_hash, g_str_equal);
+    group->left = g_ptr_array_new_with_free_func(g_free);
+    group->messages = g_queue_new();
+
+    uint8_t self[TOX_MAX_NAME_LENGTH];
+    uint16_t length = tox_get_self_name(plugin->tox, self);
+    group->self = toxprpl_group_nick(group, self, length);
+    g_hash_table_insert(plugin->groups, GINT_TO_POINTER(groupnumber), group);
+
+    PurpleConversation *conv = serv_got_joined_chat(gc, groupnumber, name);
+    if (conv != NULL)
+    {
+        PurpleConvChat *chat = PURPLE_CONV_CHAT(conv);
+        purple_conv_chat_set_nick(chat, group->self);
+        purple_conv_chat_add_user(chat, group->self, NULL,
+                                  PURPLE_CBFLAGS_NONE, FALSE);
+    }
+
+    // whoever is in the room already
+    toxprpl_group_sync(plugin, group);
+    toxprpl_group_flush_users(gc, group, FALSE);
+    return group;
+}
+
+// called from the messenger loop once the core is done with its callbacks
+static void toxprpl_group_flush(PurpleConnection *gc,
+                                toxprpl_plugin_data *plugin)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    plugin->group_flush = FALSE;
+    g_hash_table_iter_init(&iter, plugin->groups);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_group *group = value;
+        toxprpl_group_message *msg;
+        guint burst = 0;
+
+        toxprpl_group_flush_users(gc, group, TRUE);
+        // a flood in one room must not stall the others, the rest waits
+        // for the next tick
+        while ((burst < TOXPRPL_GROUP_FLUSH_BURST) &&
+               ((msg = g_queue_pop_head(group->messages)) != NULL))
+        {
+            PurpleMessageFlags flags = strcmp(msg->who, group->self) == 0 ?
+                PURPLE_MESSAGE_SEND : PURPLE_MESSAGE_RECV;
+            serv_got_chat_in(gc, group->groupnumber, msg->who, flags,
+                             msg->text, msg->mtime);
+            toxprpl_group_message_free(plugin, msg);
+            burst++;
+        }
+        if (!g_queue_is_empty(group->messages))
+        {
+            plugin->group_flush = TRUE;
+        }
+    }
+}
+
+static void on_group_invite(Tox *tox, int32_t friendnumber,
+                            uint8_t *group_public_key, void *user_data)
+{
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gchar *buddy_key = toxprpl_friend_buddy_key(plugin, friendnumber);
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnumber);
+        return;
+    }
+    PurpleBuddy *buddy = toxprpl_friend_buddy(plugin, friendnumber);
+
+    // purple owns the components from here on
+    GHashTable *components = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                   g_free, g_free);
+    g_hash_table_insert(components, g_strdup("friend"),
+                        g_strdup_printf("%d", friendnumber));
+    g_hash_table_insert(components, g_strdup("key"),
+                        toxprpl_tox_bin_id_to_string(group_public_key));
+    g_hash_table_insert(components, g_strdup("name"),
+        g_strdup_printf(_("Group chat of %s"), buddy != NULL ?
+                        purple_buddy_get_alias(buddy) : buddy_key));
+    serv_got_chat_invite(gc, g_hash_table_lookup(components, "name"),
+                         buddy_key, NULL, components);
+}
+
+static void on_group_received(Tox *tox, int groupnumber, int peernumber,
+                              uint8_t *data, uint16_t length,
+                              gboolean action, void *user_data)
+{
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    toxprpl_group *group = g_hash_table_lookup(plugin->groups,
+                                               GINT_TO_POINTER(groupnumber));
+    if (group == NULL)
+    {
+        purple_debug_info("toxprpl", "Message for unknown group %d\n",
+                          groupnumber);
+        return;
+    }
+
+    // the core hands our own messages back, they come from no peer
+    toxprpl_group_message *msg = toxprpl_pool_new0(&plugin->group_pool,
+                                                   toxprpl_group_message);
+    msg->who = g_strdup(((peernumber >= 0) &&
+                         ((guint)peernumber < group->peers->len)) ?
+                        g_ptr_array_index(group->peers, peernumber) :
+                        group->self);
+    size_t prefix = action ? 4 : 0;
+    msg->text = g_malloc(length + prefix + 1);
+    memcpy(msg->text, "/me ", prefix);
+    memcpy(msg->text + prefix, data, length);
+    msg->text[toxprpl_utf8_sanitize(msg->text + prefix, length) + prefix] =
+        '\0';
+    msg->mtime = time(NULL);
+    g_queue_push_tail(group->messages, msg);
+    plugin->group_flush = TRUE;
+
+    toxprpl_metric_add(plugin, TOXPRPL_METRIC_MESSAGES_IN, 1);
+    toxprpl_metric_add(plugin, TOXPRPL_METRIC_BYTES_IN, length);
+}
+
+static void on_group_namelist_change(Tox *tox, int groupnumber,
+                                     int peernumber, uint8_t change,
+                                     void *user_data)
+{
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    toxprpl_group *group = g_hash_table_lookup(plugin->groups,
+                                               GINT_TO_POINTER(groupnumber));
+    if (group == NULL)
+    {
+        return;
+    }
 
-    uint8_t client_id[TOX_CLIENT_ID_SIZE];
-    if (tox_get_client_id(tox, friendnum, client_id) < 0)
+    gboolean known = (peernumber >= 0) &&
+                     ((guint)peernumber < group->peers->len);
+    switch (change)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
+        case TOX_CHAT_CHANGE_PEER_ADD:
+            known = peernumber == (int)group->peers->len;
+            if (known)
+            {
+                toxprpl_group_peer_add(plugin, group);
+            }
+            break;
+        case TOX_CHAT_CHANGE_PEER_DEL:
+            if (known)
+            {
+                toxprpl_group_peer_remove(group, peernumber);
+            }
+            break;
+        case TOX_CHAT_CHANGE_PEER_NAME:
+            if (known)
+            {
+                toxprpl_group_peer_rename(gc, plugin, group, peernumber);
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (!known)
+    {
+        purple_debug_warning("toxprpl", "peer list of group %d out of sync "
+                             "(change %d for peer %d), reloading\n",
+                             groupnumber, change, peernumber);
+        toxprpl_group_sync(plugin, group);
+    }
+    plugin->group_flush = TRUE;
+}
+
+/* callback capture */
+/*
+ * opt-in recording of every callback the core delivers, in a compact binary
+ * format that bench/replay feeds back into the plugin without a network.
+ * after TOXPRPL_CAPTURE_MAGIC each callback is one record of
+ *
+ *   event (1 byte), microseconds since the previous record, friend number
+ *   plus one, arg, arg2 and payload length as LEB128 varints, payload
+ *
+ * see toxprpl_capture_event for the meaning of arg, arg2 and the payload.
+ * file data is recorded without its contents, the plugin does not look at
+ * it and it would make the capture as large as the transfers. recording
+ * stops once the file reaches TOXPRPL_CAPTURE_MAX_SIZE
+ */
+#define TOXPRPL_CAPTURE_MAGIC       "TOXPCAP1"
+#define TOXPRPL_CAPTURE_MAX_SIZE    (256 * 1024 * 1024)
+
+// the numbers are part of the file format, new events go at the end
+typedef enum
+{
+    TOXPRPL_CAPTURE_REQUEST = 1,            // payload: client id, message
+    TOXPRPL_CAPTURE_MESSAGE = 2,            // payload: message
+    TOXPRPL_CAPTURE_ACTION = 3,             // payload: action
+    TOXPRPL_CAPTURE_NAME = 4,               // payload: name
+    TOXPRPL_CAPTURE_STATUS_MESSAGE = 5,     // payload: status message
+    TOXPRPL_CAPTURE_USER_STATUS = 6,        // arg: user status
+    TOXPRPL_CAPTURE_CONNECTION = 7,         // arg: connection status
+    TOXPRPL_CAPTURE_RECEIPT = 8,            // arg: receipt
+    TOXPRPL_CAPTURE_TYPING = 9,             // arg: is typing
+    // arg: file number, arg2: file size, payload: file name
+    TOXPRPL_CAPTURE_FILE_SEND_REQUEST = 10,
+    // arg: file number, arg2: control | receive_send << 8, payload: data
+    TOXPRPL_CAPTURE_FILE_CONTROL = 11,
+    // arg: file number, arg2: chunk length
+    TOXPRPL_CAPTURE_FILE_DATA = 12,
+    // client id: group key
+    TOXPRPL_CAPTURE_GROUP_INVITE = 13,
+    // the friend number of the group events is the group number
+    // arg: peer number, payload: message
+    TOXPRPL_CAPTURE_GROUP_MESSAGE = 14,
+    // arg: peer number, payload: action
+    TOXPRPL_CAPTURE_GROUP_ACTION = 15,
+    // arg: peer number, arg2: change, payload: name of the peer
+    TOXPRPL_CAPTURE_GROUP_NAMELIST = 16
+} toxprpl_capture_event;
+
+static void toxprpl_capture_start(toxprpl_plugin_data *plugin,
+                                  PurpleAccount *account)
+{
+    plugin->capture_path = toxprpl_get_data_path(account, "capture");
+    plugin->capture = g_fopen(plugin->capture_path, "wb");
+    if (plugin->capture == NULL)
+    {
+        purple_debug_warning("toxprpl", "could not write %s: %s\n",
+                             plugin->capture_path, strerror(errno));
+        g_free(plugin->capture_path);
+        plugin->capture_path = NULL;
         return;
     }
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
-    PurpleAccount *account = purple_connection_get_account(gc);
-    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
-    if (buddy == NULL)
+    setvbuf(plugin->capture, NULL, _IOFBF, 64 * 1024);
+    fputs(TOXPRPL_CAPTURE_MAGIC, plugin->capture);
+    plugin->capture_size = strlen(TOXPRPL_CAPTURE_MAGIC);
+    plugin->capture_last = g_get_monotonic_time();
+    purple_debug_info("toxprpl", "capturing callbacks to %s\n",
+                      plugin->capture_path);
+}
+
+static void toxprpl_capture_stop(toxprpl_plugin_data *plugin)
+{
+    if (plugin->capture != NULL)
+    {
+        fclose(plugin->capture);
+        plugin->capture = NULL;
+        purple_debug_info("toxprpl", "captured %" G_GSIZE_FORMAT " bytes "
+                          "to %s\n", plugin->capture_size,
+                          plugin->capture_path);
+    }
+    g_free(plugin->capture_path);
+    plugin->capture_path = NULL;
+}
+
+static guint8 *toxprpl_capture_varint(guint8 *p, guint64 value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (guint8)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (guint8)value;
+    return p;
+}
+
+// public_key is only given for friend requests, it precedes the payload
+static void toxprpl_capture(PurpleConnection *gc, toxprpl_capture_event event,
+                            int friendnumber, guint32 arg, guint64 arg2,
+                            const uint8_t *public_key, const uint8_t *data,
+                            uint16_t length)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if ((plugin == NULL) || (plugin->capture == NULL))
     {
-        purple_debug_info("toxprpl", "Ignoring nick change because buddy %s was not found\n", buddy_key);
-        g_free(buddy_key);
         return;
     }
 
-    g_free(buddy_key);
-    gchar *safedata = g_strndup((const char *)data, length);
-    purple_blist_alias_buddy(buddy, safedata);
-    g_free(safedata);
+    guint8 header[1 + 5 * 10];
+    guint8 *p = header;
+    gint64 now = g_get_monotonic_time();
+    size_t key_length = public_key != NULL ? TOX_CLIENT_ID_SIZE : 0;
+
+    *p++ = (guint8)event;
+    p = toxprpl_capture_varint(p, (guint64)(now - plugin->capture_last));
+    p = toxprpl_capture_varint(p, (guint64)(friendnumber + 1));
+    p = toxprpl_capture_varint(p, arg);
+    p = toxprpl_capture_varint(p, arg2);
+    p = toxprpl_capture_varint(p, key_length + length);
+    plugin->capture_last = now;
+
+    fwrite(header, 1, p - header, plugin->capture);
+    if (key_length > 0)
+    {
+        fwrite(public_key, 1, key_length, plugin->capture);
+    }
+    if (length > 0)
+    {
+        fwrite(data, 1, length, plugin->capture);
+    }
+    plugin->capture_size += (p - header) + key_length + length;
+
+    if (ferror(plugin->capture))
+    {
+        purple_debug_warning("toxprpl", "could not write %s, capture "
+                             "stopped\n", plugin->capture_path);
+        toxprpl_capture_stop(plugin);
+    }
+    else if (plugin->capture_size > TOXPRPL_CAPTURE_MAX_SIZE)
+    {
+        purple_debug_warning("toxprpl", "%s is full, capture stopped\n",
+                             plugin->capture_path);
+        toxprpl_capture_stop(plugin);
+    }
 }
 
-static void on_status_change(struct Tox *tox, int32_t friendnum,
-                             uint8_t userstatus, void *user_data)
+/*
+ * the callbacks registered with the core: each one counts, traces and
+ * captures the event and measures how long the handler took
+ */
+static void toxprpl_cb_incoming_message(Tox *tox, int friendnum,
+                                        uint8_t *string, uint16_t length,
+                                        void *user_data)
 {
-    purple_debug_info("toxprpl", "Status change: %d\n", userstatus);
-    uint8_t client_id[TOX_CLIENT_ID_SIZE];
-    if (tox_get_client_id(tox, friendnum, client_id) < 0)
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_FRIEND_MESSAGE, friendnum, length);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_MESSAGE, friendnum, 0, 0, NULL,
+                    string, length);
+    on_incoming_message(tox, friendnum, string, length, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_FRIEND_MESSAGE, start,
+                         friendnum);
+}
+
+static void toxprpl_cb_nick_change(Tox *tox, int friendnum, uint8_t *data,
+                                   uint16_t length, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_NAME_CHANGE, friendnum, length);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_NAME, friendnum, 0, 0, NULL,
+                    data, length);
+    on_nick_change(tox, friendnum, data, length, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_NAME_CHANGE, start,
+                         friendnum);
+}
+
+static void toxprpl_cb_status_change(Tox *tox, int32_t friendnum,
+                                     uint8_t userstatus, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_USER_STATUS, friendnum, userstatus);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_USER_STATUS, friendnum,
+                    userstatus, 0, NULL, NULL, 0);
+    on_status_change(tox, friendnum, userstatus, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_USER_STATUS, start,
+                         friendnum);
+}
+
+static void toxprpl_cb_status_message(Tox *tox, int32_t friendnum,
+                                      uint8_t *data, uint16_t length,
+                                      void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_STATUS_MESSAGE, friendnum, length);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_STATUS_MESSAGE, friendnum, 0,
+                    0, NULL, data, length);
+    on_status_message(tox, friendnum, data, length, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_STATUS_MESSAGE, start,
+                         friendnum);
+}
+
+static void toxprpl_cb_request(Tox *tox, uint8_t *public_key, uint8_t *data,
+                               uint16_t length, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_FRIEND_REQUEST, -1, length);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_REQUEST, -1, 0, 0, public_key,
+                    data, length);
+    on_request(tox, public_key, data, length, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_FRIEND_REQUEST, start,
+                         -1);
+}
+
+static void toxprpl_cb_connectionstatus(Tox *tox, int fnum, uint8_t status,
+                                        void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_CONNECTION_STATUS, fnum, status);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_CONNECTION, fnum, status, 0,
+                    NULL, NULL, 0);
+    on_connectionstatus(tox, fnum, status, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_CONNECTION_STATUS,
+                         start, fnum);
+}
+
+static void toxprpl_cb_friend_action(Tox *tox, int friendnum, uint8_t *string,
+                                     uint16_t length, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_FRIEND_ACTION, friendnum, length);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_ACTION, friendnum, 0, 0, NULL,
+                    string, length);
+    on_friend_action(tox, friendnum, string, length, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_FRIEND_ACTION, start,
+                         friendnum);
+}
+
+static void toxprpl_cb_read_receipt(Tox *tox, int32_t friendnum,
+                                    uint32_t receipt, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_READ_RECEIPT, friendnum, receipt);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_RECEIPT, friendnum, receipt, 0,
+                    NULL, NULL, 0);
+    on_read_receipt(tox, friendnum, receipt, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_READ_RECEIPT, start,
+                         friendnum);
+}
+
+static void toxprpl_cb_file_send_request(Tox *tox, int friendnumber,
+                                         uint8_t filenumber, uint64_t filesize,
+                                         uint8_t *filename,
+                                         uint16_t filename_length,
+                                         void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_FILE_SEND_REQUEST, friendnumber, filenumber);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_FILE_SEND_REQUEST,
+                    friendnumber, filenumber, filesize, NULL, filename,
+                    filename_length);
+    on_file_send_request(tox, friendnumber, filenumber, filesize, filename,
+                         filename_length, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_FILE_SEND_REQUEST,
+                         start, friendnumber);
+}
+
+static void toxprpl_cb_file_control(Tox *tox, int friendnumber,
+                                    uint8_t receive_send, uint8_t filenumber,
+                                    uint8_t control_type, uint8_t *data,
+                                    uint16_t length, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_FILE_CONTROL, friendnumber, control_type);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_FILE_CONTROL, friendnumber,
+                    filenumber, control_type | (receive_send << 8), NULL,
+                    data, length);
+    on_file_control(tox, friendnumber, receive_send, filenumber, control_type,
+                    data, length, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_FILE_CONTROL, start,
+                         friendnumber);
+}
+
+static void toxprpl_cb_file_data(Tox *tox, int friendnumber,
+                                 uint8_t filenumber, uint8_t *data,
+                                 uint16_t length, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_FILE_DATA, friendnumber, length);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_FILE_DATA, friendnumber,
+                    filenumber, length, NULL, NULL, 0);
+    on_file_data(tox, friendnumber, filenumber, data, length, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_FILE_DATA, start,
+                         friendnumber);
+}
+
+static void toxprpl_cb_typing_change(Tox *tox, int32_t friendnum,
+                                     uint8_t is_typing, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_TYPING_CHANGE, friendnum, is_typing);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_TYPING, friendnum, is_typing,
+                    0, NULL, NULL, 0);
+    on_typing_change(tox, friendnum, is_typing, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_TYPING_CHANGE, start,
+                         friendnum);
+}
+
+static void toxprpl_cb_group_invite(Tox *tox, int32_t friendnumber,
+                                    uint8_t *group_public_key,
+                                    void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_GROUP_INVITE, friendnumber, 0);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_GROUP_INVITE, friendnumber, 0,
+                    0, group_public_key, NULL, 0);
+    on_group_invite(tox, friendnumber, group_public_key, user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_GROUP_INVITE, start,
+                         friendnumber);
+}
+
+static void toxprpl_cb_group_message(Tox *tox, int groupnumber,
+                                     int peernumber, uint8_t *message,
+                                     uint16_t length, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_GROUP_MESSAGE, groupnumber, length);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_GROUP_MESSAGE, groupnumber,
+                    peernumber, 0, NULL, message, length);
+    on_group_received(tox, groupnumber, peernumber, message, length, FALSE,
+                      user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_GROUP_MESSAGE, start,
+                         groupnumber);
+}
+
+static void toxprpl_cb_group_action(Tox *tox, int groupnumber,
+                                    int peernumber, uint8_t *action,
+                                    uint16_t length, void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_GROUP_ACTION, groupnumber, length);
+    toxprpl_capture(user_data, TOXPRPL_CAPTURE_GROUP_ACTION, groupnumber,
+                    peernumber, 0, NULL, action, length);
+    on_group_received(tox, groupnumber, peernumber, action, length, TRUE,
+                      user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_GROUP_ACTION, start,
+                         groupnumber);
+}
+
+static void toxprpl_cb_group_namelist_change(Tox *tox, int groupnumber,
+                                             int peernumber, uint8_t change,
+                                             void *user_data)
+{
+    gint64 start = toxprpl_callback_begin(user_data,
+        TOXPRPL_METRIC_CB_GROUP_NAMELIST, groupnumber, change);
+    toxprpl_plugin_data *plugin =
+        purple_connection_get_protocol_data(user_data);
+    if ((plugin != NULL) && (plugin->capture != NULL))
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
+        // the name is not part of the callback, a replay needs it anyway
+        uint8_t name[TOX_MAX_NAME_LENGTH];
+        int length = change == TOX_CHAT_CHANGE_PEER_DEL ? 0 :
+            tox_group_peername(tox, groupnumber, peernumber, name);
+        toxprpl_capture(user_data, TOXPRPL_CAPTURE_GROUP_NAMELIST,
+                        groupnumber, peernumber, change, NULL, name,
+                        (uint16_t)MAX(length, 0));
+    }
+    on_group_namelist_change(tox, groupnumber, peernumber, change,
+                             user_data);
+    toxprpl_callback_end(user_data, TOXPRPL_METRIC_CB_GROUP_NAMELIST, start,
+                         groupnumber);
+}
+
+/* bootstrap registry */
+/*
+ * bootstrap nodes known to the process, shared by all accounts. configured
+ * servers are resolved once, accounts that reached the DHT add their own
+ * endpoint and every login bootstraps from the best few nodes besides its
+ * configured server. only the first account has to find its way into the
+ * DHT from scratch, the others start next to it
+ */
+#define TOXPRPL_BOOTSTRAP_MAX_NODES 32
+#define TOXPRPL_BOOTSTRAP_SEEDS     4
+#define TOXPRPL_MAX_FD              4096
+
+// where the core binds its UDP socket, not in the public header
+#ifndef TOX_PORTRANGE_FROM
+    #define TOX_PORTRANGE_FROM      33445
+    #define TOX_PORTRANGE_TO        33545
+#endif
+
+typedef struct
+{
+    guint id;
+    gchar *host;                 // as configured, NULL for our own accounts
+    gchar *address;              // numeric, no lookups after the first
+    int family;                  // of address
+    uint16_t port;
+    uint8_t key[TOX_CLIENT_ID_SIZE];
+    gconstpointer owner;         // account of this process behind the node
+    guint attempts;
+    guint successes;             // tried by a login that reached the DHT
+    gint64 last_success;
+} toxprpl_bootstrap_node;
+
+static GList *toxprpl_bootstrap_nodes;
+static guint toxprpl_bootstrap_next_id;
+
+static void toxprpl_bootstrap_node_free(toxprpl_bootstrap_node *node)
+{
+    g_free(node->host);
+    g_free(node->address);
+    g_free(node);
+}
+
+// nodes of running accounts first, then by how often they worked
+static gint toxprpl_bootstrap_node_compare(gconstpointer a, gconstpointer b)
+{
+    const toxprpl_bootstrap_node *na = a;
+    const toxprpl_bootstrap_node *nb = b;
+    if ((na->owner == NULL) != (nb->owner == NULL))
+    {
+        return na->owner != NULL ? -1 : 1;
+    }
+    if (na->successes != nb->successes)
+    {
+        return na->successes > nb->successes ? -1 : 1;
+    }
+    if (na->last_success != nb->last_success)
+    {
+        return na->last_success > nb->last_success ? -1 : 1;
+    }
+    return 0;
+}
+
+static toxprpl_bootstrap_node *toxprpl_bootstrap_add(const char *host,
+                                                     gchar *address,
+                                                     int family,
+                                                     uint16_t port,
+                                                     const uint8_t *key,
+                                                     gconstpointer owner);
+
+// adds a node for the first address of each family the host resolves to
+static void toxprpl_bootstrap_resolve(const char *host, uint16_t port,
+                                      const uint8_t *key)
+{
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    struct addrinfo *ai;
+    char address[NI_MAXHOST];
+    gboolean have_ipv4 = FALSE;
+    gboolean have_ipv6 = FALSE;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if ((getaddrinfo(host, NULL, &hints, &result) != 0) || (result == NULL))
+    {
+        purple_debug_info("toxprpl", "could not resolve %s\n", host);
         return;
     }
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
+    for (ai = result; ai != NULL; ai = ai->ai_next)
+    {
+        gboolean *have = ai->ai_family == AF_INET6 ? &have_ipv6 :
+                         ai->ai_family == AF_INET ? &have_ipv4 : NULL;
+        if ((have == NULL) || *have ||
+            (getnameinfo(ai->ai_addr, ai->ai_addrlen, address,
+                         sizeof(address), NULL, 0, NI_NUMERICHOST) != 0))
+        {
+            continue;
+        }
+        *have = TRUE;
+        toxprpl_bootstrap_add(host, g_strdup(address), ai->ai_family, port,
+                              key, NULL);
+    }
+    freeaddrinfo(result);
+}
 
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-    PurpleAccount *account = purple_connection_get_account(gc);
-    purple_debug_info("toxprpl", "Setting user status for user %s to %s\n",
-        buddy_key, toxprpl_statuses[
-            toxprpl_get_status_index(tox, friendnum, userstatus)].id);
-    purple_prpl_got_user_status(account, buddy_key,
-        toxprpl_statuses[
-            toxprpl_get_status_index(tox, friendnum, userstatus)].id,
-        NULL);
-    g_free(buddy_key);
+static toxprpl_bootstrap_node *toxprpl_bootstrap_find(const char *address,
+                                                      uint16_t port,
+                                                      const uint8_t *key)
+{
+    GList *l;
+    for (l = toxprpl_bootstrap_nodes; l != NULL; l = l->next)
+    {
+        toxprpl_bootstrap_node *node = l->data;
+        if ((node->port == port) && (strcmp(node->address, address) == 0) &&
+            (memcmp(node->key, key, TOX_CLIENT_ID_SIZE) == 0))
+        {
+            return node;
+        }
+    }
+    return NULL;
 }
 
-//TODO create an inverted table to speed this up
-static PurpleXfer *toxprpl_find_xfer(PurpleConnection *gc, int friendnumber, uint8_t filenumber)
+// the registry takes address
+static toxprpl_bootstrap_node *toxprpl_bootstrap_add(const char *host,
+                                                     gchar *address,
+                                                     int family,
+                                                     uint16_t port,
+                                                     const uint8_t *key,
+                                                     gconstpointer owner)
 {
-    PurpleAccount *account = purple_connection_get_account(gc);
-    toxprpl_return_val_if_fail(account != NULL, NULL);
-    GList *xfers = purple_xfers_get_all();
-    toxprpl_return_val_if_fail(xfers != NULL, NULL);
+    if (g_list_length(toxprpl_bootstrap_nodes) >= TOXPRPL_BOOTSTRAP_MAX_NODES)
+    {
+        // make room by dropping the least useful node nobody runs
+        toxprpl_bootstrap_nodes = g_list_sort(toxprpl_bootstrap_nodes,
+            toxprpl_bootstrap_node_compare);
+        GList *last = g_list_last(toxprpl_bootstrap_nodes);
+        toxprpl_bootstrap_node *worst = last->data;
+        if (worst->owner == NULL)
+        {
+            toxprpl_bootstrap_nodes = g_list_delete_link(
+                toxprpl_bootstrap_nodes, last);
+            toxprpl_bootstrap_node_free(worst);
+        }
+    }
 
-    while (xfers != NULL && xfers->data != NULL)
+    toxprpl_bootstrap_node *node = g_new0(toxprpl_bootstrap_node, 1);
+    node->id = ++toxprpl_bootstrap_next_id;
+    node->host = g_strdup(host);
+    node->address = address;
+    node->family = family;
+    node->port = port;
+    memcpy(node->key, key, TOX_CLIENT_ID_SIZE);
+    node->owner = owner;
+    toxprpl_bootstrap_nodes = g_list_append(toxprpl_bootstrap_nodes, node);
+    return node;
+}
+
+static gboolean toxprpl_bootstrap_try(Tox *tox, uint8_t ipv6,
+                                      toxprpl_bootstrap_node *node,
+                                      GArray *tried)
+{
+    purple_debug_info("toxprpl", "bootstrapping from %s:%u\n",
+                      node->address, node->port);
+    node->attempts++;
+    g_array_append_val(tried, node->id);
+    return tox_bootstrap_from_address(tox, node->address, ipv6,
+                                      htons(node->port), node->key) != 0;
+}
+
+static gboolean toxprpl_bootstrap_is_configured(
+    const toxprpl_bootstrap_node *node, const char *host, uint16_t port,
+    const uint8_t *key)
+{
+    return (node->host != NULL) && (strcmp(node->host, host) == 0) &&
+           (node->port == port) &&
+           (memcmp(node->key, key, TOX_CLIENT_ID_SIZE) == 0);
+}
+
+/*
+ * bootstraps from the configured server and the best nodes of the registry.
+ * IPv6 nodes are only used by dual stack cores, which try them first. the
+ * ids of all nodes tried are added to tried, returns FALSE if the core took
+ * none of them
+ */
+static gboolean toxprpl_bootstrap(Tox *tox, uint8_t ipv6, const char *host,
+                                  uint16_t port, const char *key,
+                                  GArray *tried)
+{
+    unsigned char *bin_key = toxprpl_hex_string_to_data(key);
+    gboolean resolved = FALSE;
+    gboolean ok = FALSE;
+    GList *l;
+
+    for (l = toxprpl_bootstrap_nodes; l != NULL; l = l->next)
     {
-        PurpleXfer *xfer = xfers->data;
-        toxprpl_xfer_data *xfer_data = xfer->data;
-        if (xfer_data != NULL &&
-            xfer_data->friendnumber == friendnumber &&
-            xfer_data->filenumber == filenumber)
+        resolved |= toxprpl_bootstrap_is_configured(l->data, host, port,
+                                                    bin_key);
+    }
+    if (!resolved)
+    {
+        toxprpl_bootstrap_resolve(host, port, bin_key);
+    }
+
+    int pass;
+    for (pass = ipv6 ? 0 : 1; pass < 2; pass++)
+    {
+        int family = pass == 0 ? AF_INET6 : AF_INET;
+        for (l = toxprpl_bootstrap_nodes; l != NULL; l = l->next)
         {
-            return xfer;
+            toxprpl_bootstrap_node *node = l->data;
+            if ((node->family == family) &&
+                toxprpl_bootstrap_is_configured(node, host, port, bin_key))
+            {
+                ok |= toxprpl_bootstrap_try(tox, ipv6, node, tried);
+            }
+        }
+    }
+
+    guint seeds = 0;
+    toxprpl_bootstrap_nodes = g_list_sort(toxprpl_bootstrap_nodes,
+                                          toxprpl_bootstrap_node_compare);
+    for (l = toxprpl_bootstrap_nodes;
+         (l != NULL) && (seeds < TOXPRPL_BOOTSTRAP_SEEDS); l = l->next)
+    {
+        toxprpl_bootstrap_node *node = l->data;
+        if (!toxprpl_bootstrap_is_configured(node, host, port, bin_key) &&
+            ((node->owner != NULL) || (node->successes > 0)) &&
+            (ipv6 || (node->family == AF_INET)))
+        {
+            ok |= toxprpl_bootstrap_try(tox, ipv6, node, tried);
+            seeds++;
+        }
+    }
+    g_free(bin_key);
+    return ok;
+}
+
+// counts the nodes tried per address family
+static void toxprpl_bootstrap_count(toxprpl_plugin_data *plugin)
+{
+    GList *l;
+    guint i;
+
+    for (l = toxprpl_bootstrap_nodes; l != NULL; l = l->next)
+    {
+        toxprpl_bootstrap_node *node = l->data;
+        for (i = 0; i < plugin->bootstrap_tried->len; i++)
+        {
+            if (g_array_index(plugin->bootstrap_tried, guint, i) == node->id)
+            {
+                toxprpl_metric_add(plugin, node->family == AF_INET6 ?
+                    TOXPRPL_METRIC_BOOTSTRAP_IPV6 :
+                    TOXPRPL_METRIC_BOOTSTRAP_IPV4, 1);
+            }
+        }
+    }
+}
+
+// credits the nodes the account tried and offers the account as a node
+static void toxprpl_bootstrap_connected(toxprpl_plugin_data *plugin)
+{
+    gint64 now = g_get_monotonic_time();
+    GList *l;
+    guint i;
+
+    for (l = toxprpl_bootstrap_nodes; l != NULL; l = l->next)
+    {
+        toxprpl_bootstrap_node *node = l->data;
+        for (i = 0; i < plugin->bootstrap_tried->len; i++)
+        {
+            if (g_array_index(plugin->bootstrap_tried, guint, i) == node->id)
+            {
+                node->successes++;
+                node->last_success = now;
+                break;
+            }
+        }
+    }
+    g_array_set_size(plugin->bootstrap_tried, 0);
+
+    if (plugin->dht_port == 0)
+    {
+        return;
+    }
+    // the first bytes of our address are the key the DHT knows us by
+    uint8_t address[TOX_FRIEND_ADDRESS_SIZE];
+    tox_get_address(plugin->tox, address);
+    if (toxprpl_bootstrap_find("127.0.0.1", plugin->dht_port, address) == NULL)
+    {
+        // a dual stack socket takes IPv4 as well
+        toxprpl_bootstrap_add(NULL, g_strdup("127.0.0.1"), AF_INET,
+                              plugin->dht_port, address, plugin);
+    }
+}
+
+static void toxprpl_bootstrap_forget(gconstpointer owner)
+{
+    GList *l = toxprpl_bootstrap_nodes;
+    while (l != NULL)
+    {
+        GList *next = l->next;
+        toxprpl_bootstrap_node *node = l->data;
+        if (node->owner == owner)
+        {
+            toxprpl_bootstrap_nodes = g_list_delete_link(
+                toxprpl_bootstrap_nodes, l);
+            toxprpl_bootstrap_node_free(node);
+        }
+        l = next;
+    }
+}
+
+/*
+ * the core binds the first free port of TOX_PORTRANGE_FROM..TO and does not
+ * tell which one. a socket only counts as the one of the core if it is new
+ * after tox_new(), bound in that range and of the family the core was asked
+ * for, otherwise the socket stays unknown and is left alone
+ */
+static uint16_t toxprpl_udp_port(int fd, int *family)
+{
+#ifdef __WIN32__
+    return 0;
+#else
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    int type;
+    socklen_t type_length = sizeof(type);
+
+    if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_length) != 0) ||
+        (type != SOCK_DGRAM) ||
+        (getsockname(fd, (struct sockaddr *)&addr, &length) != 0))
+    {
+        return 0;
+    }
+    if (family != NULL)
+    {
+        *family = addr.ss_family;
+    }
+    if (addr.ss_family == AF_INET)
+    {
+        return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    }
+    if (addr.ss_family == AF_INET6)
+    {
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    }
+    return 0;
+#endif
+}
+
+// UDP sockets of the process as fd -> port
+static GHashTable *toxprpl_udp_sockets(void)
+{
+    GHashTable *sockets = g_hash_table_new(g_direct_hash, g_direct_equal);
+    int fd;
+    for (fd = 0; fd < TOXPRPL_MAX_FD; fd++)
+    {
+        uint16_t port = toxprpl_udp_port(fd, NULL);
+        if (port != 0)
+        {
+            g_hash_table_insert(sockets, GINT_TO_POINTER(fd),
+                                GUINT_TO_POINTER(port));
         }
-        xfers = g_list_next(xfers);
     }
-    return NULL;
+    return sockets;
 }
 
-static void on_file_control(Tox *tox, int friendnumber, uint8_t receive_send,
-                            uint8_t filenumber, uint8_t control_type,
-                            uint8_t *data, uint16_t length, void *userdata)
+/*
+ * the UDP socket of the core among those that are not in before, -1 if there
+ * is none or more than one could be it. frees before
+ */
+static int toxprpl_udp_socket_new(GHashTable *before, uint8_t ipv6)
 {
-    purple_debug_info("toxprpl", "file control: %i (%s) %i\n", friendnumber,
-        receive_send == 0 ? "rx" : "tx", filenumber);
-    PurpleConnection *gc = userdata;
-    toxprpl_return_if_fail(gc != NULL);
-
-    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnumber, filenumber);
-    toxprpl_return_if_fail(xfer != NULL);
-
-    if (receive_send == 0) //receiving
+    int found = -1;
+    int fd;
+    for (fd = 0; fd < TOXPRPL_MAX_FD; fd++)
     {
-        switch (control_type)
+        int family = AF_UNSPEC;
+        uint16_t port = toxprpl_udp_port(fd, &family);
+        if ((port == 0) ||
+            (g_hash_table_lookup(before, GINT_TO_POINTER(fd)) ==
+             GUINT_TO_POINTER(port)))
         {
-            case TOX_FILECONTROL_FINISHED:
-                purple_xfer_set_completed(xfer, TRUE);
-                purple_xfer_end(xfer);
-                break;
-            case TOX_FILECONTROL_KILL:
-                purple_xfer_cancel_remote(xfer);
-                break;
+            continue;
         }
-    }
-    else //sending
-    {
-        switch (control_type)
+        if ((port < TOX_PORTRANGE_FROM) || (port > TOX_PORTRANGE_TO) ||
+            (family != (ipv6 ? AF_INET6 : AF_INET)))
         {
-            case TOX_FILECONTROL_ACCEPT:
-                purple_xfer_start(xfer, -1, NULL, 0);
-                break;
-            case TOX_FILECONTROL_KILL:
-                purple_xfer_cancel_remote(xfer);
-                break;
+            purple_debug_info("toxprpl", "UDP socket %d on port %u is not "
+                              "the one of the core\n", fd, port);
+            continue;
         }
+        if (found >= 0)
+        {
+            purple_debug_info("toxprpl", "UDP sockets %d and %d could both be "
+                              "the one of the core\n", found, fd);
+            found = -1;
+            break;
+        }
+        found = fd;
     }
+    g_hash_table_destroy(before);
+    return found;
 }
 
-static void on_file_send_request(Tox *tox, int friendnumber, uint8_t filenumber,
-                                 uint64_t filesize, uint8_t *filename,
-                                 uint16_t filename_length, void *userdata)
+/* core socket tuning */
+/*
+ * the socket of the core if it was identified at login and the descriptor
+ * still is that socket, -1 otherwise. nothing else is ever tuned or read
+ */
+static int toxprpl_udp_core_fd(toxprpl_plugin_data *plugin)
 {
-    purple_debug_info("toxprpl", "file_send_request: %i %i\n", friendnumber,
-        filenumber);
-    PurpleConnection *gc = userdata;
-
-    toxprpl_return_if_fail(gc != NULL);
-    toxprpl_return_if_fail(filename != NULL);
-    toxprpl_return_if_fail(tox != NULL);
+    int family = AF_UNSPEC;
+    if ((plugin->dht_fd < 0) ||
+        (toxprpl_udp_port(plugin->dht_fd, &family) != plugin->dht_port) ||
+        (family != (plugin->ipv6 ? AF_INET6 : AF_INET)))
+    {
+        return -1;
+    }
+    return plugin->dht_fd;
+}
 
-    uint8_t client_id[TOX_CLIENT_ID_SIZE];
-    if (tox_get_client_id(tox, friendnumber, client_id) < 0)
+// what the kernel made of it, 0 if unknown
+static gint64 toxprpl_udp_buffer_size(int fd, int option)
+{
+    int size = 0;
+    socklen_t length = sizeof(size);
+    if ((fd < 0) ||
+        (getsockopt(fd, SOL_SOCKET, option, (void *)&size, &length) != 0))
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnumber);
-        return;
+        return 0;
     }
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
+    return size;
+}
 
-    PurpleXfer *xfer = toxprpl_new_xfer_receive(gc, buddy_key, friendnumber,
-        filenumber, filesize, (const char*) filename);
-    if (xfer == NULL)
+/*
+ * sets a socket buffer size of the core, the kernel caps it at
+ * net.core.rmem_max / wmem_max. Linux reports the doubled size it reserves
+ * for bookkeeping, which is what is logged
+ */
+static void toxprpl_udp_set_buffer_size(int fd, int option, const char *name,
+                                        int size)
+{
+    if (setsockopt(fd, SOL_SOCKET, option, (const void *)&size,
+                   sizeof(size)) != 0)
     {
-        purple_debug_warning("toxprpl", "could not create xfer\n");
-        g_free(buddy_key);
+        purple_debug_info("toxprpl", "could not set %s: %s\n", name,
+                          strerror(errno));
         return;
     }
-    toxprpl_return_if_fail(xfer != NULL);
-    purple_xfer_request(xfer);
-    g_free(buddy_key);
+    purple_debug_info("toxprpl", "%s %d requested, now %" G_GINT64_FORMAT
+                      "\n", name, size, toxprpl_udp_buffer_size(fd, option));
 }
 
-static void on_file_data(Tox *tox, int friendnumber, uint8_t filenumber,
-                         uint8_t *data, uint16_t length, void *userdata)
+static void toxprpl_udp_tune(PurpleAccount *acct, toxprpl_plugin_data *plugin)
 {
-    PurpleConnection *gc = userdata;
+    int rcvbuf = purple_account_get_int(acct, "udp_rcvbuf", 0);
+    int sndbuf = purple_account_get_int(acct, "udp_sndbuf", 0);
+    if ((rcvbuf <= 0) && (sndbuf <= 0))
+    {
+        return;
+    }
+    int fd = toxprpl_udp_core_fd(plugin);
+    if (fd < 0)
+    {
+        purple_debug_info("toxprpl", "socket buffers not set, the socket of "
+                          "the core is not known\n");
+        return;
+    }
 
-    toxprpl_return_if_fail(gc != NULL);
+    if (rcvbuf > 0)
+    {
+        toxprpl_udp_set_buffer_size(fd, SO_RCVBUF, "SO_RCVBUF",
+                                    rcvbuf * 1024);
+    }
+    if (sndbuf > 0)
+    {
+        toxprpl_udp_set_buffer_size(fd, SO_SNDBUF, "SO_SNDBUF",
+                                    sndbuf * 1024);
+    }
+}
 
-    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnumber, filenumber);
-    toxprpl_return_if_fail(xfer != NULL);
-    toxprpl_return_if_fail(xfer->dest_fp != NULL);
+// datagrams the kernel dropped on the socket since it was opened, from the
+// last column of /proc/net/udp(6). 0 where that is not available
+static gint64 toxprpl_udp_drops(int fd)
+{
+#ifdef __linux__
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) != 0))
+    {
+        return 0;
+    }
 
-    size_t written = fwrite(data, sizeof(uint8_t), length, xfer->dest_fp);
-    if (written != length)
+    const char *tables[] = { "/proc/net/udp", "/proc/net/udp6" };
+    char line[512];
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(tables); i++)
     {
-        purple_debug_warning("toxprpl", "could not write whole buffer\n");
-        purple_xfer_cancel_local(xfer);
-        return;
+        FILE *f = fopen(tables[i], "r");
+        if (f == NULL)
+        {
+            continue;
+        }
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+            // sl local remote st tx:rx tr:when retrnsmt uid timeout inode
+            // ref pointer drops
+            unsigned long inode;
+            long long drops;
+            if ((sscanf(line, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %lu "
+                        "%*s %*s %lld", &inode, &drops) == 2) &&
+                (inode == (unsigned long)st.st_ino))
+            {
+                fclose(f);
+                return drops;
+            }
+        }
+        fclose(f);
     }
+#endif
+    return 0;
+}
 
-    if (purple_xfer_get_size(xfer) > 0)
+/* LAN discovery */
+static void toxprpl_lan_read(gpointer data, gint fd,
+                             PurpleInputCondition condition)
+{
+    PurpleConnection *gc = data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+    uint8_t packet[TOXPRPL_LAN_PACKET_SIZE + 1];
+    struct sockaddr_storage from;
+    char host[NI_MAXHOST];
+    guint i;
+
+    // a bounded number per wakeup, the rest comes with the next one
+    for (i = 0; i < 16; i++)
     {
-        xfer->bytes_remaining -= written;
-        xfer->bytes_sent += written;
-        purple_xfer_update_progress(xfer);
+        socklen_t from_length = sizeof(from);
+        ssize_t length = recvfrom(fd, (void *)packet, sizeof(packet), 0,
+                                  (struct sockaddr *)&from, &from_length);
+        if (length < 0)
+        {
+            break;
+        }
+
+        const uint8_t *key = packet + TOXPRPL_LAN_MAGIC_SIZE;
+        if ((length != TOXPRPL_LAN_PACKET_SIZE) ||
+            (memcmp(packet, TOXPRPL_LAN_MAGIC, TOXPRPL_LAN_MAGIC_SIZE) != 0) ||
+            (memcmp(key, plugin->lan_packet + TOXPRPL_LAN_MAGIC_SIZE,
+                    TOX_CLIENT_ID_SIZE) == 0) ||
+            (getnameinfo((struct sockaddr *)&from, from_length, host,
+                         sizeof(host), NULL, 0, NI_NUMERICHOST) != 0))
+        {
+            continue; // garbage or ourselves
+        }
+
+        uint16_t port = (uint16_t)((key[TOX_CLIENT_ID_SIZE] << 8) |
+                                   key[TOX_CLIENT_ID_SIZE + 1]);
+        toxprpl_metric_add(plugin, TOXPRPL_METRIC_LAN_ANNOUNCEMENTS, 1);
+        tox_bootstrap_from_address(plugin->tox, host, plugin->ipv6,
+                                   htons(port), (uint8_t *)key);
+
+        int fnum = toxprpl_friend_find(&plugin->friends, key);
+        if (fnum >= 0)
+        {
+            if (plugin->friends.lan_seen[fnum] == 0)
+            {
+                purple_debug_info("toxprpl", "friend %d announced itself on "
+                                  "the LAN at %s:%u\n", fnum, host, port);
+            }
+            plugin->friends.lan_seen[fnum] = g_get_monotonic_time();
+        }
     }
 }
 
-static void on_typing_change(Tox *tox, int32_t friendnum, uint8_t is_typing,
-                            void *userdata)
+static void toxprpl_lan_announce(toxprpl_plugin_data *plugin)
 {
-    purple_debug_info("toxprpl", "Friend typing status change: %d", friendnum);
-    
-    PurpleConnection *gc = userdata;
-    toxprpl_return_if_fail(gc != NULL);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(TOXPRPL_LAN_PORT);
+    to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    if (sendto(plugin->lan_fd, (const void *)plugin->lan_packet,
+               TOXPRPL_LAN_PACKET_SIZE, 0, (struct sockaddr *)&to,
+               sizeof(to)) < 0)
+    {
+        purple_debug_info("toxprpl", "LAN announcement failed: %s\n",
+                          strerror(errno));
+    }
+}
 
-    uint8_t client_id[TOX_CLIENT_ID_SIZE];
-    if (tox_get_client_id(tox, friendnum, client_id) < 0)
+static void toxprpl_lan_start(PurpleConnection *gc,
+                              toxprpl_plugin_data *plugin)
+{
+#ifdef __WIN32__
+    purple_debug_info("toxprpl", "LAN discovery is not supported here\n");
+#else
+    if (plugin->dht_port == 0)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
+        purple_debug_info("toxprpl", "no LAN discovery, the port of the "
+                          "core is not known\n");
         return;
     }
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
-    PurpleAccount *account = purple_connection_get_account(gc);
-    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
-    if (buddy == NULL)
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
     {
-        purple_debug_info("toxprpl", "Ignoring typing change because buddy %s was not found\n", buddy_key);
-        g_free(buddy_key);
+        purple_debug_info("toxprpl", "could not create the LAN discovery "
+                          "socket: %s\n", strerror(errno));
         return;
     }
 
-    g_free(buddy_key);
-    
-    if (is_typing)
+    int on = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(TOXPRPL_LAN_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    if ((setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) != 0) ||
+        (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+        (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0))
     {
-        serv_got_typing(gc, buddy->name, 5, PURPLE_TYPING);
-                                    /*   ^ timeout for typing status (0 = disabled) */
+        purple_debug_info("toxprpl", "could not set up the LAN discovery "
+                          "socket: %s\n", strerror(errno));
+        close(fd);
+        return;
     }
-    else
+
+    uint8_t address[TOX_FRIEND_ADDRESS_SIZE];
+    tox_get_address(plugin->tox, address);
+    memcpy(plugin->lan_packet, TOXPRPL_LAN_MAGIC, TOXPRPL_LAN_MAGIC_SIZE);
+    memcpy(plugin->lan_packet + TOXPRPL_LAN_MAGIC_SIZE, address,
+           TOX_CLIENT_ID_SIZE);
+    plugin->lan_packet[TOXPRPL_LAN_PACKET_SIZE - 2] = plugin->dht_port >> 8;
+    plugin->lan_packet[TOXPRPL_LAN_PACKET_SIZE - 1] = plugin->dht_port & 0xff;
+
+    plugin->lan_fd = fd;
+    plugin->lan_input = purple_input_add(fd, PURPLE_INPUT_READ,
+                                         toxprpl_lan_read, gc);
+    purple_debug_info("toxprpl", "LAN discovery on port %u\n",
+                      TOXPRPL_LAN_PORT);
+#endif
+}
+
+static void toxprpl_lan_stop(toxprpl_plugin_data *plugin)
+{
+    if (plugin->lan_fd < 0)
     {
-        serv_got_typing_stopped(gc, buddy->name);
+        return;
     }
+    purple_input_remove(plugin->lan_input);
+    close(plugin->lan_fd);
+    plugin->lan_fd = -1;
 }
 
 static gboolean tox_messenger_loop(gpointer data)
@@ -652,7 +4533,28 @@ static gboolean tox_messenger_loop(gpointer data)
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
     if ((plugin != NULL) && (plugin->tox != NULL))
     {
+        toxprpl_probe0(loop__entry);
+        gint64 span = toxprpl_span_begin(plugin);
+        gint64 start = g_get_monotonic_time();
         tox_do(plugin->tox);
+        guint64 duration = (guint64)(g_get_monotonic_time() - start);
+        toxprpl_probe1(loop__return, duration);
+        toxprpl_span_end(plugin, "tox_do", "messenger", span, -1);
+        toxprpl_metric_observe(plugin, TOXPRPL_HISTOGRAM_TOX_DO, duration);
+        toxprpl_trace(TOXPRPL_TRACE_TOX_DO, -1, (guint32)duration, 0);
+        toxprpl_arena_reset(&plugin->scratch);
+        if (plugin->offline_flush)
+        {
+            span = toxprpl_span_begin(plugin);
+            toxprpl_offline_flush(plugin);
+            toxprpl_span_end(plugin, "offline_flush", "messenger", span, -1);
+        }
+        if (plugin->group_flush)
+        {
+            span = toxprpl_span_begin(plugin);
+            toxprpl_group_flush(gc, plugin);
+            toxprpl_span_end(plugin, "group_flush", "messenger", span, -1);
+        }
     }
     return TRUE;
 }
@@ -673,14 +4575,26 @@ static gboolean tox_connection_check(gpointer gc)
 {
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
 
+    toxprpl_receipt_expire(gc, plugin, -1);
+
     if ((plugin->connected == 0) && tox_isconnected(plugin->tox))
     {
         plugin->connected = 1;
+        toxprpl_trace(TOXPRPL_TRACE_DHT, -1, 1, 0);
+        guint64 connect_time =
+            (guint64)(g_get_monotonic_time() - plugin->connect_started);
+        toxprpl_metric_observe(plugin, TOXPRPL_HISTOGRAM_DHT_CONNECT,
+                               connect_time);
+        // by what the core may use, it does not tell what it ended up with
+        toxprpl_metric_observe(plugin, plugin->ipv6 ?
+            TOXPRPL_HISTOGRAM_DHT_CONNECT_IPV6 :
+            TOXPRPL_HISTOGRAM_DHT_CONNECT_IPV4, connect_time);
         purple_connection_update_progress(gc, _("Connected"),
                 1,   /* which connection step this is */
                 2);  /* total number of steps */
         purple_connection_set_state(gc, PURPLE_CONNECTED);
         purple_debug_info("toxprpl", "DHT connected!\n");
+        toxprpl_bootstrap_connected(plugin);
 
         // query status of all buddies
         PurpleAccount *account = purple_connection_get_account(gc);
@@ -722,6 +4636,8 @@ static gboolean tox_connection_check(gpointer gc)
     else if ((plugin->connected == 1) && !tox_isconnected(plugin->tox))
     {
         plugin->connected = 0;
+        toxprpl_trace(TOXPRPL_TRACE_DHT, -1, 0, 0);
+        plugin->connect_started = g_get_monotonic_time();
         purple_debug_info("toxprpl", "DHT disconnected!\n");
         purple_connection_notice(gc,
                 _("Connection to DHT server lost, attempging to reconnect..."));
@@ -732,6 +4648,149 @@ static gboolean tox_connection_check(gpointer gc)
     return TRUE;
 }
 
+/*
+ * all accounts share one timer instead of two each. every account has its
+ * own due times for tox_do() and the connection check, a tick services the
+ * accounts that are due in round robin order and re-arms the timer for the
+ * earliest due time left. a tick stops after TOXPRPL_SCHEDULER_BUDGET_US and
+ * continues with the next account right after the main loop had its turn, so
+ * many accounts can not starve the UI or each other
+ */
+#define TOXPRPL_LOOP_INTERVAL_US        (80 * 1000)
+#define TOXPRPL_CHECK_INTERVAL_US       (2 * G_USEC_PER_SEC)
+#define TOXPRPL_SCHEDULER_BUDGET_US     (20 * 1000)
+
+typedef struct
+{
+    GList *accounts;            // PurpleConnection *
+    GList *next;                // first account the next tick looks at
+    guint timer;
+    gint64 timer_due;
+} toxprpl_scheduler;
+
+static toxprpl_scheduler toxprpl_sched;
+
+static gboolean toxprpl_scheduler_tick(gpointer data);
+
+static void toxprpl_scheduler_arm(gint64 now)
+{
+    gint64 due = G_MAXINT64;
+    GList *l;
+    for (l = toxprpl_sched.accounts; l != NULL; l = l->next)
+    {
+        toxprpl_plugin_data *plugin =
+            purple_connection_get_protocol_data(l->data);
+        due = MIN(due, MIN(plugin->loop_due, plugin->check_due));
+        if (plugin->lan_fd >= 0)
+        {
+            due = MIN(due, plugin->lan_due);
+        }
+    }
+
+    if ((toxprpl_sched.timer != 0) && (toxprpl_sched.timer_due == due))
+    {
+        return;
+    }
+    if (toxprpl_sched.timer != 0)
+    {
+        purple_timeout_remove(toxprpl_sched.timer);
+        toxprpl_sched.timer = 0;
+    }
+    if (due == G_MAXINT64)
+    {
+        return;
+    }
+
+    toxprpl_sched.timer_due = due;
+    toxprpl_sched.timer = purple_timeout_add(
+        (guint)((MAX(due - now, 0) + 999) / 1000), toxprpl_scheduler_tick,
+        NULL);
+}
+
+static gboolean toxprpl_scheduler_tick(gpointer data)
+{
+    gint64 start = g_get_monotonic_time();
+    guint count = g_list_length(toxprpl_sched.accounts);
+    guint i;
+
+    toxprpl_sched.timer = 0;
+    for (i = 0; (i < count) && (toxprpl_sched.accounts != NULL); i++)
+    {
+        if (toxprpl_sched.next == NULL)
+        {
+            toxprpl_sched.next = toxprpl_sched.accounts;
+        }
+        // the callbacks may close accounts, toxprpl_scheduler_remove()
+        // keeps next valid
+        PurpleConnection *gc = toxprpl_sched.next->data;
+        toxprpl_sched.next = toxprpl_sched.next->next;
+
+        toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+        gint64 now = g_get_monotonic_time();
+        if (plugin->loop_due <= now)
+        {
+            toxprpl_metric_observe(plugin, TOXPRPL_HISTOGRAM_SCHEDULER_LAG,
+                                   (guint64)(now - plugin->loop_due));
+            // a late account does not try to catch up with missed ticks
+            plugin->loop_due = MAX(plugin->loop_due + TOXPRPL_LOOP_INTERVAL_US,
+                                   now);
+            tox_messenger_loop(gc);
+            if (g_list_find(toxprpl_sched.accounts, gc) == NULL)
+            {
+                continue;
+            }
+        }
+        if ((plugin->lan_fd >= 0) && (plugin->lan_due <= now))
+        {
+            plugin->lan_due = now + TOXPRPL_LAN_INTERVAL_US;
+            toxprpl_lan_announce(plugin);
+        }
+        if (plugin->check_due <= now)
+        {
+            plugin->check_due = now + TOXPRPL_CHECK_INTERVAL_US;
+            tox_connection_check(gc);
+        }
+
+        if (g_get_monotonic_time() - start >= TOXPRPL_SCHEDULER_BUDGET_US)
+        {
+            break;
+        }
+    }
+
+    toxprpl_scheduler_arm(g_get_monotonic_time());
+    return FALSE;
+}
+
+static void toxprpl_scheduler_add(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    gint64 now = g_get_monotonic_time();
+
+    plugin->loop_due = now + TOXPRPL_LOOP_INTERVAL_US;
+    plugin->check_due = now + TOXPRPL_CHECK_INTERVAL_US;
+    plugin->lan_due = now; // announce right away
+    toxprpl_sched.accounts = g_list_append(toxprpl_sched.accounts, gc);
+    purple_debug_info("toxprpl", "scheduling %u accounts\n",
+                      g_list_length(toxprpl_sched.accounts));
+    toxprpl_scheduler_arm(now);
+}
+
+static void toxprpl_scheduler_remove(PurpleConnection *gc)
+{
+    GList *link = g_list_find(toxprpl_sched.accounts, gc);
+    if (link == NULL)
+    {
+        return;
+    }
+
+    if (toxprpl_sched.next == link)
+    {
+        toxprpl_sched.next = link->next;
+    }
+    toxprpl_sched.accounts = g_list_delete_link(toxprpl_sched.accounts, link);
+    toxprpl_scheduler_arm(g_get_monotonic_time());
+}
+
 static void toxprpl_set_status(PurpleAccount *account, PurpleStatus *status)
 {
     const char* status_id = purple_status_get_id(status);
@@ -759,7 +4818,7 @@ static void toxprpl_set_status(PurpleAccount *account, PurpleStatus *status)
 // query buddy status
 static void toxprpl_query_buddy_info(gpointer data, gpointer user_data)
 {
-    purple_debug_info("toxprpl", "toxprpl_query_buddy_info\n");
+    toxprpl_debug("toxprpl_query_buddy_info\n");
     PurpleBuddy *buddy = (PurpleBuddy *)data;
     PurpleConnection *gc = (PurpleConnection *)user_data;
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
@@ -769,28 +4828,24 @@ static void toxprpl_query_buddy_info(gpointer data, gpointer user_data)
     {
         unsigned char *bin_key = toxprpl_hex_string_to_data(buddy->name);
         int fnum = tox_get_friend_number(plugin->tox, bin_key);
-        buddy_data = g_new0(toxprpl_buddy_data, 1);
-        buddy_data->tox_friendlist_number = fnum;
-        purple_buddy_set_protocol_data(buddy, buddy_data);
+        buddy_data = toxprpl_buddy_attach(plugin, buddy, fnum);
         g_free(bin_key);
     }
 
+    int status_index = toxprpl_get_status_index(&plugin->friends,
+        buddy_data->tox_friendlist_number);
     PurpleAccount *account = purple_connection_get_account(gc);
-    purple_debug_info("toxprpl", "Setting user status for user %s to %s\n",
-        buddy->name, toxprpl_statuses[toxprpl_get_status_index(plugin->tox,
-            buddy_data->tox_friendlist_number,
-            tox_get_user_status(plugin->tox,buddy_data->tox_friendlist_number))].id);
+    toxprpl_debug("Setting user status for user %s to %s\n",
+        buddy->name, toxprpl_statuses[status_index].id);
     purple_prpl_got_user_status(account, buddy->name,
-        toxprpl_statuses[toxprpl_get_status_index(plugin->tox,
-            buddy_data->tox_friendlist_number,
-            tox_get_user_status(plugin->tox, buddy_data->tox_friendlist_number))].id,
-        NULL);
+        toxprpl_statuses[status_index].id, NULL);
 
     uint8_t alias[TOX_MAX_NAME_LENGTH + 1];
     if (tox_get_name(plugin->tox, buddy_data->tox_friendlist_number, alias) == 0)
     {
         alias[TOX_MAX_NAME_LENGTH] = '\0';
-        purple_blist_alias_buddy(buddy, (const char*)alias);
+        purple_blist_alias_buddy(buddy,
+            toxprpl_utf8_sanitize_string((char *)alias));
     }
 }
 
@@ -836,23 +4891,137 @@ static PurpleCmdRet toxprpl_myid_cmd_cb(PurpleConversation *conv,
 
     purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM,
                               time(NULL));
-    g_free(id);
+    g_free(id);
+    g_free(message);
+    return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet toxprpl_nick_cmd_cb(PurpleConversation *conv,
+        const gchar *cmd, gchar **args, gchar **error, void *data)
+{
+    purple_debug_info("toxprpl", "/nick %s command detected\n", args[0]);
+    PurpleConnection *gc = (PurpleConnection *)data;
+    toxprpl_set_nick_action(gc, args[0]);
+    return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet toxprpl_latency_cmd_cb(PurpleConversation *conv,
+        const gchar *cmd, gchar **args, gchar **error, void *data)
+{
+    purple_debug_info("toxprpl", "/latency command detected\n");
+    PurpleConnection *gc = (PurpleConnection *)data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+
+    gchar *all = toxprpl_histogram_summary_ms(
+        &plugin->metrics.histograms[TOXPRPL_HISTOGRAM_DELIVERY_LATENCY]);
+    gchar *message = g_strdup_printf(_("Delivery latency, all friends: %s"),
+                                     all);
+    purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM,
+                              time(NULL));
+    g_free(message);
+    g_free(all);
+
+    if (purple_conversation_get_type(conv) == PURPLE_CONV_TYPE_IM)
+    {
+        PurpleAccount *account = purple_connection_get_account(gc);
+        PurpleBuddy *buddy = purple_find_buddy(account,
+            purple_conversation_get_name(conv));
+        toxprpl_buddy_data *buddy_data = buddy == NULL ? NULL :
+            purple_buddy_get_protocol_data(buddy);
+        if (buddy_data != NULL)
+        {
+            toxprpl_histogram *h = g_hash_table_lookup(plugin->friend_latency,
+                GINT_TO_POINTER(buddy_data->tox_friendlist_number));
+            gchar *summary = h == NULL ? g_strdup(_("no samples")) :
+                                         toxprpl_histogram_summary_ms(h);
+            message = g_strdup_printf(_("Delivery latency, this friend: %s"),
+                                      summary);
+            purple_conversation_write(conv, NULL, message,
+                                      PURPLE_MESSAGE_SYSTEM, time(NULL));
+            g_free(message);
+            g_free(summary);
+        }
+    }
+
+    message = g_strdup_printf(_("Messages waiting for a read receipt: %u"),
+                              g_hash_table_size(plugin->receipts));
+    purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM,
+                              time(NULL));
     g_free(message);
     return PURPLE_CMD_RET_OK;
 }
 
-static PurpleCmdRet toxprpl_nick_cmd_cb(PurpleConversation *conv,
+static PurpleCmdRet toxprpl_stats_cmd_cb(PurpleConversation *conv,
         const gchar *cmd, gchar **args, gchar **error, void *data)
 {
-    purple_debug_info("toxprpl", "/nick %s command detected\n", args[0]);
+    purple_debug_info("toxprpl", "/toxstats command detected\n");
     PurpleConnection *gc = (PurpleConnection *)data;
-    toxprpl_set_nick_action(gc, args[0]);
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    GString *message = g_string_new(NULL);
+    guint i;
+
+    toxprpl_metrics_refresh(gc, plugin);
+    for (i = 0; i < TOXPRPL_METRIC_COUNT; i++)
+    {
+        g_string_append_printf(message, "%s: %" G_GINT64_FORMAT "%s%s<br>",
+            toxprpl_metric_infos[i].name, plugin->metrics.values[i],
+            toxprpl_metric_infos[i].unit ? " " : "",
+            toxprpl_metric_infos[i].unit ? toxprpl_metric_infos[i].unit : "");
+    }
+    for (i = 0; i < TOXPRPL_HISTOGRAM_COUNT; i++)
+    {
+        const toxprpl_histogram *h = &plugin->metrics.histograms[i];
+        if (h->count == 0)
+        {
+            g_string_append_printf(message, "%s: %s<br>",
+                toxprpl_histogram_infos[i].name, _("no samples"));
+            continue;
+        }
+        g_string_append_printf(message, "%s: n=%" G_GUINT64_FORMAT
+            " min=%" G_GUINT64_FORMAT " p50=%" G_GUINT64_FORMAT
+            " p99=%" G_GUINT64_FORMAT " max=%" G_GUINT64_FORMAT " %s<br>",
+            toxprpl_histogram_infos[i].name, h->count, h->min,
+            toxprpl_histogram_percentile(h, 50),
+            toxprpl_histogram_percentile(h, 99), h->max,
+            toxprpl_histogram_infos[i].unit);
+    }
+
+    purple_conversation_write(conv, NULL, message->str, PURPLE_MESSAGE_SYSTEM,
+                              time(NULL));
+    g_string_free(message, TRUE);
+    return PURPLE_CMD_RET_OK;
+}
+
+#ifndef TOXPRPL_NO_TRACE
+static PurpleCmdRet toxprpl_trace_cmd_cb(PurpleConversation *conv,
+        const gchar *cmd, gchar **args, gchar **error, void *data)
+{
+    purple_debug_info("toxprpl", "/toxtrace command detected\n");
+    gchar *path = g_build_filename(purple_user_dir(), "tox", "toxprpl.trace",
+                                   NULL);
+    gchar *message;
+    if (toxprpl_trace_dump(path))
+    {
+        message = g_strdup_printf(_("Trace of the last %d events written to "
+                                    "%s"), TOXPRPL_TRACE_RECORDS, path);
+    }
+    else
+    {
+        message = g_strdup_printf(_("Could not write %s"), path);
+    }
+    purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM,
+                              time(NULL));
+    g_free(message);
+    g_free(path);
     return PURPLE_CMD_RET_OK;
 }
+#endif
 
-static void toxprpl_sync_add_buddy(PurpleAccount *account, Tox *tox,
+static void toxprpl_sync_add_buddy(PurpleAccount *account,
+                                   toxprpl_plugin_data *plugin,
                                    int friend_number)
 {
+    Tox *tox = plugin->tox;
     uint8_t alias[TOX_MAX_NAME_LENGTH + 1];
     uint8_t client_id[TOX_CLIENT_ID_SIZE];
     if (tox_get_client_id(tox, friend_number, client_id) < 0)
@@ -863,11 +5032,18 @@ static void toxprpl_sync_add_buddy(PurpleAccount *account, Tox *tox,
     }
 
     gchar *buddy_key = toxprpl_tox_bin_id_to_string(client_id);
-
+    toxprpl_friend_update(&plugin->friends, tox, friend_number);
 
     PurpleBuddy *buddy;
+    // the buffer is only filled in if the core knows the friend, and the
+    // name in it is not terminated
+    memset(alias, 0, sizeof(alias));
     int ret = tox_get_name(tox, friend_number, alias);
-    alias[TOX_MAX_NAME_LENGTH] = '\0';
+    if (ret == 0)
+    {
+        alias[TOX_MAX_NAME_LENGTH] = '\0';
+        toxprpl_utf8_sanitize_string((char *)alias);
+    }
     if ((ret == 0) && (strlen((const char *)alias) > 0))
     {
         purple_debug_info("toxprpl", "Got friend alias %s\n", alias);
@@ -879,22 +5055,21 @@ static void toxprpl_sync_add_buddy(PurpleAccount *account, Tox *tox,
         buddy = purple_buddy_new(account, buddy_key, NULL);
     }
 
-    toxprpl_buddy_data *buddy_data = g_new0(toxprpl_buddy_data, 1);
-    buddy_data->tox_friendlist_number = friend_number;
-    purple_buddy_set_protocol_data(buddy, buddy_data);
+    toxprpl_buddy_attach(plugin, buddy, friend_number);
     purple_blist_add_buddy(buddy, NULL, NULL, NULL);
-    TOX_USERSTATUS userstatus = tox_get_user_status(tox, friend_number);
     purple_debug_info("toxprpl", "Friend %s has status %d\n", buddy_key,
-                      userstatus);
+                      plugin->friends.user_status[friend_number]);
     purple_prpl_got_user_status(account, buddy_key,
         toxprpl_statuses[
-            toxprpl_get_status_index(tox,friend_number,userstatus)].id,
+            toxprpl_get_status_index(&plugin->friends, friend_number)].id,
         NULL);
     g_free(buddy_key);
 }
 
-static void toxprpl_sync_friends(PurpleAccount *acct, Tox *tox)
+static void toxprpl_sync_friends(PurpleAccount *acct,
+                                 toxprpl_plugin_data *plugin)
 {
+    Tox *tox = plugin->tox;
     uint32_t i;
 
     uint32_t fl_len = tox_count_friendlist(tox);
@@ -910,19 +5085,16 @@ static void toxprpl_sync_friends(PurpleAccount *acct, Tox *tox)
         {
             iterator = buddies;
             int fnum = friendlist[i];
-            uint8_t bin_id[TOX_CLIENT_ID_SIZE];
-            if (tox_get_client_id(tox, fnum, bin_id) == 0)
+            if (toxprpl_friend_known(&plugin->friends, fnum))
             {
-                gchar *str_id = toxprpl_tox_bin_id_to_string(bin_id);
+                gchar *str_id = toxprpl_tox_bin_id_to_string(
+                    plugin->friends.keys + fnum * TOX_CLIENT_ID_SIZE);
                 while (iterator != NULL)
                 {
                     PurpleBuddy *buddy = iterator->data;
                     if (strcmp(buddy->name, str_id) == 0)
                     {
-                        toxprpl_buddy_data *buddy_data =
-                                    g_new0(toxprpl_buddy_data, 1);
-                        buddy_data->tox_friendlist_number = fnum;
-                        purple_buddy_set_protocol_data(buddy, buddy_data);
+                        toxprpl_buddy_attach(plugin, buddy, fnum);
                         friendlist[i] = -1;
                     }
                     iterator = iterator->next;
@@ -954,7 +5126,7 @@ static void toxprpl_sync_friends(PurpleAccount *acct, Tox *tox)
     {
         if (friendlist[i] != -1)
         {
-            toxprpl_sync_add_buddy(acct, tox, friendlist[i]);
+            toxprpl_sync_add_buddy(acct, plugin, friendlist[i]);
         }
     }
 
@@ -966,12 +5138,33 @@ static gboolean toxprpl_save_account(PurpleAccount *account, Tox* tox)
     uint32_t msg_size = tox_size(tox);
     if (msg_size > 0)
     {
+        // not yet set while logging in
+        PurpleConnection *gc = purple_account_get_connection(account);
+        toxprpl_plugin_data *plugin = gc == NULL ? NULL :
+            purple_connection_get_protocol_data(gc);
+
+        gint64 span = toxprpl_span_begin(plugin);
+        // only read by the trace ring and the probe
+        gint64 start G_GNUC_UNUSED = g_get_monotonic_time();
         guchar *msg_data = g_malloc0(msg_size);
         tox_save(tox, (uint8_t *)msg_data);
+
+        if (plugin != NULL)
+        {
+            toxprpl_metric_add(plugin, TOXPRPL_METRIC_SAVES, 1);
+            toxprpl_metric_observe(plugin, TOXPRPL_HISTOGRAM_SAVE_SIZE,
+                                   msg_size);
+        }
+
         gchar *msg64 = g_base64_encode(msg_data, msg_size);
         purple_account_set_string(account, "messenger", msg64);
         g_free(msg64);
         g_free(msg_data);
+        toxprpl_trace(TOXPRPL_TRACE_SAVE, -1, msg_size,
+                      (guint32)(g_get_monotonic_time() - start));
+        toxprpl_span_end(plugin, "save_account", "account", span, -1);
+        toxprpl_probe2(save__account, msg_size,
+                       g_get_monotonic_time() - start);
         return TRUE;
     }
 
@@ -984,7 +5177,10 @@ static void toxprpl_login_after_setup(PurpleAccount *acct)
 
     PurpleConnection *gc = purple_account_get_connection(acct);
 
-    Tox *tox = tox_new(0);
+    uint8_t ipv6 = purple_account_get_bool(acct, "ipv6", FALSE) ? 1 : 0;
+    GHashTable *udp_sockets = toxprpl_udp_sockets();
+    Tox *tox = tox_new(ipv6);
+    int dht_fd = toxprpl_udp_socket_new(udp_sockets, ipv6);
     if (tox == NULL)
     {
         purple_debug_info("toxprpl", "Fatal error, could not allocate memory "
@@ -993,18 +5189,26 @@ static void toxprpl_login_after_setup(PurpleAccount *acct)
 
     }
 
-    tox_callback_friend_message(tox, on_incoming_message, gc);
-    tox_callback_name_change(tox, on_nick_change, gc);
-    tox_callback_user_status(tox, on_status_change, gc);
-    tox_callback_friend_request(tox, on_request, gc);
-    tox_callback_connection_status(tox, on_connectionstatus, gc);
-    tox_callback_friend_action(tox, on_friend_action, gc);
-
-    tox_callback_file_send_request(tox, on_file_send_request, gc);
-    tox_callback_file_control(tox, on_file_control, gc);
-    tox_callback_file_data(tox, on_file_data, gc);
+    tox_callback_friend_message(tox, toxprpl_cb_incoming_message, gc);
+    tox_callback_name_change(tox, toxprpl_cb_nick_change, gc);
+    tox_callback_user_status(tox, toxprpl_cb_status_change, gc);
+    tox_callback_status_message(tox, toxprpl_cb_status_message, gc);
+    tox_callback_friend_request(tox, toxprpl_cb_request, gc);
+    tox_callback_connection_status(tox, toxprpl_cb_connectionstatus, gc);
+    tox_callback_friend_action(tox, toxprpl_cb_friend_action, gc);
+    tox_callback_read_receipt(tox, toxprpl_cb_read_receipt, gc);
+
+    tox_callback_file_send_request(tox, toxprpl_cb_file_send_request, gc);
+    tox_callback_file_control(tox, toxprpl_cb_file_control, gc);
+    tox_callback_file_data(tox, toxprpl_cb_file_data, gc);
     
-    tox_callback_typing_change(tox, on_typing_change, gc);
+    tox_callback_typing_change(tox, toxprpl_cb_typing_change, gc);
+
+    tox_callback_group_invite(tox, toxprpl_cb_group_invite, gc);
+    tox_callback_group_message(tox, toxprpl_cb_group_message, gc);
+    tox_callback_group_action(tox, toxprpl_cb_group_action, gc);
+    tox_callback_group_namelist_change(tox, toxprpl_cb_group_namelist_change,
+                                       gc);
     purple_debug_info("toxprpl", "initialized tox callbacks\n");
 
     gc->flags |= PURPLE_CONNECTION_NO_FONTSIZE | PURPLE_CONNECTION_NO_URLDESC;
@@ -1048,40 +5252,85 @@ static void toxprpl_login_after_setup(PurpleAccount *acct)
     const char* ip = purple_account_get_string(acct, "dht_server",
                                                DEFAULT_SERVER_IP);
 
-    unsigned char *bin_str = toxprpl_hex_string_to_data(key);
-
     purple_debug_info("toxprpl", "Will connect to %s:%d (%s)\n" ,
                       ip, port, key);
 
-    if (tox_bootstrap_from_address(tox, ip, 0, htons(port), bin_str) == 0)
+    GArray *bootstrap_tried = g_array_new(FALSE, FALSE, sizeof(guint));
+    if (!toxprpl_bootstrap(tox, ipv6, ip, port, key, bootstrap_tried))
     {
         purple_connection_error_reason(gc,
                 PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
                 _("server invalid or not found"));
-        g_free(bin_str);
+        g_array_free(bootstrap_tried, TRUE);
         tox_kill(tox);
         return;
     }
-    g_free(bin_str);
-
-    toxprpl_sync_friends(acct, tox);
 
     toxprpl_plugin_data *plugin = g_new0(toxprpl_plugin_data, 1);
-
+    plugin->chrome_trace = purple_account_get_bool(acct, "chrome_trace",
+                                                   FALSE);
+    if (plugin->chrome_trace)
+    {
+        plugin->trace_id = toxprpl_chrome_trace_start();
+        purple_debug_info("toxprpl", "spans of %s are traced as process %u\n",
+                          purple_account_get_username(acct),
+                          plugin->trace_id);
+    }
     plugin->tox = tox;
-    plugin->tox_timer = purple_timeout_add(80, tox_messenger_loop, gc);
-    purple_debug_info("toxprpl", "added messenger timer as %d\n",
-                      plugin->tox_timer);
-    plugin->connection_timer = purple_timeout_add_seconds(2,
-                                                        tox_connection_check,
-                                                        gc);
-    purple_debug_info("toxprpl", "added connection timer as %d\n",
-                      plugin->connection_timer);
+    plugin->ipv6 = ipv6;
+    plugin->lan_fd = -1;
+    plugin->dht_fd = dht_fd;
+    plugin->dht_port = dht_fd < 0 ? 0 : toxprpl_udp_port(dht_fd, NULL);
+    plugin->bootstrap_tried = bootstrap_tried;
+    toxprpl_bootstrap_count(plugin);
+    toxprpl_pool_init(&plugin->buddy_pool, sizeof(toxprpl_buddy_data));
+    toxprpl_pool_init(&plugin->xfer_pool, sizeof(toxprpl_xfer_data));
+    toxprpl_pool_init(&plugin->message_pool, sizeof(GOfflineMessage));
+    toxprpl_pool_init(&plugin->group_pool, sizeof(toxprpl_group_message));
+    toxprpl_friends_load(&plugin->friends, tox);
+
+    gint64 span = toxprpl_span_begin(plugin);
+    toxprpl_sync_friends(acct, plugin);
+    toxprpl_span_end(plugin, "sync_friends", "account", span, -1);
+
+#if !defined(TOXPRPL_NO_TRACE) && !defined(__WIN32__)
+    plugin->crash_trace = purple_account_get_bool(acct, "crash_trace", FALSE);
+    if (plugin->crash_trace)
+    {
+        toxprpl_crash_handler_install();
+    }
+#endif
+    if (purple_account_get_bool(acct, "capture", FALSE))
+    {
+        toxprpl_capture_start(plugin, acct);
+    }
+
+    plugin->connect_started = g_get_monotonic_time();
+    plugin->receipts = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+        NULL, (GDestroyNotify)toxprpl_receipt_free);
+    plugin->friend_latency = g_hash_table_new_full(g_direct_hash,
+        g_direct_equal, NULL, g_free);
+    plugin->typing = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+        NULL, (GDestroyNotify)toxprpl_typing_free);
+    plugin->groups = g_hash_table_new(g_direct_hash, g_direct_equal);
+    toxprpl_offline_load(plugin, acct);
+    toxprpl_inbox_load(plugin, acct);
+    toxprpl_udp_tune(acct, plugin);
+    if (purple_account_get_bool(acct, "lan_discovery", FALSE))
+    {
+        toxprpl_lan_start(gc, plugin);
+    }
+    // the scheduler finds the account through its protocol data
+    purple_connection_set_protocol_data(gc, plugin);
+    toxprpl_scheduler_add(gc);
 
 
     gchar *myid_help = "myid  print your tox id which you can give to "
                        "your friends";
     gchar *nick_help = "nick &lt;nickname&gt; set your nickname";
+    gchar *latency_help = "latency  show how long it takes until sent "
+                          "messages are confirmed by read receipts";
+    gchar *stats_help = "toxstats  show internal statistics of this account";
 
     plugin->myid_command_id = purple_cmd_register("myid", "",
             PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT,
@@ -1091,6 +5340,32 @@ static void toxprpl_login_after_setup(PurpleAccount *acct)
             PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT,
             TOXPRPL_ID, toxprpl_nick_cmd_cb, nick_help, gc);
 
+    plugin->latency_command_id = purple_cmd_register("latency", "",
+            PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT,
+            TOXPRPL_ID, toxprpl_latency_cmd_cb, latency_help, gc);
+
+    plugin->stats_command_id = purple_cmd_register("toxstats", "",
+            PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT,
+            TOXPRPL_ID, toxprpl_stats_cmd_cb, stats_help, gc);
+
+#ifndef TOXPRPL_NO_TRACE
+    gchar *trace_help = "toxtrace  write the most recent internal events to "
+                        "a file";
+    plugin->trace_command_id = purple_cmd_register("toxtrace", "",
+            PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT,
+            TOXPRPL_ID, toxprpl_trace_cmd_cb, trace_help, gc);
+#endif
+
+    int interval = purple_account_get_int(acct, "stats_interval", 0);
+    if (interval > 0)
+    {
+        plugin->metrics_path = toxprpl_get_data_path(acct, "stats.json");
+        plugin->metrics_timer = purple_timeout_add_seconds(interval,
+            toxprpl_metrics_dump, gc);
+        purple_debug_info("toxprpl", "writing statistics to %s every %d "
+                          "seconds\n", plugin->metrics_path, interval);
+    }
+
     const char *nick = purple_account_get_string(acct, "nickname", NULL);
     if (!nick || (strlen(nick) == 0))
     {
@@ -1106,8 +5381,12 @@ static void toxprpl_login_after_setup(PurpleAccount *acct)
         }
     }
 
-    purple_connection_set_protocol_data(gc, plugin);
     toxprpl_set_nick_action(gc, nick);
+
+    if (plugin->inbox_unseen)
+    {
+        toxprpl_inbox_schedule_review(gc);
+    }
 }
 
 static void toxprpl_user_import(PurpleAccount *acct, const char *filename)
@@ -1260,25 +5539,145 @@ static void toxprpl_close(PurpleConnection *gc)
         return;
     }
 
-    purple_debug_info("toxprpl", "removing timers %d and %d\n",
-            plugin->tox_timer, plugin->connection_timer);
-    purple_timeout_remove(plugin->tox_timer);
-    purple_timeout_remove(plugin->connection_timer);
+    toxprpl_scheduler_remove(gc);
+    toxprpl_lan_stop(plugin);
 
     purple_cmd_unregister(plugin->myid_command_id);
     purple_cmd_unregister(plugin->nick_command_id);
+    purple_cmd_unregister(plugin->latency_command_id);
+    purple_cmd_unregister(plugin->stats_command_id);
+    if (plugin->chrome_trace)
+    {
+        toxprpl_chrome_trace_stop();
+    }
+    toxprpl_capture_stop(plugin);
+#ifndef TOXPRPL_NO_TRACE
+    purple_cmd_unregister(plugin->trace_command_id);
+#endif
+#if !defined(TOXPRPL_NO_TRACE) && !defined(__WIN32__)
+    if (plugin->crash_trace)
+    {
+        toxprpl_crash_handler_remove();
+    }
+#endif
+    if (plugin->metrics_timer != 0)
+    {
+        purple_timeout_remove(plugin->metrics_timer);
+        toxprpl_metrics_dump(gc);
+    }
+    g_free(plugin->metrics_path);
 
     if (!toxprpl_save_account(account, plugin->tox))
     {
         purple_account_set_string(account, "messenger", "");
     }
 
+    // undelivered messages are already in the queue file
+    toxprpl_offline_close(plugin);
+    toxprpl_inbox_close(plugin);
+    g_hash_table_destroy(plugin->receipts);
+    g_hash_table_destroy(plugin->friend_latency);
+    g_hash_table_destroy(plugin->typing);
+
+    GHashTableIter iter;
+    gpointer group;
+    g_hash_table_iter_init(&iter, plugin->groups);
+    while (g_hash_table_iter_next(&iter, NULL, &group))
+    {
+        serv_got_chat_left(gc, ((toxprpl_group *)group)->groupnumber);
+        toxprpl_group_free(plugin, group);
+    }
+    g_hash_table_destroy(plugin->groups);
+
+    // nothing may point into the pools once they are gone: transfers can
+    // not go on without the core anyway and buddies outlive the connection
+    GList *xfers = g_list_copy(purple_xfers_get_all());
+    GList *l;
+    for (l = xfers; l != NULL; l = l->next)
+    {
+        PurpleXfer *xfer = l->data;
+        if ((purple_xfer_get_account(xfer) == account) && (xfer->data != NULL))
+        {
+            purple_xfer_cancel_local(xfer);
+        }
+    }
+    g_list_free(xfers);
+
+    GSList *buddies = purple_find_buddies(account, NULL);
+    GSList *b;
+    for (b = buddies; b != NULL; b = b->next)
+    {
+        purple_buddy_set_protocol_data(b->data, NULL);
+    }
+    g_slist_free(buddies);
+
+    purple_debug_info("toxprpl", "pools: %" G_GSIZE_FORMAT " buddies, %"
+        G_GSIZE_FORMAT " queued messages in %" G_GSIZE_FORMAT " slabs\n",
+        plugin->buddy_pool.in_use, plugin->message_pool.in_use,
+        plugin->buddy_pool.slab_count + plugin->xfer_pool.slab_count +
+        plugin->message_pool.slab_count);
+    toxprpl_pool_destroy(&plugin->buddy_pool);
+    toxprpl_pool_destroy(&plugin->xfer_pool);
+    toxprpl_pool_destroy(&plugin->message_pool);
+    toxprpl_pool_destroy(&plugin->group_pool);
+    toxprpl_friends_free(&plugin->friends);
+    toxprpl_bootstrap_forget(plugin);
+    g_array_free(plugin->bootstrap_tried, TRUE);
+
+    purple_debug_info("toxprpl", "scratch arena: %" G_GUINT64_FORMAT
+        " allocations, %" G_GUINT64_FORMAT " heap blocks, %" G_GSIZE_FORMAT
+        " bytes high water\n", plugin->scratch.allocs,
+        plugin->scratch.heap_allocs, plugin->scratch.high_water);
+    toxprpl_arena_free_blocks(&plugin->scratch);
+
     purple_debug_info("toxprpl", "shutting down\n");
     purple_connection_set_protocol_data(gc, NULL);
     tox_kill(plugin->tox);
     g_free(plugin);
 }
 
+// returns TRUE if message contains neither tags nor entities nor the
+// whitespace that purple_markup_strip_html() turns into spaces, in which case
+// stripping the markup would not change it. length is only set then.
+static gboolean toxprpl_is_plain_text(const char *message, size_t *length)
+{
+    size_t n = strcspn(message, "<&\n\t\r\v\f");
+    if (message[n] != '\0')
+    {
+        return FALSE;
+    }
+    *length = n;
+    return TRUE;
+}
+
+// turns an outgoing message into the plain text that is sent to the friend
+// and tells whether it is a /me action. plain text messages are not copied,
+// the result then points into message and *buffer stays NULL. otherwise the
+// result lives in *buffer, which the caller must g_free()
+static const char *toxprpl_prepare_message(const char *message, char **buffer,
+                                           uint32_t *length, gboolean *action)
+{
+    size_t plain_length;
+
+    *buffer = NULL;
+    if (toxprpl_is_plain_text(message, &plain_length))
+    {
+        *action = g_ascii_strncasecmp(message, "/me ", 4) == 0;
+        if (*action)
+        {
+            message += 4;
+            plain_length -= 4;
+        }
+        *length = (uint32_t)plain_length;
+        return message;
+    }
+
+    *buffer = purple_markup_strip_html(message);
+    *action = purple_message_meify(*buffer, -1);
+    *length = (uint32_t)strlen(*buffer);
+    return *buffer;
+}
+
 /**
  * This PRPL function should return a positive value on success.
  * If the message is too big to be sent, return -E2BIG.  If
@@ -1291,10 +5690,10 @@ static void toxprpl_close(PurpleConnection *gc)
 static int toxprpl_send_im(PurpleConnection *gc, const char *who,
         const char *message, PurpleMessageFlags flags)
 {
-    const char *from_username = gc->account->username;
+    gint64 start G_GNUC_UNUSED = toxprpl_probe_time(send__im);
 
-    purple_debug_info("toxprpl", "sending message from %s to %s\n",
-            from_username, who);
+    toxprpl_debug("sending message from %s to %s\n",
+            gc->account->username, who);
 
     int message_sent = -999;
 
@@ -1308,213 +5707,679 @@ static int toxprpl_send_im(PurpleConnection *gc, const char *who,
     toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
     if (buddy_data == NULL)
     {
-         purple_debug_info("toxprpl", "Can't send message because tox friend number is unknown\n");
-        return message_sent;
+         purple_debug_info("toxprpl", "Can't send message because tox friend number is unknown\n");
+        return message_sent;
+    }
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    char *no_html = NULL;
+    gboolean action;
+    uint32_t length;
+    const char *text = toxprpl_prepare_message(message, &no_html, &length,
+                                               &action);
+    if (length == 0)
+    {
+        // markup only, nothing left once it is stripped
+        purple_debug_info("toxprpl", "Not sending an empty message to %s\n",
+                          who);
+        g_free(no_html);
+        return -EINVAL;
+    }
+
+    // messages queued earlier must go out first, so only try the core
+    // directly if nothing is pending for this friend
+    uint32_t accepted = 0;
+    if (toxprpl_offline_queue_depth(plugin, buddy->name) == 0)
+    {
+        accepted = toxprpl_tox_send(plugin, buddy_data->tox_friendlist_number,
+                                    text, length, action);
+    }
+
+    if (accepted == length)
+    {
+        message_sent = 1;
+    }
+    else
+    {
+        // queue whatever the core did not take, this may be the tail of a
+        // long message
+        GOfflineMessage *msg = toxprpl_pool_new0(&plugin->message_pool,
+                                                 GOfflineMessage);
+        msg->message = g_strndup(text + accepted, length - accepted);
+        msg->length = length - accepted;
+        msg->mtime = time(NULL);
+        msg->action = action;
+        if (toxprpl_offline_push(plugin, buddy->name, msg, TRUE))
+        {
+            message_sent = 1;
+        }
+    }
+
+    toxprpl_probe4(send__im, buddy_data->tox_friendlist_number, length,
+                   accepted, toxprpl_probe_time(send__im) - start);
+    g_free(no_html);
+    return message_sent;
+}
+
+static GList *toxprpl_chat_info(PurpleConnection *gc)
+{
+    // rooms have no settings, invites carry their own components
+    return NULL;
+}
+
+static char *toxprpl_get_chat_name(GHashTable *components)
+{
+    return g_strdup(g_hash_table_lookup(components, "name"));
+}
+
+// joins the group of an invite, without one a new group is created
+static void toxprpl_join_chat(PurpleConnection *gc, GHashTable *components)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    const char *friend = g_hash_table_lookup(components, "friend");
+    const char *key = g_hash_table_lookup(components, "key");
+    int groupnumber;
+    if ((friend != NULL) && (key != NULL))
+    {
+        if (strlen(key) != TOX_CLIENT_ID_SIZE * 2)
+        {
+            purple_debug_info("toxprpl", "Invalid group key %s\n", key);
+            purple_serv_got_join_chat_failed(gc, components);
+            return;
+        }
+        unsigned char *bin_key = toxprpl_hex_string_to_data(key);
+        groupnumber = tox_join_groupchat(plugin->tox, atoi(friend), bin_key);
+        free(bin_key);
+    }
+    else
+    {
+        groupnumber = tox_add_groupchat(plugin->tox);
+    }
+
+    if (groupnumber < 0)
+    {
+        purple_debug_info("toxprpl", "Could not join group chat\n");
+        purple_serv_got_join_chat_failed(gc, components);
+        return;
+    }
+
+    const char *name = g_hash_table_lookup(components, "name");
+    gchar *fallback = g_strdup_printf(_("Group chat %d"), groupnumber);
+    purple_debug_info("toxprpl", "joined group chat %d\n", groupnumber);
+    toxprpl_group_open(gc, plugin, groupnumber,
+                       name != NULL ? name : fallback);
+    g_free(fallback);
+}
+
+static void toxprpl_chat_invite(PurpleConnection *gc, int id,
+                                const char *message, const char *who)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    PurpleAccount *account = purple_connection_get_account(gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, who);
+    toxprpl_buddy_data *buddy_data = buddy != NULL ?
+        purple_buddy_get_protocol_data(buddy) : NULL;
+    if ((buddy_data == NULL) ||
+        (tox_invite_friend(plugin->tox, buddy_data->tox_friendlist_number,
+                           id) < 0))
+    {
+        PurpleConversation *conv = purple_find_chat(gc, id);
+        gchar *msg = g_strdup_printf(_("Could not invite %s"), who);
+        if (conv != NULL)
+        {
+            purple_conversation_write(conv, NULL, msg, PURPLE_MESSAGE_ERROR,
+                                      time(NULL));
+        }
+        purple_debug_info("toxprpl", "%s to group %d\n", msg, id);
+        g_free(msg);
+    }
+}
+
+static void toxprpl_chat_leave(PurpleConnection *gc, int id)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    toxprpl_group *group = g_hash_table_lookup(plugin->groups,
+                                               GINT_TO_POINTER(id));
+    if (group == NULL)
+    {
+        return;
+    }
+    tox_del_groupchat(plugin->tox, id);
+    g_hash_table_remove(plugin->groups, GINT_TO_POINTER(id));
+    toxprpl_group_free(plugin, group);
+}
+
+static gboolean toxprpl_group_send_piece(toxprpl_plugin_data *plugin,
+                                         int groupnumber, uint8_t *piece,
+                                         uint32_t piece_len, gboolean action)
+{
+    int ret = action ?
+        tox_group_action_send(plugin->tox, groupnumber, piece,
+                              piece_len + 1) :
+        tox_group_message_send(plugin->tox, groupnumber, piece,
+                               piece_len + 1);
+    return ret >= 0;
+}
+
+// our own messages are not written to the conversation here, the core
+// hands them back like the messages of everybody else
+static int toxprpl_chat_send(PurpleConnection *gc, int id,
+                             const char *message, PurpleMessageFlags flags)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin != NULL, -ENOTCONN);
+    if (g_hash_table_lookup(plugin->groups, GINT_TO_POINTER(id)) == NULL)
+    {
+        return -EINVAL;
+    }
+
+    char *no_html = NULL;
+    gboolean action;
+    uint32_t length;
+    const char *text = toxprpl_prepare_message(message, &no_html, &length,
+                                               &action);
+    if (length == 0)
+    {
+        g_free(no_html);
+        return -EINVAL;
+    }
+    uint32_t offset = toxprpl_send_pieces(plugin, id, text, length, action,
+                                          toxprpl_group_send_piece);
+    g_free(no_html);
+
+    if (offset < length)
+    {
+        // nobody in the room, or the core could not take it
+        purple_debug_info("toxprpl", "Could not send to group %d\n", id);
+        return -ENOTCONN;
+    }
+    return 0;
+}
+
+static const char *toxprpl_add_friend_strerror(int ret)
+{
+    switch (ret)
+    {
+        case TOX_FAERR_TOOLONG:
+            return "Message too long";
+        case TOX_FAERR_NOMESSAGE:
+            return "Missing request message";
+        case TOX_FAERR_OWNKEY:
+            return "You're trying to add yourself as a friend";
+        case TOX_FAERR_ALREADYSENT:
+            return "Friend request already sent";
+        case TOX_FAERR_BADCHECKSUM:
+            return "Can't add friend: bad checksum in ID";
+        case TOX_FAERR_SETNEWNOSPAM:
+            return "Can't add friend: wrong nospam ID";
+        case TOX_FAERR_NOMEM:
+            return "Could not allocate memory for friendlist";
+        case TOXPRPL_FAERR_INVALID_ID:
+            return "Invalid buddy ID given (must be 76 characters long)";
+        default:
+            return "Error adding friend";
+    }
+}
+
+static int toxprpl_tox_add_friend(Tox *tox, PurpleConnection *gc,
+                                 const char *buddy_key,
+                                 gboolean sendrequest,
+                                 const char *message)
+{
+    unsigned char *bin_key = toxprpl_hex_string_to_data(buddy_key);
+    int ret;
+
+    if (sendrequest == TRUE)
+    {
+        if ((message == NULL) || (strlen(message) == 0))
+        {
+            message = DEFAULT_REQUEST_MESSAGE;
+        }
+        ret = tox_add_friend(tox, bin_key, (uint8_t *)message,
+                            (uint16_t)strlen(message) + 1);
+    }
+    else
+    {
+        ret = tox_add_friend_norequest(tox, bin_key);
+    }
+
+    g_free(bin_key);
+
+    if (ret < 0)
+    {
+        purple_notify_error(gc, _("Error"), toxprpl_add_friend_strerror(ret),
+                            NULL);
+    }
+    else
+    {
+        purple_debug_info("toxprpl", "Friend %s added as %d\n", buddy_key, ret);
+    }
+
+    return ret;
+}
+
+// adds the friend without saving the account, callers save once per batch
+static gboolean toxprpl_accept_friend(PurpleConnection *gc,
+                                      const gchar *buddy_key)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    PurpleAccount *account = purple_connection_get_account(gc);
+
+    if (purple_find_buddy(account, buddy_key) != NULL)
+    {
+        return FALSE;
+    }
+
+    int ret = toxprpl_tox_add_friend(plugin->tox, gc, buddy_key, FALSE, NULL);
+    if (ret < 0)
+    {
+        // error dialogs handled in toxprpl_tox_add_friend()
+        return FALSE;
+    }
+
+    toxprpl_sync_add_buddy(account, plugin, ret);
+    return TRUE;
+}
+
+static gint toxprpl_friend_request_compare(gconstpointer a, gconstpointer b)
+{
+    const toxprpl_friend_request *ra = a;
+    const toxprpl_friend_request *rb = b;
+    if (ra->received != rb->received)
+    {
+        return ra->received < rb->received ? -1 : 1;
+    }
+    return strcmp(ra->buddy_key, rb->buddy_key);
+}
+
+static void toxprpl_inbox_review_done(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    plugin->inbox_dialog = NULL;
+    g_ptr_array_free(plugin->inbox_dialog_keys, TRUE);
+    plugin->inbox_dialog_keys = NULL;
+    if (plugin->inbox_dirty)
+    {
+        toxprpl_inbox_save(plugin);
     }
-    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
-    char *no_html = purple_markup_strip_html(message);
 
-    if (purple_message_meify(no_html, -1))
+    // requests that came in while the dialog was open
+    if (plugin->inbox_unseen)
     {
-        if (tox_send_action(plugin->tox, buddy_data->tox_friendlist_number,
-                                    (uint8_t *)no_html, strlen(message)+1) == 1)
-        {
-            message_sent = 1;
-        }
+        toxprpl_inbox_schedule_review(gc);
     }
-    else
+}
+
+static void toxprpl_inbox_review_apply_cb(PurpleConnection *gc,
+                                          PurpleRequestFields *fields)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    gboolean accept = purple_request_fields_get_choice(fields, "action") == 0;
+    PurpleRequestField *field = purple_request_fields_get_field(fields,
+                                                                "requests");
+    GList *l;
+    guint accepted = 0;
+    guint handled = 0;
+
+    for (l = purple_request_field_list_get_selected(field); l != NULL;
+         l = l->next)
     {
-        if (tox_send_message(plugin->tox, buddy_data->tox_friendlist_number,
-                                   (uint8_t *)no_html, strlen(message)+1) != 0)
+        const gchar *buddy_key = purple_request_field_list_get_data(field,
+                                                                    l->data);
+        if (accept && toxprpl_accept_friend(gc, buddy_key))
         {
-            message_sent = 1;
+            accepted++;
         }
+        toxprpl_inbox_remove(plugin, buddy_key);
+        handled++;
     }
-    if (no_html)
+
+    purple_debug_info("toxprpl", "%s %u friend requests, %u added\n",
+                      accept ? "accepted" : "rejected", handled, accepted);
+    if (accepted > 0)
     {
-        free(no_html);
+        // one save for the whole batch
+        toxprpl_save_account(purple_connection_get_account(gc), plugin->tox);
     }
-    return message_sent;
+    toxprpl_inbox_review_done(gc);
 }
 
-static int toxprpl_tox_add_friend(Tox *tox, PurpleConnection *gc,
-                                 const char *buddy_key,
-                                 gboolean sendrequest,
-                                 const char *message)
+static void toxprpl_inbox_review_later_cb(PurpleConnection *gc,
+                                          PurpleRequestFields *fields)
 {
-    unsigned char *bin_key = toxprpl_hex_string_to_data(buddy_key);
-    int ret;
+    toxprpl_inbox_review_done(gc);
+}
 
-    if (sendrequest == TRUE)
-    {
-        if ((message == NULL) || (strlen(message) == 0))
-        {
-            message = DEFAULT_REQUEST_MESSAGE;
-        }
-        ret = tox_add_friend(tox, bin_key, (uint8_t *)message,
-                            (uint16_t)strlen(message) + 1);
-    }
-    else
+static void toxprpl_inbox_review(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    if (plugin->inbox_dialog != NULL)
     {
-        ret = tox_add_friend_norequest(tox, bin_key);
+        return;
     }
 
-    g_free(bin_key);
-    const char *msg;
-    switch (ret)
+    guint count = g_hash_table_size(plugin->inbox);
+    if (count == 0)
     {
-        case TOX_FAERR_TOOLONG:
-            msg = "Message too long";
-            break;
-        case TOX_FAERR_NOMESSAGE:
-            msg = "Missing request message";
-            break;
-        case TOX_FAERR_OWNKEY:
-            msg = "You're trying to add yourself as a friend";
-            break;
-        case TOX_FAERR_ALREADYSENT:
-            msg = "Friend request already sent";
-            break;
-        case TOX_FAERR_BADCHECKSUM:
-            msg = "Can't add friend: bad checksum in ID";
-            break;
-        case TOX_FAERR_SETNEWNOSPAM:
-            msg = "Can't add friend: wrong nospam ID";
-            break;
-        case TOX_FAERR_NOMEM:
-            msg = "Could not allocate memory for friendlist";
-            break;
-        case TOX_FAERR_UNKNOWN:
-            msg = "Error adding friend";
-            break;
-        default:
-            break;
+        return;
     }
 
-    if (ret < 0)
+    PurpleRequestFields *fields = purple_request_fields_new();
+    PurpleRequestFieldGroup *group = purple_request_field_group_new(NULL);
+    purple_request_fields_add_group(fields, group);
+
+    PurpleRequestField *field = purple_request_field_list_new("requests",
+                                                              NULL);
+    purple_request_field_list_set_multi_select(field, TRUE);
+
+    // the dialog keeps its own copy of the keys, the inbox may change while
+    // it is open
+    plugin->inbox_dialog_keys = g_ptr_array_new_with_free_func(g_free);
+    GList *requests = g_list_sort(g_hash_table_get_values(plugin->inbox),
+                                  toxprpl_friend_request_compare);
+    GList *l;
+    for (l = requests; l != NULL; l = l->next)
     {
-        purple_notify_error(gc, _("Error"), msg, NULL);
+        toxprpl_friend_request *request = l->data;
+        gchar *buddy_key = g_strdup(request->buddy_key);
+        g_ptr_array_add(plugin->inbox_dialog_keys, buddy_key);
+
+        gchar *item;
+        if (request->count > 1)
+        {
+            item = g_strdup_printf("%s (%ux): %s", buddy_key, request->count,
+                                   request->message);
+        }
+        else
+        {
+            item = g_strdup_printf("%s: %s", buddy_key, request->message);
+        }
+        purple_request_field_list_add(field, item, buddy_key);
+        purple_request_field_list_add_selected(field, item);
+        g_free(item);
     }
-    else
+    g_list_free(requests);
+    purple_request_field_group_add_field(group, field);
+
+    field = purple_request_field_choice_new("action", _("Selected requests"),
+                                            0);
+    purple_request_field_choice_add(field, _("Accept"));
+    purple_request_field_choice_add(field, _("Reject"));
+    purple_request_field_group_add_field(group, field);
+
+    gchar *primary = g_strdup_printf(_("%u pending friend requests"), count);
+    gchar *secondary = NULL;
+    if (plugin->inbox_dropped > 0)
     {
-        purple_debug_info("toxprpl", "Friend %s added as %d\n", buddy_key, ret);
-        // save account so buddy is not lost in case pidgin does not exit
-        // cleanly
-        PurpleAccount *account = purple_connection_get_account(gc);
-        toxprpl_save_account(account, tox);
+        secondary = g_strdup_printf(_("%u more requests were dropped because "
+                                      "too many came in at once."),
+                                    plugin->inbox_dropped);
     }
+    plugin->inbox_dropped = 0;
+    plugin->inbox_unseen = FALSE;
 
-    return ret;
+    PurpleAccount *account = purple_connection_get_account(gc);
+    plugin->inbox_dialog = purple_request_fields(gc, _("Friend requests"),
+            primary, secondary, fields,
+            _("_Apply"), G_CALLBACK(toxprpl_inbox_review_apply_cb),
+            _("_Later"), G_CALLBACK(toxprpl_inbox_review_later_cb),
+            account, NULL, NULL, gc);
+    g_free(primary);
+    g_free(secondary);
 }
 
-static void toxprpl_do_not_add_to_buddylist(toxprpl_accept_friend_data *data)
+static gboolean toxprpl_inbox_review_timeout(gpointer data)
 {
-    g_free(data->buddy_key);
-    g_free(data);
+    PurpleConnection *gc = (PurpleConnection *)data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin != NULL, FALSE);
+
+    plugin->inbox_timer = 0;
+    if (plugin->inbox_dirty)
+    {
+        toxprpl_inbox_save(plugin);
+    }
+    toxprpl_inbox_review(gc);
+    return FALSE;
 }
 
-static void toxprpl_add_to_buddylist(toxprpl_accept_friend_data *data)
+static void toxprpl_inbox_schedule_review(PurpleConnection *gc)
 {
-    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(data->gc);
-
-    int ret = toxprpl_tox_add_friend(plugin->tox, data->gc, data->buddy_key,
-                                    FALSE, NULL);
-    if (ret < 0)
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if ((plugin->inbox_timer == 0) && (plugin->inbox_dialog == NULL))
     {
-        g_free(data->buddy_key);
-        g_free(data);
-        // error dialogs handled in toxprpl_tox_add_friend()
-        return;
+        plugin->inbox_timer = purple_timeout_add_seconds(
+            TOXPRPL_INBOX_REVIEW_DELAY, toxprpl_inbox_review_timeout, gc);
     }
+}
 
-    PurpleAccount *account = purple_connection_get_account(data->gc);
-
-    uint8_t alias[TOX_MAX_NAME_LENGTH + 1];
+// a friend address is the client id followed by nospam and checksum
+static gboolean toxprpl_is_valid_address(const char *name)
+{
+    return (strlen(name) == (TOX_FRIEND_ADDRESS_SIZE * 2)) &&
+           (strspn(name, "0123456789abcdefABCDEF") ==
+                (TOX_FRIEND_ADDRESS_SIZE * 2));
+}
 
-    PurpleBuddy *buddy;
-    int rc = tox_get_name(plugin->tox, ret, alias);
-    alias[TOX_MAX_NAME_LENGTH] = '\0';
-    if ((rc == 0) && (strlen((const char *)alias) > 0))
+/*
+ * sends friend requests to all buddies in one pass and saves the account
+ * once. returns the result for each buddy in list order: the new friend
+ * number or a TOX_FAERR_* / TOXPRPL_FAERR_INVALID_ID error. buddies that
+ * could not be added are removed from the buddy list again, so the list
+ * must not be used afterwards
+ */
+static GArray *toxprpl_add_buddies_batch(PurpleConnection *gc, GList *buddies,
+                                         const char *msg)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    guint count = g_list_length(buddies);
+    GArray *results = g_array_sized_new(FALSE, TRUE, sizeof(int), count);
+    g_array_set_size(results, count);
+    guint added = 0;
+    guint i;
+    GList *l;
+
+    // validate all ids before the friend list is touched
+    for (l = buddies, i = 0; l != NULL; l = l->next, i++)
     {
-        purple_debug_info("toxprpl", "Got friend alias %s\n", alias);
-        buddy = purple_buddy_new(account, data->buddy_key, (const char*)alias);
+        PurpleBuddy *buddy = l->data;
+        buddy->name = g_strstrip(buddy->name);
+        if (!toxprpl_is_valid_address(buddy->name))
+        {
+            g_array_index(results, int, i) = TOXPRPL_FAERR_INVALID_ID;
+        }
     }
-    else
+
+    if ((msg == NULL) || (strlen(msg) == 0))
     {
-        purple_debug_info("toxprpl", "Adding [%s]\n", data->buddy_key);
-        buddy = purple_buddy_new(account, data->buddy_key, NULL);
+        msg = DEFAULT_REQUEST_MESSAGE;
     }
 
-    toxprpl_buddy_data *buddy_data = g_new0(toxprpl_buddy_data, 1);
-    buddy_data->tox_friendlist_number = ret;
-    purple_buddy_set_protocol_data(buddy, buddy_data);
-    purple_blist_add_buddy(buddy, NULL, NULL, NULL);
-    TOX_USERSTATUS userstatus = tox_get_user_status(plugin->tox, ret);
-    purple_debug_info("toxprpl", "Friend %s has status %d\n",
-            data->buddy_key, userstatus);
-    purple_prpl_got_user_status(account, data->buddy_key,
-        toxprpl_statuses[toxprpl_get_status_index(plugin->tox,ret,userstatus)].id,
-        NULL);
+    for (l = buddies, i = 0; l != NULL; l = l->next, i++)
+    {
+        PurpleBuddy *buddy = l->data;
+        int *result = &g_array_index(results, int, i);
+        if (*result == 0)
+        {
+            unsigned char *bin_key = toxprpl_hex_string_to_data(buddy->name);
+            *result = tox_add_friend(plugin->tox, bin_key, (uint8_t *)msg,
+                                     (uint16_t)strlen(msg) + 1);
+            g_free(bin_key);
+        }
 
-    g_free(data->buddy_key);
-    g_free(data);
-}
+        if (*result < 0)
+        {
+            purple_debug_info("toxprpl", "adding buddy %s failed (%d)\n",
+                              buddy->name, *result);
+            continue;
+        }
+        added++;
 
-static void toxprpl_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
-        PurpleGroup *group, const char *msg)
-{
-    purple_debug_info("toxprpl", "adding %s to buddy list\n", buddy->name);
+        gchar *cut = g_ascii_strdown(buddy->name, TOX_CLIENT_ID_SIZE * 2);
+        purple_debug_info("toxprpl", "converted %s to %s\n", buddy->name, cut);
+        purple_blist_rename_buddy(buddy, cut);
+        toxprpl_inbox_remove(plugin, cut);
+        g_free(cut);
+
+        toxprpl_friend_update(&plugin->friends, plugin->tox, *result);
+        toxprpl_buddy_attach(plugin, buddy, *result);
+        toxprpl_query_buddy_info((gpointer)buddy, (gpointer)gc);
+    }
 
-    buddy->name = g_strstrip(buddy->name);
-    if (strlen(buddy->name) != (TOX_FRIEND_ADDRESS_SIZE * 2))
+    // one save for the whole batch so buddies are not lost in case pidgin
+    // does not exit cleanly
+    if (added > 0)
     {
-        purple_notify_error(gc, _("Error"),
-                            _("Invalid buddy ID given (must be 76 characters "
-                              "long)"), NULL);
-        purple_blist_remove_buddy(buddy);
-        return;
+        PurpleAccount *account = purple_connection_get_account(gc);
+        toxprpl_save_account(account, plugin->tox);
     }
 
-    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
-    int ret = toxprpl_tox_add_friend(plugin->tox, gc, buddy->name, TRUE, msg);
-    if (ret < 0)
+    if (added == count)
     {
-        purple_debug_info("toxprpl", "adding buddy %s failed (%d)\n",
-                          buddy->name, ret);
-        purple_blist_remove_buddy(buddy);
-        return;
+        return results;
     }
 
-    // save account so buddy is not lost in case pidgin does not exit cleanly
-    PurpleAccount *account = purple_connection_get_account(gc);
-    toxprpl_save_account(account, plugin->tox);
+    // one dialog for all failures, removing the buddies has to come last
+    GString *details = g_string_new(NULL);
+    guint failed = 0;
+    int last_error = 0;
+    for (l = buddies, i = 0; l != NULL; l = l->next, i++)
+    {
+        PurpleBuddy *buddy = l->data;
+        int result = g_array_index(results, int, i);
+        if (result >= 0)
+        {
+            continue;
+        }
+
+        if (failed++ < 20)
+        {
+            g_string_append_printf(details, "%s: %s\n", buddy->name,
+                                   toxprpl_add_friend_strerror(result));
+        }
+        last_error = result;
+        purple_blist_remove_buddy(buddy);
+    }
 
-    gchar *cut = g_ascii_strdown(buddy->name, TOX_CLIENT_ID_SIZE * 2 + 1);
-    cut[TOX_CLIENT_ID_SIZE * 2] = '\0';
-    purple_debug_info("toxprpl", "converted %s to %s\n", buddy->name, cut);
-    purple_blist_rename_buddy(buddy, cut);
-    g_free(cut);
-    // buddy data will be added by the query_buddy_info function
-    toxprpl_query_buddy_info((gpointer)buddy, (gpointer)gc);
+    if (count == 1)
+    {
+        purple_notify_error(gc, _("Error"),
+                            toxprpl_add_friend_strerror(last_error), NULL);
+    }
+    else
+    {
+        if (failed > 20)
+        {
+            g_string_append_printf(details, "... (%u more)\n", failed - 20);
+        }
+        gchar *primary = g_strdup_printf(_("Could not add %u of %u buddies"),
+                                         failed, count);
+        purple_notify_error(gc, _("Error"), primary, details->str);
+        g_free(primary);
+    }
+    g_string_free(details, TRUE);
+    return results;
 }
 
-static void toxprpl_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
-        PurpleGroup *group)
+// deletes all buddies from the friend list and saves the account once.
+// returns 0 or -1 for each buddy in list order
+static GArray *toxprpl_remove_buddies_batch(PurpleConnection *gc,
+                                            GList *buddies)
 {
-    purple_debug_info("toxprpl", "removing buddy %s\n", buddy->name);
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
-    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
-    if (buddy_data != NULL)
+    guint count = g_list_length(buddies);
+    GArray *results = g_array_sized_new(FALSE, TRUE, sizeof(int), count);
+    g_array_set_size(results, count);
+    guint removed = 0;
+    guint i;
+    GList *l;
+
+    for (l = buddies, i = 0; l != NULL; l = l->next, i++)
     {
+        PurpleBuddy *buddy = l->data;
+        purple_debug_info("toxprpl", "removing buddy %s\n", buddy->name);
+        toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+        if (buddy_data == NULL)
+        {
+            g_array_index(results, int, i) = -1;
+            continue;
+        }
+
         purple_debug_info("toxprpl", "removing tox friend #%d\n",
                           buddy_data->tox_friendlist_number);
-        tox_del_friend(plugin->tox, buddy_data->tox_friendlist_number);
+        g_array_index(results, int, i) = tox_del_friend(plugin->tox,
+            buddy_data->tox_friendlist_number);
+        if (g_array_index(results, int, i) == 0)
+        {
+            int fnum = buddy_data->tox_friendlist_number;
+            toxprpl_friend_remove(&plugin->friends, fnum);
+            // a friend added later may get the same number
+            toxprpl_offline_drop(plugin, buddy->name);
+            toxprpl_typing_reset(plugin, fnum);
+            toxprpl_receipt_expire(gc, plugin, fnum);
+            removed++;
+        }
+    }
 
-        // save account to make sure buddy stays deleted in case pidgin does
-        // not exit cleanly
+    // save account to make sure buddies stay deleted in case pidgin does
+    // not exit cleanly
+    if (removed > 0)
+    {
         PurpleAccount *account = purple_connection_get_account(gc);
         toxprpl_save_account(account, plugin->tox);
     }
+    return results;
+}
+
+static void toxprpl_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
+        PurpleGroup *group, const char *msg)
+{
+    purple_debug_info("toxprpl", "adding %s to buddy list\n", buddy->name);
+
+    GList *buddies = g_list_prepend(NULL, buddy);
+    g_array_free(toxprpl_add_buddies_batch(gc, buddies, msg), TRUE);
+    g_list_free(buddies);
+}
+
+static void toxprpl_add_buddies_with_invite(PurpleConnection *gc,
+        GList *buddies, GList *groups, const char *msg)
+{
+    purple_debug_info("toxprpl", "adding %u buddies to buddy list\n",
+                      g_list_length(buddies));
+    g_array_free(toxprpl_add_buddies_batch(gc, buddies, msg), TRUE);
+}
+
+static void toxprpl_add_buddies(PurpleConnection *gc, GList *buddies,
+        GList *groups)
+{
+    toxprpl_add_buddies_with_invite(gc, buddies, groups, NULL);
+}
+
+static void toxprpl_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
+        PurpleGroup *group)
+{
+    GList *buddies = g_list_prepend(NULL, buddy);
+    g_array_free(toxprpl_remove_buddies_batch(gc, buddies), TRUE);
+    g_list_free(buddies);
+}
+
+static void toxprpl_remove_buddies(PurpleConnection *gc, GList *buddies,
+        GList *groups)
+{
+    purple_debug_info("toxprpl", "removing %u buddies\n",
+                      g_list_length(buddies));
+    g_array_free(toxprpl_remove_buddies_batch(gc, buddies), TRUE);
 }
 
 static void toxprpl_show_id_dialog_closed(gchar *id)
@@ -1656,6 +6521,21 @@ static void toxprpl_export_account_dialog(PurplePluginAction *action)
     g_free(id);
 }
 
+static void toxprpl_action_review_requests(PurplePluginAction *action)
+{
+    PurpleConnection *gc = (PurpleConnection*)action->context;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    if (g_hash_table_size(plugin->inbox) == 0)
+    {
+        purple_notify_info(gc, _("Friend requests"),
+                           _("There are no pending friend requests."), NULL);
+        return;
+    }
+    toxprpl_inbox_review(gc);
+}
+
 static GList *toxprpl_account_actions(PurplePlugin *plugin, gpointer context)
 {
     purple_debug_info("toxprpl", "setting up account actions\n");
@@ -1671,6 +6551,10 @@ static GList *toxprpl_account_actions(PurplePlugin *plugin, gpointer context)
              toxprpl_action_set_nick_dialog);
     actions = g_list_append(actions, action);
 
+    action = purple_plugin_action_new(_("Friend requests..."),
+             toxprpl_action_review_requests);
+    actions = g_list_append(actions, action);
+
     action = purple_plugin_action_new(_("Export account data..."),
             toxprpl_export_account_dialog);
     actions = g_list_append(actions, action);
@@ -1681,14 +6565,66 @@ static void toxprpl_free_buddy(PurpleBuddy *buddy)
 {
     if (buddy->proto_data)
     {
+        // buddy data only exists while connected, toxprpl_close() drops it
+        PurpleConnection *gc = purple_account_get_connection(buddy->account);
+        toxprpl_plugin_data *plugin = gc == NULL ? NULL :
+            purple_connection_get_protocol_data(gc);
+        toxprpl_return_if_fail(plugin != NULL);
         toxprpl_buddy_data *buddy_data = buddy->proto_data;
-        g_free(buddy_data);
+        if (toxprpl_friend_buddy(plugin,
+                buddy_data->tox_friendlist_number) == buddy)
+        {
+            plugin->friends.buddies[buddy_data->tox_friendlist_number] = NULL;
+        }
+        toxprpl_pool_free(&plugin->buddy_pool, buddy->proto_data);
+        buddy->proto_data = NULL;
     }
 }
 
 static gboolean toxprpl_offline_message(const PurpleBuddy *buddy)
 {
-    return FALSE;
+    // messages to offline friends are queued and sent when they come online
+    return TRUE;
+}
+
+static void toxprpl_tooltip_text(PurpleBuddy *buddy,
+                                 PurpleNotifyUserInfo *user_info,
+                                 gboolean full)
+{
+    PurpleAccount *account = purple_buddy_get_account(buddy);
+    PurpleConnection *gc = purple_account_get_connection(account);
+    toxprpl_return_if_fail(gc != NULL);
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->offline_queues != NULL);
+
+    guint depth = toxprpl_offline_queue_depth(plugin, buddy->name);
+    if (depth > 0)
+    {
+        gchar *value = g_strdup_printf("%u", depth);
+        purple_notify_user_info_add_pair(user_info, _("Queued messages"),
+                                         value);
+        g_free(value);
+    }
+
+    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+    int fnum = buddy_data == NULL ? -1 : buddy_data->tox_friendlist_number;
+    if (toxprpl_friend_on_lan(plugin, fnum))
+    {
+        // anyone on the LAN can send the announcement of a friend
+        purple_notify_user_info_add_pair(user_info, _("Network"),
+            _("Announced on the local network (not verified)"));
+    }
+    if (toxprpl_friend_known(&plugin->friends, fnum) &&
+        !plugin->friends.connection[fnum] &&
+        (plugin->friends.last_seen[fnum] != 0))
+    {
+        // only known for friends that were online since the login
+        gchar *value = purple_str_seconds_to_string(
+            time(NULL) - plugin->friends.last_seen[fnum]);
+        purple_notify_user_info_add_pair(user_info, _("Offline for"), value);
+        g_free(value);
+    }
 }
 
 static gboolean toxprpl_can_receive_file(PurpleConnection *gc, const char *who)
@@ -1710,8 +6646,9 @@ static gboolean toxprpl_can_receive_file(PurpleConnection *gc, const char *who)
     toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
     toxprpl_return_val_if_fail(buddy_data != NULL, FALSE);
 
-    return tox_get_friend_connection_status(plugin->tox,
-        buddy_data->tox_friendlist_number) == 1;
+    int fnum = buddy_data->tox_friendlist_number;
+    return toxprpl_friend_known(&plugin->friends, fnum) &&
+           plugin->friends.connection[fnum];
 }
 
 static gboolean toxprpl_xfer_idle_write(toxprpl_idle_write_data *data)
@@ -1726,6 +6663,13 @@ static gboolean toxprpl_xfer_idle_write(toxprpl_idle_write_data *data)
             bytes_remaining > 0 &&
             !purple_xfer_is_canceled(data->xfer))
         {
+            toxprpl_xfer_data *xfer_data = data->xfer->data;
+            int friendnumber = xfer_data->friendnumber;
+            PurpleConnection *gc = purple_account_get_connection(
+                purple_xfer_get_account(data->xfer));
+            toxprpl_plugin_data *plugin = gc == NULL ? NULL :
+                purple_connection_get_protocol_data(gc);
+            gint64 span = toxprpl_span_begin(plugin);
             gssize wrote = purple_xfer_write(data->xfer, data->offset, bytes_remaining);
             if (wrote > 0)
             {
@@ -1733,6 +6677,8 @@ static gboolean toxprpl_xfer_idle_write(toxprpl_idle_write_data *data)
                 purple_xfer_update_progress(data->xfer);
                 data->offset += wrote;
             }
+            toxprpl_span_end(plugin, "xfer_pump", "transfer", span,
+                             friendnumber);
             return TRUE;
         }
         purple_debug_info("toxprpl", "ending file transfer\n");
@@ -1855,6 +6801,10 @@ static gssize toxprpl_xfer_write(const guchar *data, size_t len, PurpleXfer *xfe
         tox_do(xfer_data->tox);
         return -1;
     }
+    toxprpl_trace(TOXPRPL_TRACE_XFER_WRITE, xfer_data->friendnumber,
+                  xfer_data->filenumber, (guint32)len);
+    toxprpl_probe3(xfer__write, xfer_data->friendnumber,
+                   xfer_data->filenumber, len);
     return len;
 }
 
@@ -1878,7 +6828,15 @@ static void toxprpl_xfer_free(PurpleXfer *xfer)
         idle_write_data->running = FALSE;
         xfer_data->idle_write_data = NULL;
     }
-    g_free(xfer_data);
+
+    PurpleConnection *gc = purple_account_get_connection(
+        purple_xfer_get_account(xfer));
+    toxprpl_plugin_data *plugin = gc == NULL ? NULL :
+        purple_connection_get_protocol_data(gc);
+    if (plugin != NULL)
+    {
+        toxprpl_pool_free(&plugin->xfer_pool, xfer_data);
+    }
     xfer->data = NULL;
 }
 
@@ -1933,6 +6891,16 @@ static void toxprpl_xfer_end(PurpleXfer *xfer)
     toxprpl_return_if_fail(xfer != NULL);
     toxprpl_xfer_data *xfer_data = xfer->data;
 
+    PurpleConnection *gc = purple_account_get_connection(
+        purple_xfer_get_account(xfer));
+    toxprpl_plugin_data *plugin = gc == NULL ? NULL :
+        purple_connection_get_protocol_data(gc);
+    if (plugin != NULL)
+    {
+        toxprpl_metric_observe(plugin, TOXPRPL_HISTOGRAM_TRANSFER_SIZE,
+                               purple_xfer_get_bytes_sent(xfer));
+    }
+
     if (purple_xfer_get_type(xfer) == PURPLE_XFER_SEND)
     {
         tox_file_send_control(xfer_data->tox, xfer_data->friendnumber,
@@ -1957,11 +6925,14 @@ static PurpleXfer *toxprpl_new_xfer(PurpleConnection *gc, const gchar *who)
     PurpleAccount *account = purple_connection_get_account(gc);
     toxprpl_return_val_if_fail(account != NULL, NULL);
 
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin != NULL, NULL);
+
     PurpleXfer *xfer = purple_xfer_new(account, PURPLE_XFER_SEND, who);
     toxprpl_return_val_if_fail(xfer != NULL, NULL);
 
-    toxprpl_xfer_data *xfer_data = g_new0(toxprpl_xfer_data, 1);
-    toxprpl_return_val_if_fail(xfer_data != NULL, NULL);
+    toxprpl_xfer_data *xfer_data = toxprpl_pool_new0(&plugin->xfer_pool,
+                                                     toxprpl_xfer_data);
 
     xfer->data = xfer_data;
 
@@ -1985,14 +6956,14 @@ static PurpleXfer* toxprpl_new_xfer_receive(PurpleConnection *gc, const char *wh
     PurpleAccount *account = purple_connection_get_account(gc);
     toxprpl_return_val_if_fail(account != NULL, NULL);
 
+    toxprpl_plugin_data *plugin_data = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin_data != NULL, NULL);
+
     PurpleXfer *xfer = purple_xfer_new(account, PURPLE_XFER_RECEIVE, who);
     toxprpl_return_val_if_fail(xfer != NULL, NULL);
 
-    toxprpl_xfer_data *xfer_data = g_new0(toxprpl_xfer_data, 1);
-    toxprpl_return_val_if_fail(xfer_data != NULL, NULL);
-
-    toxprpl_plugin_data *plugin_data = purple_connection_get_protocol_data(gc);
-    toxprpl_return_val_if_fail(plugin_data != NULL, NULL);
+    toxprpl_xfer_data *xfer_data = toxprpl_pool_new0(&plugin_data->xfer_pool,
+                                                     toxprpl_xfer_data);
 
     xfer_data->tox = plugin_data->tox;
     xfer_data->friendnumber = friendnumber;
@@ -2038,8 +7009,6 @@ static void toxprpl_send_file(PurpleConnection *gc, const char *who, const char
 static unsigned int toxprpl_send_typing(PurpleConnection *gc, const char *who,
     PurpleTypingState state)
 {
-    purple_debug_info("toxprpl", "send_typing\n");
-    
     toxprpl_return_val_if_fail(gc != NULL, 0);
     toxprpl_return_val_if_fail(who != NULL, 0);
     
@@ -2055,24 +7024,43 @@ static unsigned int toxprpl_send_typing(PurpleConnection *gc, const char *who,
     toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
     toxprpl_return_val_if_fail(buddy_data != NULL, 0);
 
-    switch(state)
+    int fnum = buddy_data->tox_friendlist_number;
+    toxprpl_typing_data *typing = g_hash_table_lookup(plugin->typing,
+                                                      GINT_TO_POINTER(fnum));
+    if (typing == NULL)
     {
-        case PURPLE_TYPING:
-            purple_debug_info("toxprpl", "Send typing state: TYPING\n");
-            tox_set_user_is_typing(plugin->tox, buddy_data->tox_friendlist_number, TRUE);
-            break;
+        if (!toxprpl_friend_known(&plugin->friends, fnum) ||
+            !plugin->friends.connection[fnum])
+        {
+            return 0; // nobody to tell
+        }
+        typing = g_new0(toxprpl_typing_data, 1);
+        typing->tox = plugin->tox;
+        typing->friendnumber = fnum;
+        g_hash_table_insert(plugin->typing, GINT_TO_POINTER(fnum), typing);
+    }
 
-        case PURPLE_TYPED:
-            purple_debug_info("toxprpl", "Send typing state: TYPED\n"); /* typing pause */
-            tox_set_user_is_typing(plugin->tox, buddy_data->tox_friendlist_number, FALSE);
-            break;
-        
-        default:
-            purple_debug_info("toxprpl", "Send typing state: NOT_TYPING\n");
-            tox_set_user_is_typing(plugin->tox, buddy_data->tox_friendlist_number, FALSE);
-            break;
+    // PURPLE_TYPED is a typing pause, for the friend it means not typing
+    typing->wanted = (state == PURPLE_TYPING);
+
+    if (typing->wanted)
+    {
+        // started typing: tell right away, unless a pending "stopped"
+        // never went out
+        if (typing->timer != 0)
+        {
+            purple_timeout_remove(typing->timer);
+            typing->timer = 0;
+        }
+        toxprpl_typing_update(typing);
     }
-    
+    else if ((typing->sent != typing->wanted) && (typing->timer == 0))
+    {
+        // stopped typing: wait a moment, the user may continue
+        typing->timer = purple_timeout_add(TOXPRPL_TYPING_COALESCE_MS,
+                                           toxprpl_typing_timeout, typing);
+    }
+
     return 0;
 }
 
@@ -2085,10 +7073,10 @@ static PurplePluginProtocolInfo prpl_info =
     toxprpl_list_icon,                  /* list_icon */
     NULL,                               /* list_emblem */
     NULL,                               /* status_text */
-    NULL,                               /* tooltip_text */
+    toxprpl_tooltip_text,               /* tooltip_text */
     toxprpl_status_types,               /* status_types */
     NULL,                               /* blist_node_menu */
-    NULL,                               /* chat_info */
+    toxprpl_chat_info,                  /* chat_info */
     NULL,                               /* chat_info_defaults */
     toxprpl_login,                      /* login */
     toxprpl_close,                      /* close */
@@ -2100,21 +7088,21 @@ static PurplePluginProtocolInfo prpl_info =
     NULL,                               /* set_idle */
     NULL,                               /* change_passwd */
     NULL,                               /* add_buddy */
-    NULL,                               /* add_buddies */
+    toxprpl_add_buddies,                /* add_buddies */
     toxprpl_remove_buddy,               /* remove_buddy */
-    NULL,                               /* remove_buddies */
+    toxprpl_remove_buddies,             /* remove_buddies */
     NULL,                               /* add_permit */
     NULL,                               /* add_deny */
     NULL,                               /* rem_permit */
     NULL,                               /* rem_deny */
     NULL,                               /* set_permit_deny */
-    NULL,                               /* join_chat */
+    toxprpl_join_chat,                  /* join_chat */
     NULL,                               /* reject_chat */
-    NULL,                               /* get_chat_name */
-    NULL,                               /* chat_invite */
-    NULL,                               /* chat_leave */
+    toxprpl_get_chat_name,              /* get_chat_name */
+    toxprpl_chat_invite,                /* chat_invite */
+    toxprpl_chat_leave,                 /* chat_leave */
     NULL,                               /* chat_whisper */
-    NULL,                               /* chat_send */
+    toxprpl_chat_send,                  /* chat_send */
     NULL,                               /* keepalive */
     NULL,                               /* register_user */
     NULL,                               /* get_cb_info */
@@ -2151,7 +7139,7 @@ static PurplePluginProtocolInfo prpl_info =
     NULL,                               /* set_public_alias */
     NULL,                               /* get_public_alias */
     toxprpl_add_buddy,                  /* add_buddy_with_invite */
-    NULL                                /* add_buddies_with_invite */
+    toxprpl_add_buddies_with_invite     /* add_buddies_with_invite */
 };
 
 static void toxprpl_init(PurplePlugin *plugin)
@@ -2176,6 +7164,49 @@ static void toxprpl_init(PurplePlugin *plugin)
         "dht_server_key", DEFAULT_SERVER_KEY);
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
                                                option);
+
+    option = purple_account_option_bool_new(_("Use IPv6 (dual stack)"),
+                                            "ipv6", FALSE);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_bool_new(
+        _("Discover friends on the local network"), "lan_discovery", FALSE);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_int_new(
+        _("UDP receive buffer in KiB (0 = system default)"), "udp_rcvbuf", 0);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_int_new(
+        _("UDP send buffer in KiB (0 = system default)"), "udp_sndbuf", 0);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_int_new(
+        _("Write statistics every N seconds (0 = off)"), "stats_interval", 0);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_bool_new(
+        _("Record a timing trace (Chrome trace format)"), "chrome_trace",
+        FALSE);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_bool_new(
+        _("Capture core events for replay"), "capture", FALSE);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+#if !defined(TOXPRPL_NO_TRACE) && !defined(__WIN32__)
+    option = purple_account_option_bool_new(
+        _("Write the recent event trace when Pidgin crashes"), "crash_trace",
+        FALSE);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+#endif
     purple_debug_info("toxprpl", "initialization complete\n");
 }
 